@@ -3,6 +3,7 @@ import { immer } from "zustand/middleware/immer";
 import type { PanelType } from "./components/Panel";
 import type {
   BidAskStruct,
+  BookDelta,
   LimitOrder,
   LimitOrderExt,
   MessageProcessor,
@@ -28,6 +29,35 @@ interface Layout {
   type: PanelType;
 }
 
+// Applies the order events of `delta` newer than `sequence` to `book`, keeping the server's
+// order: bids by descending price, asks by ascending price, then by order id.
+const applyBookDelta = (book: OrderBook, delta: BookDelta, sequence: number) => {
+  for (const event of delta.order_events) {
+    if (event.sequence <= sequence) {
+      continue;
+    }
+    const orders = event.side === "bid" ? book.bid : book.ask;
+    if (event.event === "add") {
+      const direction = event.side === "bid" ? -1 : 1;
+      const index = orders.findIndex((el) => {
+        const s = direction * (el.price - event.order.price);
+        return s > 0 || (s === 0 && el.order_id > event.order.order_id);
+      });
+      orders.splice(index === -1 ? orders.length : index, 0, event.order);
+      continue;
+    }
+    const index = orders.findIndex((el) => el.order_id === event.order.order_id);
+    if (index === -1) {
+      continue;
+    }
+    if (event.event === "modify") {
+      orders[index].volume = event.order.volume;
+    } else {
+      orders.splice(index, 1);
+    }
+  }
+};
+
 interface GlobalState extends MessageProcessor {
   // Market state data
   is_initialized: boolean;
@@ -40,6 +70,8 @@ interface GlobalState extends MessageProcessor {
   security_info: Record<Ticker, SecurityInfo>;
   order_book_per_security: Record<Ticker, OrderBook>;
   order_book_per_security_color: Record<Ticker, OrderBookHighlight>;
+  book_sequence_per_security: Record<Ticker, number>;
+  stale_books: Ticker[]; // Books that missed a delta, waiting for a snapshot
   previous_top_bid_ask: Record<Ticker, BidAskStruct<LimitOrder | null>>;
   user_id_to_username: Record<UserID, Username>;
   portfolio: Record<Ticker, number>;
@@ -82,6 +114,8 @@ export const useGlobalStore = create<GlobalState>()(
     security_info: {},
     order_book_per_security: {},
     order_book_per_security_color: {},
+    book_sequence_per_security: {},
+    stale_books: [],
     previous_top_bid_ask: {},
     user_id_to_username: {},
     portfolio: {},
@@ -111,6 +145,8 @@ export const useGlobalStore = create<GlobalState>()(
         state.security_info = msg.security_info;
         state.order_book_per_security = msg.order_book_per_security;
         state.order_book_per_security_color = structuredClone(msg.order_book_per_security);
+        state.book_sequence_per_security = msg.book_sequence_per_security;
+        state.stale_books = [];
         state.previous_top_bid_ask = Object.entries(msg.order_book_per_security).reduce(
           (prev, curr) => {
             const ticker = curr[0];
@@ -246,8 +282,19 @@ export const useGlobalStore = create<GlobalState>()(
               return s;
             });
 
-          state.order_book_per_security[ticker].bid = msg.order_book_per_security[ticker].bid;
-          state.order_book_per_security[ticker].ask = msg.order_book_per_security[ticker].ask;
+          const delta = msg.book_deltas[ticker];
+          if (delta.previous_sequence > state.book_sequence_per_security[ticker]) {
+            if (!state.stale_books.includes(ticker)) {
+              state.stale_books.push(ticker);
+            }
+          } else {
+            applyBookDelta(
+              state.order_book_per_security[ticker],
+              delta,
+              state.book_sequence_per_security[ticker]
+            );
+            state.book_sequence_per_security[ticker] = delta.sequence;
+          }
           state.order_book_per_security_color[ticker].bid = current_book_bid_color;
           state.order_book_per_security_color[ticker].ask = current_book_ask_color;
         }
@@ -268,6 +315,16 @@ export const useGlobalStore = create<GlobalState>()(
           state.news_read.push(false);
         }
       }),
+    processMessageBookSnapshotRequest: () => {
+      throw new Error("??");
+    },
+    processMessageBookSnapshot: (msg) =>
+      set((state) => {
+        state.order_book_per_security[msg.ticker] = msg.order_book;
+        state.order_book_per_security_color[msg.ticker] = structuredClone(msg.order_book);
+        state.book_sequence_per_security[msg.ticker] = msg.sequence;
+        state.stale_books = state.stale_books.filter((ticker) => ticker !== msg.ticker);
+      }),
     processMessageNewUserConnected: (msg) =>
       set((state) => {
         state.user_id_to_username[msg.user_id] = msg.username;
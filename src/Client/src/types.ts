@@ -25,6 +25,29 @@ export type OrderBookHighlight = BidAskStruct<LimitOrderExt[]>;
 
 export type OrderBook = BidAskStruct<LimitOrder[]>;
 
+export type BookSide = "bid" | "ask";
+export type BookEventType = "add" | "modify" | "delete";
+export interface OrderEvent {
+  sequence: number;
+  event: BookEventType;
+  side: BookSide;
+  order: LimitOrder;
+}
+export interface LevelUpdate {
+  sequence: number;
+  side: BookSide;
+  price: number;
+  volume: number;
+  order_count: number;
+}
+// Events numbered above `previous_sequence` up to `sequence`
+export interface BookDelta {
+  previous_sequence: number;
+  sequence: number;
+  level_updates: LevelUpdate[];
+  order_events: OrderEvent[];
+}
+
 export interface Transaction {
   tick: number;
   price: number;
@@ -53,7 +76,9 @@ type MessageType =
   | "simulation_update"
   | "market_update"
   | "new_user_connected"
-  | "chat_message_received";
+  | "chat_message_received"
+  | "book_snapshot_request"
+  | "book_snapshot";
 interface MessageBase {
   type_: MessageType;
 }
@@ -74,6 +99,7 @@ export interface MessageSimulationLoad extends MessageBase {
   tradeable_securities: Ticker[];
   security_info: Record<Ticker, SecurityInfo>;
   order_book_per_security: Record<Ticker, OrderBook>;
+  book_sequence_per_security: Record<Ticker, number>;
   transactions: Record<Ticker, Transaction[]>;
   user_id_to_username: Record<UserID, Username>;
   portfolio: Record<Ticker, number>;
@@ -93,11 +119,21 @@ export interface MessageMarketUpdate extends MessageBase {
   submitted_orders: Record<Ticker, SubmittedOrders>;
   cancelled_orders: Record<Ticker, CancelledOrders>;
   transacted_orders: Record<Ticker, TransactedOrders>;
-  order_book_per_security: Record<Ticker, OrderBook>;
+  book_deltas: Record<Ticker, BookDelta>;
   portfolio: Record<Ticker, number>;
   new_transactions: Record<Ticker, Transaction[]>;
   new_news: News[];
 }
+export interface MessageBookSnapshotRequest extends MessageBase {
+  type_: "book_snapshot_request";
+  ticker: Ticker;
+}
+export interface MessageBookSnapshot extends MessageBase {
+  type_: "book_snapshot";
+  ticker: Ticker;
+  sequence: number;
+  order_book: OrderBook;
+}
 export interface MessageNewUserConnected extends MessageBase {
   type_: "new_user_connected";
   user_id: UserID;
@@ -115,6 +151,8 @@ type MessageMap = {
   MessageSimulationLoad: MessageSimulationLoad;
   MessageSimulationUpdate: MessageSimulationUpdate;
   MessageMarketUpdate: MessageMarketUpdate;
+  MessageBookSnapshotRequest: MessageBookSnapshotRequest;
+  MessageBookSnapshot: MessageBookSnapshot;
   MessageNewUserConnected: MessageNewUserConnected;
   MessageChatMessageReceived: MessageChatMessageReceived;
 };
@@ -1,5 +1,5 @@
 import { useGlobalStore } from "./store";
-import type { Message } from "./types";
+import type { Message, Ticker } from "./types";
 
 const WS_ENDPOINT = "http://localhost:8765";
 export const WS = new WebSocket(WS_ENDPOINT);
@@ -30,6 +30,10 @@ WS.onmessage = (event) => {
       state.processMessageSimulationUpdate(message);
     } else if (message.type_ === "market_update") {
       state.processMessageMarketUpdate(message);
+      requestStaleBookSnapshots();
+    } else if (message.type_ === "book_snapshot") {
+      requested_snapshots.delete(message.ticker);
+      state.processMessageBookSnapshot(message);
     } else if (message.type_ === "chat_message_received") {
       state.processMessageChatMessageReceived(message);
     } else if (message.type_ === "new_user_connected") {
@@ -42,9 +46,19 @@ WS.onmessage = (event) => {
   }
 };
 
-export const sendMessage = () => {
-  throw new Error("Not implemented!");
+export const sendMessage = (message: Message) => {
   if (WS.readyState === WebSocket.OPEN) {
-    // WS.send(data);
+    WS.send(JSON.stringify(message));
+  }
+};
+
+// Books that missed a delta are requested in full, once until the snapshot arrives
+const requested_snapshots = new Set<Ticker>();
+const requestStaleBookSnapshots = () => {
+  for (const ticker of useGlobalStore.getState().stale_books) {
+    if (!requested_snapshots.has(ticker)) {
+      requested_snapshots.add(ticker);
+      sendMessage({ type_: "book_snapshot_request", ticker: ticker });
+    }
   }
 };
@@ -30,6 +30,37 @@ class LimitOrder:
 class OrderBook(BidAskStruct[List[LimitOrder]]):
     pass
 
+class BookSide(Enum):
+    bid = "bid"
+    ask = "ask"
+
+class BookEventType(Enum):
+    add = "add"
+    modify = "modify"
+    delete = "delete"
+
+@dataclass
+class OrderEvent:
+    sequence: int
+    event: BookEventType
+    side: BookSide
+    order: LimitOrder
+
+@dataclass
+class LevelUpdate:
+    sequence: int
+    side: BookSide
+    price: float
+    volume: float
+    order_count: int
+
+@dataclass
+class BookDelta:
+    previous_sequence: int
+    sequence: int
+    level_updates: List[LevelUpdate]
+    order_events: List[OrderEvent]
+
 @dataclass
 class Transaction:
     tick: int
@@ -63,6 +94,8 @@ class MessageType(Enum):
     market_update = "market_update"
     new_user_connected = "new_user_connected"
     chat_message_received = "chat_message_received"
+    book_snapshot_request = "book_snapshot_request"
+    book_snapshot = "book_snapshot"
 
 @dataclass
 class MessageBase:
@@ -87,6 +120,7 @@ class MessageSimulationLoad(MessageBase):
     tradeable_securities: List[str]
     security_info: dict[str, SecurityInfo]
     order_book_per_security: dict[str, OrderBook]
+    book_sequence_per_security: dict[str, int]
     transactions: dict[str, List[Transaction]]
     user_id_to_username: dict[int, str]
     portfolio: dict[str, float]
@@ -117,12 +151,24 @@ class MessageMarketUpdate(MessageBase):
     submitted_orders: dict[str, SubmittedOrders]
     cancelled_orders: dict[str, CancelledOrders]
     transacted_orders: dict[str, TransactedOrders]
-    order_book_per_security: dict[str, OrderBook]
+    book_deltas: dict[str, BookDelta]
     portfolio: dict[str, float]
     new_transactions: dict[str, Transaction]
     new_news: List[News]
     type_: MessageType = MessageType.market_update
 
+@dataclass
+class MessageBookSnapshotRequest(MessageBase):
+    ticker: str
+    type_: MessageType = MessageType.book_snapshot_request
+
+@dataclass
+class MessageBookSnapshot(MessageBase):
+    ticker: str
+    sequence: int
+    order_book: OrderBook
+    type_: MessageType = MessageType.book_snapshot
+
 @dataclass
 class MessageNewUserConnected(MessageBase):
     user_id: int
@@ -141,6 +187,8 @@ type Message = Union[
     MessageSimulationLoad,
     MessageSimulationUpdate,
     MessageMarketUpdate,
+    MessageBookSnapshotRequest,
+    MessageBookSnapshot,
     MessageNewUserConnected,
     MessageChatMessageReceived
 ]
\ No newline at end of file
@@ -4,7 +4,7 @@ import json
 from typing import List, Tuple
 import websockets
 import python_modules.Server as Server
-from custypes import CancelledOrders, EnhancedJSONEncoder, LimitOrder, MessageLoginResponse, MessageMarketUpdate, MessageSimulationLoad, MessageSimulationUpdate, OrderBook, SecurityInfo, SimulationState, SubmittedOrders, TransactedOrders, Transaction
+from custypes import BookDelta, BookEventType, BookSide, CancelledOrders, EnhancedJSONEncoder, LevelUpdate, LimitOrder, MessageBookSnapshot, MessageLoginResponse, MessageMarketUpdate, MessageSimulationLoad, MessageSimulationUpdate, MessageType, OrderBook, OrderEvent, SecurityInfo, SimulationState, SubmittedOrders, TransactedOrders, Transaction
 import numpy as np
 
 def limit_order_convert(order: Server.LimitOrder) -> LimitOrder:
@@ -15,6 +15,40 @@ def limit_order_convert(order: Server.LimitOrder) -> LimitOrder:
         user_id=order.user_id
     )
 
+def book_side_convert(side: Server.OrderSide) -> BookSide:
+    return BookSide.bid if side == Server.OrderSide.BID else BookSide.ask
+
+book_event_type_convert = {
+    Server.BookEventType.ADD: BookEventType.add,
+    Server.BookEventType.MODIFY: BookEventType.modify,
+    Server.BookEventType.DELETE: BookEventType.delete,
+}
+
+def book_delta_convert(delta: Server.BookDelta) -> BookDelta:
+    return BookDelta(
+        previous_sequence=delta.previous_sequence,
+        sequence=delta.sequence,
+        level_updates=[LevelUpdate(
+            sequence=update.sequence,
+            side=book_side_convert(update.side),
+            price=update.price,
+            volume=update.volume,
+            order_count=update.order_count
+        ) for update in delta.level_updates],
+        order_events=[OrderEvent(
+            sequence=event.sequence,
+            event=book_event_type_convert[event.type],
+            side=book_side_convert(event.order.side),
+            order=limit_order_convert(event.order)
+        ) for event in delta.order_events]
+    )
+
+def book_snapshot_convert(snapshot: Server.BookSnapshot) -> OrderBook:
+    return OrderBook(
+        bid=[limit_order_convert(l) for l in snapshot.book[0]],
+        ask=[limit_order_convert(l) for l in snapshot.book[1]]
+    )
+
 def volatility_strength_func(tick: int, t: float, dt: float):
     if 0 <= tick < 200:
         return 0.5
@@ -87,7 +121,7 @@ class StepResult:
     submitted_orders: dict[str, SubmittedOrders]
     cancelled_orders: dict[str, CancelledOrders]
     transacted_orders: dict[str, TransactedOrders]
-    order_book_per_security: dict[str, OrderBook]
+    book_deltas: dict[str, BookDelta]
     portfolios: List[List[float]]
     new_transactions: dict[str, List[Transaction]]
     pass
@@ -121,6 +155,8 @@ class SimulationBiotech:
         )
         self.currency_id = self.simulation.get_security_id("CAD")
         self.stock_id = self.simulation.get_security_id("BIOTECH")
+        # Prices are sent to clients with 2 decimal places, so match the book to it
+        self.simulation.set_tick_size(self.stock_id, 0.01)
         self.anon_id = self.simulation.add_user("AGENT")
         
         self.initial_price = 100.0
@@ -173,9 +209,13 @@ class SimulationBiotech:
             combined_orders: List[Tuple[Server.OrderSide, float, float]] = bids + asks
             self.rng.shuffle(combined_orders)
 
-            for (side, price, volume) in combined_orders:
-                self.simulation.direct_insert_limit_order(self.anon_id, self.stock_id, side, round(price, 2), volume)
-                pass
+            self.simulation.bulk_insert_limit_orders(
+                self.anon_id,
+                self.stock_id,
+                np.array([int(side) for (side, _, _) in combined_orders], dtype=np.uint8),
+                np.round([price for (_, price, _) in combined_orders], 2),
+                np.array([volume for (_, _, volume) in combined_orders]),
+            )
             pass
         else:
             order_count = 5
@@ -183,10 +223,8 @@ class SimulationBiotech:
             orders_ANON = list(self.simulation.get_all_open_user_orders(self.anon_id, self.stock_id))
             # Remove some percent of ANON orders
             if (k := int(len(orders_ANON) * self.removal_percentage)) > 0:
-                orders_to_remove = list(self.rng.choice(a=orders_ANON, size=k, replace=False))
-                for order_id in orders_to_remove:
-                    self.simulation.submit_cancel_order(self.anon_id, self.stock_id, order_id)
-                    pass
+                orders_to_remove = self.rng.choice(a=orders_ANON, size=k, replace=False)
+                self.simulation.submit_cancel_orders(np.full(k, self.anon_id), np.full(k, self.stock_id), orders_to_remove)
                 pass
             
             if self.simulation.get_bid_count(self.stock_id) > 0 and self.simulation.get_ask_count(self.stock_id) > 0:
@@ -211,7 +249,6 @@ class SimulationBiotech:
                 * self.rng.normal(loc=0.0, scale=1.0, size=order_count)
             )
             bid_quantities = self.rng.integers(ORDER_SIZE_MIN, ORDER_SIZE_MAX, size=order_count)
-            bids = [(Server.OrderSide.BID, price, bid_quantities[i]) for i, price in enumerate(bid_prices)]
             
             ask_prices = (
                 top_bid_price + SPREAD
@@ -221,14 +258,13 @@ class SimulationBiotech:
                 * self.rng.normal(loc=0.0, scale=1.0, size=order_count)
             )
             ask_quantities = self.rng.integers(ORDER_SIZE_MIN, ORDER_SIZE_MAX, size=order_count) 
-            asks = [(Server.OrderSide.ASK, price, ask_quantities[i]) for i, price in enumerate(ask_prices)]
             
-            combined_orders: List[Tuple[Server.OrderSide, float, float]] = bids + asks
-            self.rng.shuffle(combined_orders)
-
-            for (side, price, volume) in combined_orders:
-                self.simulation.submit_limit_order(self.anon_id, self.stock_id, side, round(price, 2), volume)
-                pass
+            # Bids and asks are submitted in a random order, in one batch
+            shuffled = self.rng.permutation(2 * order_count)
+            sides = np.repeat([int(Server.OrderSide.BID), int(Server.OrderSide.ASK)], order_count)[shuffled]
+            prices = np.round(np.concatenate([bid_prices, ask_prices]), 2)[shuffled]
+            volumes = np.concatenate([bid_quantities, ask_quantities])[shuffled]
+            self.simulation.submit_limit_orders(np.full(2 * order_count, self.anon_id), np.full(2 * order_count, self.stock_id), sides, prices, volumes)
             pass
         
         results = self.simulation.do_simulation_step()
@@ -265,21 +301,15 @@ class SimulationBiotech:
             list(pair.items())
          for (ticker, pair) in results.v2_transacted_orders.items()}
         
-        ob = [
-            (ticker, current_case.simulation.get_order_book(current_case.simulation.get_security_id(ticker)))
-            for ticker in current_case.simulation.get_all_tickers()
-        ]
-        kob = {ticker: OrderBook(
-            bid=[limit_order_convert(l) for l in book[0]],
-            ask=[limit_order_convert(l) for l in book[1]] 
-        ) for ticker, book in ob}
+        # Clients keep their books up to date from the deltas, full books are only sent on load or request
+        deltas = {ticker: book_delta_convert(delta) for (ticker, delta) in results.book_deltas.items()}
         
         return done, StepResult(
             tick=self.simulation.get_tick(),
             submitted_orders=w2,
             cancelled_orders=results.v2_cancelled_orders,
             transacted_orders=to,
-            order_book_per_security=kob,
+            book_deltas=deltas,
             portfolios=results.portfolios,
             new_transactions={ticker: [
                 Transaction(
@@ -292,6 +322,16 @@ class SimulationBiotech:
             ] for ticker, transactions in results.transactions.items()}
         )
     
+    def get_book_snapshots(self) -> Tuple[dict[str, OrderBook], dict[str, int]]:
+        snapshots = {
+            ticker: self.simulation.get_book_snapshot(self.simulation.get_security_id(ticker))
+            for ticker in self.simulation.get_all_tickers()
+        }
+        return (
+            {ticker: book_snapshot_convert(snapshot) for ticker, snapshot in snapshots.items()},
+            {ticker: snapshot.sequence for ticker, snapshot in snapshots.items()}
+        )
+    
     def reset(self):
         self.simulation.reset_simulation()
         base_path, had_good_preliminary, had_good_fda = get_base_path(
@@ -326,20 +366,14 @@ async def step_loop():
     while True:
         if case_state == SimulationState.running:
             try:
-                is_done, result = current_case.step()
+                # The engine releases the GIL while it steps, so the websocket handlers keep running meanwhile
+                is_done, result = await asyncio.to_thread(current_case.step)
                 
                 for (client_id, socket) in client_id_to_socket.items():
                     user_id = client_id_to_user_id[client_id]
                     
                     if result.tick - 1 == 0:
-                        ob = [
-                            (ticker, current_case.simulation.get_order_book(current_case.simulation.get_security_id(ticker)))
-                            for ticker in current_case.simulation.get_all_tickers()
-                        ]
-                        kob = {ticker: OrderBook(
-                            bid=[limit_order_convert(l) for l in book[0]],
-                            ask=[limit_order_convert(l) for l in book[1]]    
-                        ) for ticker, book in ob}
+                        kob, sequences = current_case.get_book_snapshots()
                         por = current_case.simulation.get_user_portfolio(user_id)
                         pok = {ticker: por[current_case.simulation.get_security_id(ticker)] for ticker in current_case.simulation.get_all_tickers()}
                         transactions = result.new_transactions
@@ -358,6 +392,7 @@ async def step_loop():
                                 max_trade_volume=20
                             ) for ticker in current_case.simulation.get_all_tickers()},
                             order_book_per_security=kob,
+                            book_sequence_per_security=sequences,
                             transactions=transactions,
                             user_id_to_username=current_case.simulation.get_user_id_to_username(),
                             portfolio=pok,
@@ -379,7 +414,7 @@ async def step_loop():
                             submitted_orders=result.submitted_orders,
                             cancelled_orders=result.cancelled_orders,
                             transacted_orders=result.transacted_orders,
-                            order_book_per_security=result.order_book_per_security,
+                            book_deltas=result.book_deltas,
                             portfolio={current_case.simulation.get_security_ticker(index): holdings for index, holdings in enumerate(result.portfolios[user_id])},
                             new_transactions=result.new_transactions,
                             new_news=[],
@@ -390,7 +425,7 @@ async def step_loop():
                     pass
                 
                 if is_done:
-                    current_case.reset()
+                    await asyncio.to_thread(current_case.reset)
                 pass
             except Exception as e:
                 print(f"[STEP LOOP] Encountered exception: {e}")
@@ -406,6 +441,22 @@ async def step_loop():
             pass
         await asyncio.sleep(1.0/4.0)
 
+async def handle_client_message(websocket: websockets.WebSocketServerProtocol, client_id: int, message: str):
+    msg = json.loads(message)
+    if msg.get("type_") == MessageType.book_snapshot_request.value:
+        # A client missed a delta (its sequence numbers have a gap), resend the whole book
+        ticker = msg["ticker"]
+        snapshot = current_case.simulation.get_book_snapshot(current_case.simulation.get_security_id(ticker))
+        await websocket.send(json.dumps(MessageBookSnapshot(
+            ticker=ticker,
+            sequence=snapshot.sequence,
+            order_book=book_snapshot_convert(snapshot)
+        ), cls=EnhancedJSONEncoder))
+        pass
+    elif case_state == SimulationState.running:
+        await current_case.handle_message(client_id, message)
+        pass
+
 async def handle_client(websocket: websockets.WebSocketServerProtocol, path: str):
     client_id = id(websocket)
     client_id_to_socket[client_id] = websocket
@@ -417,14 +468,7 @@ async def handle_client(websocket: websockets.WebSocketServerProtocol, path: str
         
         await websocket.send(json.dumps(MessageLoginResponse(user_id=user_id), cls=EnhancedJSONEncoder))
 
-        ob = [
-            (ticker, current_case.simulation.get_order_book(current_case.simulation.get_security_id(ticker)))
-            for ticker in current_case.simulation.get_all_tickers()
-        ]
-        kob = {ticker: OrderBook(
-            bid=[limit_order_convert(l) for l in book[0]],
-            ask=[limit_order_convert(l) for l in book[1]]    
-        ) for ticker, book in ob}
+        kob, sequences = current_case.get_book_snapshots()
         por = current_case.simulation.get_user_portfolio(user_id)
         pok = {ticker: por[current_case.simulation.get_security_id(ticker)] for ticker in current_case.simulation.get_all_tickers()}
         
@@ -442,6 +486,7 @@ async def handle_client(websocket: websockets.WebSocketServerProtocol, path: str
                 max_trade_volume=20
             ) for ticker in current_case.simulation.get_all_tickers()},
             order_book_per_security=kob,
+            book_sequence_per_security=sequences,
             transactions={ticker: [] for ticker in current_case.simulation.get_all_tickers()},
             user_id_to_username=current_case.simulation.get_user_id_to_username(),
             portfolio=pok,
@@ -451,9 +496,8 @@ async def handle_client(websocket: websockets.WebSocketServerProtocol, path: str
         await websocket.send(json.dumps(load, cls=EnhancedJSONEncoder))
         
         async for message in websocket:
-            if case_state == SimulationState.running:
-                current_case.handle_message(message, websocket)
-                pass
+            await handle_client_message(websocket, client_id, message)
+            pass
     except websockets.exceptions.ConnectionClosed:
         print(f"[Server] Client {client_id} disconnected.")
     except Exception as e:
@@ -0,0 +1,192 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include <bit>
+
+// Maps order ids to the handle of a resting order.
+// Order ids are handed out by a single increasing counter, so they are dense and can index
+// a flat table directly. The table is split into fixed size chunks; a chunk is released once
+// every order in it has reached a terminal state (filled or cancelled), so memory follows the
+// window of live ids rather than the total number of ids ever issued. Released chunks are kept
+// for reuse, so once the window has reached its usual width the locator no longer allocates.
+template<typename Handle>
+class OrderLocator {
+	static constexpr uint32_t CHUNK_BITS = 12;
+	static constexpr uint32_t CHUNK_SIZE = uint32_t(1) << CHUNK_BITS;
+	static constexpr uint32_t CHUNK_MASK = CHUNK_SIZE - 1;
+	static constexpr uint32_t WORDS_PER_CHUNK = CHUNK_SIZE / 64;
+	static constexpr std::size_t MAX_SPARE_CHUNKS = 4;
+
+	struct Chunk {
+		Handle handles[CHUNK_SIZE];
+		uint64_t occupied[WORDS_PER_CHUNK] = {};
+		uint32_t live = 0;
+	};
+
+	std::vector<std::unique_ptr<Chunk>> chunks = {}; // chunks[i] holds the ids of chunk `first_chunk + i`
+	std::vector<std::unique_ptr<Chunk>> spare_chunks = {};
+	std::size_t live_count = 0;
+	uint32_t first_chunk = 0;
+	uint32_t newest_chunk = 0;
+
+	static bool is_occupied(const Chunk& chunk, uint32_t slot) noexcept {
+		return (chunk.occupied[slot >> 6] >> (slot & 63)) & 1;
+	}
+
+	Chunk* get_chunk(uint32_t id) const noexcept {
+		auto index = id >> CHUNK_BITS;
+		if (index < first_chunk || index - first_chunk >= chunks.size()) {
+			return nullptr;
+		}
+		return chunks[index - first_chunk].get();
+	}
+
+	std::unique_ptr<Chunk> acquire_chunk() {
+		if (spare_chunks.empty()) {
+			return std::make_unique<Chunk>();
+		}
+		auto chunk = std::move(spare_chunks.back());
+		spare_chunks.pop_back();
+		return chunk;
+	}
+
+	void release_chunk(uint32_t index) noexcept {
+		// Keep a few empty chunks around so a busy book does not allocate on every chunk boundary
+		auto& chunk = chunks[index - first_chunk];
+		if (spare_chunks.size() < MAX_SPARE_CHUNKS) {
+			spare_chunks.push_back(std::move(chunk));
+		}
+		else {
+			chunk.reset();
+		}
+		// Drop the released chunks at the front, so the table only spans the live window
+		auto released = std::find_if(chunks.begin(), chunks.end(), [](const auto& c) { return c != nullptr; }) - chunks.begin();
+		chunks.erase(chunks.begin(), chunks.begin() + released);
+		first_chunk += uint32_t(released);
+	}
+public:
+	std::size_t size() const noexcept {
+		return live_count;
+	}
+
+	// The chunks holding ids, not counting the spare ones
+	std::size_t chunk_count() const noexcept {
+		return std::count_if(chunks.begin(), chunks.end(), [](const auto& chunk) { return chunk != nullptr; });
+	}
+
+	// The emptied chunks kept for reuse
+	std::size_t spare_chunk_count() const noexcept {
+		return spare_chunks.size();
+	}
+
+	bool contains(uint32_t id) const noexcept {
+		auto chunk = get_chunk(id);
+		return chunk != nullptr && is_occupied(*chunk, id & CHUNK_MASK);
+	}
+
+	// Returns `nullptr` if the id is not in the locator
+	Handle* find(uint32_t id) const noexcept {
+		auto chunk = get_chunk(id);
+		if (chunk == nullptr || !is_occupied(*chunk, id & CHUNK_MASK)) {
+			return nullptr;
+		}
+		return &chunk->handles[id & CHUNK_MASK];
+	}
+
+	// Returns `false` if the id is already in the locator
+	bool insert(uint32_t id, const Handle& handle) {
+		auto index = id >> CHUNK_BITS;
+		if (index > newest_chunk && !chunks.empty()) {
+			// The newest chunk is done being filled, its orders may all be gone already
+			auto previous = get_chunk(newest_chunk << CHUNK_BITS);
+			if (previous != nullptr && previous->live == 0) {
+				release_chunk(newest_chunk);
+			}
+		}
+		if (chunks.empty()) {
+			first_chunk = index;
+		}
+		else if (index < first_chunk) {
+			// An old id, e.g. a queued order overtaken by newer ones
+			auto shift = first_chunk - index;
+			chunks.resize(chunks.size() + shift);
+			std::move_backward(chunks.begin(), chunks.end() - shift, chunks.end());
+			first_chunk = index;
+		}
+		if (index - first_chunk >= chunks.size()) {
+			chunks.resize(std::size_t(index - first_chunk) + 1);
+		}
+		auto& chunk = chunks[index - first_chunk];
+		if (chunk == nullptr) {
+			chunk = acquire_chunk();
+		}
+		auto slot = id & CHUNK_MASK;
+		if (is_occupied(*chunk, slot)) {
+			return false;
+		}
+		chunk->handles[slot] = handle;
+		chunk->occupied[slot >> 6] |= uint64_t(1) << (slot & 63);
+		chunk->live += 1;
+		live_count += 1;
+		newest_chunk = std::max(newest_chunk, index);
+		return true;
+	}
+
+	// Returns `false` if the id was not in the locator
+	bool erase(uint32_t id) noexcept {
+		auto index = id >> CHUNK_BITS;
+		auto chunk = get_chunk(id);
+		auto slot = id & CHUNK_MASK;
+		if (chunk == nullptr || !is_occupied(*chunk, slot)) {
+			return false;
+		}
+		chunk->occupied[slot >> 6] &= ~(uint64_t(1) << (slot & 63));
+		chunk->live -= 1;
+		live_count -= 1;
+		// The newest chunk is still being filled, releasing it would only thrash the allocator.
+		// `insert` releases it once a newer chunk is started.
+		if (chunk->live == 0 && index < newest_chunk) {
+			release_chunk(index);
+		}
+		return true;
+	}
+
+	// Keeps up to `MAX_SPARE_CHUNKS` of the chunks for the ids that follow, emptied
+	void clear() noexcept {
+		for (auto& chunk : chunks) {
+			if (chunk != nullptr && spare_chunks.size() < MAX_SPARE_CHUNKS) {
+				std::fill(std::begin(chunk->occupied), std::end(chunk->occupied), uint64_t(0));
+				chunk->live = 0;
+				spare_chunks.push_back(std::move(chunk));
+			}
+		}
+		chunks.clear();
+		live_count = 0;
+		first_chunk = 0;
+		newest_chunk = 0;
+	}
+
+	// Visits every (id, handle) pair in increasing id order
+	template<typename F>
+	void for_each(F&& callback) const {
+		for (uint32_t offset = 0; offset < chunks.size(); offset++) {
+			const auto& chunk = chunks[offset];
+			if (chunk == nullptr) {
+				continue;
+			}
+			auto index = first_chunk + offset;
+			for (uint32_t word = 0; word < WORDS_PER_CHUNK; word++) {
+				auto bits = chunk->occupied[word];
+				while (bits != 0) {
+					auto slot = word * 64 + uint32_t(std::countr_zero(bits));
+					callback((index << CHUNK_BITS) | slot, chunk->handles[slot]);
+					bits &= bits - 1;
+				}
+			}
+		}
+	}
+};
@@ -1,22 +1,40 @@
 // Server.cpp : Defines the entry point for the application.
 //
 #include "SingleThreadedTraderRank.hpp"
+#include "OrderLocator.hpp"
+#include "ThreadPool.hpp"
 
 #include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+#include <cmath>
+#include <new>
+#include <bit>
 #include <iostream>
 #include <algorithm>
+#include <numeric>
 #include <shared_mutex>
 #include <mutex>
+#include <thread>
 #include <atomic>
 #include <memory>
+#include <memory_resource>
+#include <optional>
+#include <limits>
+#include <utility>
 #include <variant>
+#include <span>
 #include <vector>
 #include <queue>
+#include <deque>
 #include <map>
 #include <unordered_map>
 #include <set>
 #include <unordered_set>
 #include <functional>
+#include <random>
+#include <chrono>
+#include <condition_variable>
 #include <exception>
 #include <stdexcept>
 #include <source_location>
@@ -25,12 +43,65 @@
 #include <nlohmann/json.hpp>
 // TODO: investigate if we should use https://github.com/johnmcfarlane/cnl instead of float/double
 
+// The engine tests build this file with `TRADERRANK_ENGINE_ONLY`, leaving out the Python bindings
+#ifndef TRADERRANK_ENGINE_ONLY
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 #include <pybind11/stl_bind.h>
 #include <pybind11/functional.h>
+#include <pybind11/numpy.h>
 
 namespace py = pybind11;
+#endif
+
+#ifdef TRADERRANK_COUNT_ALLOCATIONS
+// Test mode: count every heap allocation made by this module, so that a steady state
+// simulation step can be checked to not touch the heap
+std::atomic<uint64_t> heap_allocation_count = 0;
+
+// The plain `operator new` and `operator delete` are kept out of line, once inlined GCC pairs their `malloc` and
+// `free` with the `new` and `delete` of the callers and warns of mismatched deallocations. The other overloads
+// forward to them
+[[gnu::noinline]] void *operator new(std::size_t size)
+{
+	heap_allocation_count.fetch_add(1, std::memory_order_relaxed);
+	if (auto pointer = std::malloc(size == 0 ? 1 : size))
+	{
+		return pointer;
+	}
+	throw std::bad_alloc();
+}
+void *operator new[](std::size_t size)
+{
+	return operator new(size);
+}
+[[gnu::noinline]] void operator delete(void *pointer) noexcept
+{
+	std::free(pointer);
+}
+void operator delete[](void *pointer) noexcept
+{
+	operator delete(pointer);
+}
+void operator delete(void *pointer, std::size_t) noexcept
+{
+	operator delete(pointer);
+}
+void operator delete[](void *pointer, std::size_t) noexcept
+{
+	operator delete(pointer);
+}
+
+uint64_t get_heap_allocation_count() noexcept
+{
+	return heap_allocation_count.load(std::memory_order_relaxed);
+}
+#else
+constexpr uint64_t get_heap_allocation_count() noexcept
+{
+	return 0;
+}
+#endif
 
 struct IDNotFoundError : std::out_of_range
 {
@@ -98,998 +169,3584 @@ struct QueueCapturingMarketOrder
 };
 using OrderVariant = std::variant<LimitOrder, CancelOrder, MarketOrder, QueueCapturingMarketOrder>;
 
+// How the orders queued during a step are executed
+enum class MatchingMode : uint8_t
+{
+	CONTINUOUS,	 // Each order is matched against the book as it is processed, in submission order
+	CALL_AUCTION // All of the orders of the step are collected, then cleared at a single price
+};
+
 // (bid, ask) pair of depths
 using BookDepth = std::pair<std::map<float, float>, std::map<float, float>>;
 using FlatOrderBook = std::pair<std::vector<LimitOrder>, std::vector<LimitOrder>>;
-class OrderBook
-{
-	using BidSet = std::set<LimitOrder, LimitOrder::BidComparator>;
-	using AskSet = std::set<LimitOrder, LimitOrder::AskComparator>;
 
-	BidSet bid_orders;
-	AskSet ask_orders;
-	std::map<OrderID, BidSet::iterator> bid_map;
-	std::map<OrderID, AskSet::iterator> ask_map;
+enum class BookEventType : uint8_t
+{
+	ADD,
+	MODIFY,
+	DELETE
+};
+// An order level (L3) change of a book. `order` is the order after the change,
+// or as it was when removed for `DELETE` (filled or cancelled).
+struct OrderEvent
+{
+	uint64_t sequence;
+	BookEventType type;
+	LimitOrder order;
+};
+// A price level (L2) change of a book, a `volume` and `order_count` of 0 means the level is gone
+struct LevelUpdate
+{
+	uint64_t sequence; // Sequence number of the order event that caused the change
+	OrderSide side;
+	float price;
+	float volume;
+	uint32_t order_count;
+};
+// The changes of a book between two sequence numbers. Applying `order_events` (or `level_updates`)
+// with a sequence number above `previous_sequence` to a book at `previous_sequence` gives the book at `sequence`.
+struct BookDelta
+{
+	uint64_t previous_sequence;
+	uint64_t sequence;
+	std::vector<LevelUpdate> level_updates; // Only the last update of each level, bids then asks by ascending price
+	std::vector<OrderEvent> order_events;
+};
+struct BookSnapshot
+{
+	uint64_t sequence;
+	FlatOrderBook book;
+};
+// A resting order as exported to a numpy structured array, the side is given by the array it is in
+struct OrderRecord
+{
+	OrderID order_id;
+	UserID user_id;
+	float price;
+	float volume;
+};
 
-public:
-	std::size_t bid_size() const
+// Makes room for `size` elements in a buffer refilled every step. Its capacity grows geometrically rather than to
+// the exact size, so a peak that keeps creeping up reallocates a few times instead of on every new maximum.
+template <typename Buffer>
+void reserve_reusing(Buffer &buffer, std::size_t size)
+{
+	if (buffer.capacity() < size)
 	{
-		return bid_orders.size();
+		buffer.reserve(std::max(size, buffer.capacity() * 2));
 	}
+}
 
-	std::size_t ask_size() const
+// Replaces the contents of a buffer refilled every step, growing it as `reserve_reusing`
+template <typename Buffer, typename Values>
+void assign_reusing(Buffer &buffer, const Values &values)
+{
+	buffer.clear();
+	reserve_reusing(buffer, values.size());
+	buffer.assign(values.begin(), values.end());
+}
+
+// Hands out fixed size blocks carved from larger slabs. Freed blocks go on a free list and are
+// reused by the next allocation, memory is only returned to the system when the pool is destroyed.
+// Slabs are carved one block at a time, so `clear` can take back every block without visiting them.
+class BlockPool
+{
+	static constexpr std::size_t BLOCKS_PER_SLAB = 256;
+
+	std::size_t block_size;
+	std::vector<std::unique_ptr<std::byte[]>> slabs = {};
+	void *free_list = nullptr;
+	std::size_t next_slab = 0; // Slabs from this one on are not carved yet
+	std::byte *carve_next = nullptr;
+	std::byte *carve_end = nullptr;
+
+public:
+	// A `block_size` of 0 is fixed by the first call to `accepts`
+	explicit BlockPool(std::size_t block_size = 0) : block_size{0}
 	{
-		return ask_orders.size();
+		if (block_size > 0)
+		{
+			accepts(block_size);
+		}
 	}
-
-	bool has_order(OrderID order_id)
+	BlockPool(const BlockPool &) = delete;
+	BlockPool &operator=(const BlockPool &) = delete;
+	BlockPool(BlockPool &&other) noexcept : block_size{other.block_size},
+											slabs{std::move(other.slabs)},
+											free_list{std::exchange(other.free_list, nullptr)},
+											next_slab{std::exchange(other.next_slab, 0)},
+											carve_next{std::exchange(other.carve_next, nullptr)},
+											carve_end{std::exchange(other.carve_end, nullptr)} {}
+	BlockPool &operator=(BlockPool &&other) noexcept
 	{
-		return bid_map.find(order_id) != bid_map.end() || ask_map.find(order_id) != ask_map.end();
+		block_size = other.block_size;
+		slabs = std::move(other.slabs);
+		free_list = std::exchange(other.free_list, nullptr);
+		next_slab = std::exchange(other.next_slab, 0);
+		carve_next = std::exchange(other.carve_next, nullptr);
+		carve_end = std::exchange(other.carve_end, nullptr);
+		return *this;
 	}
 
-	bool insert_order(const LimitOrder &order)
+	// Whether objects of `size` bytes can be allocated from this pool
+	bool accepts(std::size_t size) noexcept
 	{
-		if (order.side == OrderSide::BID)
-		{
-			auto [it, inserted] = bid_orders.insert(order);
-			if (!inserted)
-				return false;
-			bid_map[order.order_id] = it;
-		}
-		else
+		if (block_size == 0)
 		{
-			auto [it, inserted] = ask_orders.insert(order);
-			if (!inserted)
-				return false;
-			ask_map[order.order_id] = it;
+			constexpr auto alignment = alignof(std::max_align_t);
+			block_size = (std::max(size, sizeof(void *)) + alignment - 1) / alignment * alignment;
 		}
-		return true;
+		return size <= block_size;
 	}
 
-	bool cancel_order(const CancelOrder &cancel)
+	void *allocate()
 	{
-		if (auto it = bid_map.find(cancel.order_id); it != bid_map.end())
+		if (free_list != nullptr)
 		{
-			bid_orders.erase(it->second);
-			bid_map.erase(it);
-			return true;
+			auto block = free_list;
+			free_list = *static_cast<void **>(block);
+			return block;
 		}
-		else if (auto it = ask_map.find(cancel.order_id); it != ask_map.end())
+		if (carve_next == carve_end)
 		{
-			ask_orders.erase(it->second);
-			ask_map.erase(it);
-			return true;
+			// Slabs kept by `clear` are carved again before new ones are added
+			if (next_slab == slabs.size())
+			{
+				slabs.emplace_back(new std::byte[block_size * BLOCKS_PER_SLAB]);
+			}
+			carve_next = slabs[next_slab].get();
+			carve_end = carve_next + block_size * BLOCKS_PER_SLAB;
+			next_slab += 1;
 		}
-		return false;
+		auto block = carve_next;
+		carve_next += block_size;
+		return block;
 	}
 
-	LimitOrder &top_bid() const
+	void deallocate(void *block) noexcept
 	{
-		if (bid_orders.empty())
-		{
-			throw std::runtime_error("Bid book is empty.");
-		}
-		return const_cast<LimitOrder &>(*bid_orders.begin());
+		*static_cast<void **>(block) = free_list;
+		free_list = block;
 	}
 
-	LimitOrder &top_ask() const
+	// Takes back every block at once, the slabs are kept for the next allocations
+	void clear() noexcept
 	{
-		if (ask_orders.empty())
-		{
-			throw std::runtime_error("Ask book is empty.");
-		}
-		return const_cast<LimitOrder &>(*ask_orders.begin());
+		free_list = nullptr;
+		next_slab = 0;
+		carve_next = nullptr;
+		carve_end = nullptr;
 	}
+};
 
-	void pop_top_bid()
+// Node allocator for standard containers, single objects come from a `BlockPool` shared by every
+// copy of the allocator. The pool is owned jointly, so a moved from container stays valid.
+template <typename T>
+class PoolAllocator
+{
+	template <typename U>
+	friend class PoolAllocator;
+
+	std::shared_ptr<BlockPool> pool;
+
+public:
+	using value_type = T;
+	using propagate_on_container_copy_assignment = std::true_type;
+	using propagate_on_container_move_assignment = std::true_type;
+	using propagate_on_container_swap = std::true_type;
+
+	PoolAllocator() : pool{std::make_shared<BlockPool>()} {}
+	template <typename U>
+	PoolAllocator(const PoolAllocator<U> &other) noexcept : pool{other.pool} {}
+
+	T *allocate(std::size_t n)
 	{
-		if (bid_orders.empty())
+		if (n == 1 && pool->accepts(sizeof(T)))
 		{
-			throw std::runtime_error("Bid book is empty.");
+			return static_cast<T *>(pool->allocate());
 		}
-		auto it = bid_orders.begin();
-		bid_map.erase(it->order_id);
-		bid_orders.erase(it);
+		return std::allocator<T>().allocate(n);
 	}
 
-	void pop_top_ask()
+	void deallocate(T *pointer, std::size_t n) noexcept
 	{
-		if (ask_orders.empty())
+		if (n == 1 && pool->accepts(sizeof(T)))
 		{
-			throw std::runtime_error("Ask book is empty.");
+			pool->deallocate(pointer);
+			return;
 		}
-		auto it = ask_orders.begin();
-		ask_map.erase(it->order_id);
-		ask_orders.erase(it);
+		std::allocator<T>().deallocate(pointer, n);
 	}
 
-	BookDepth get_book_depth() const
+	template <typename U>
+	bool operator==(const PoolAllocator<U> &other) const noexcept
 	{
-		std::map<float, float> bid_depth;
-		std::map<float, float> ask_depth;
+		return pool == other.pool;
+	}
+};
 
-		// For bids, accumulate by descending price
-		float accumulated_bid_depth = 0.0f;
-		for (const auto &order : bid_orders)
-		{
-			accumulated_bid_depth += order.volume;
-			bid_depth[order.price] = accumulated_bid_depth;
-		}
+struct PriceLevel;
 
-		// For asks, accumulate by ascending price
-		float accumulated_ask_depth = 0.0f;
-		for (const auto &order : ask_orders)
-		{
-			accumulated_ask_depth += order.volume;
-			ask_depth[order.price] = accumulated_ask_depth;
-		}
+// A resting order, intrusively linked into the FIFO of its price level and into the list of its user's orders
+struct OrderNode
+{
+	LimitOrder order;
+	OrderNode *prev = nullptr;
+	OrderNode *next = nullptr;
+	OrderNode *user_prev = nullptr;
+	OrderNode *user_next = nullptr;
+	PriceLevel *level = nullptr;
+};
 
-		return {bid_depth, ask_depth};
+// Intrusive list of order nodes threaded through the `Prev`/`Next` links, oldest first
+template <OrderNode *OrderNode::*Prev, OrderNode *OrderNode::*Next>
+struct OrderList
+{
+	OrderNode *head = nullptr;
+	OrderNode *tail = nullptr;
+	uint32_t count = 0;
+
+	bool empty() const noexcept
+	{
+		return head == nullptr;
 	}
 
-	FlatOrderBook get_limit_orders() const
+	// Time priority is given by the order id, orders almost always arrive with
+	// increasing ids so this is O(1) except when a direct insert overtakes a queued order.
+	void insert(OrderNode *node) noexcept
 	{
-		std::vector<LimitOrder> bids(bid_orders.begin(), bid_orders.end());
-		std::vector<LimitOrder> asks(ask_orders.begin(), ask_orders.end());
-		return {std::move(bids), std::move(asks)};
+		auto after = tail;
+		while (after != nullptr && after->order.order_id > node->order.order_id)
+		{
+			after = after->*Prev;
+		}
+		node->*Prev = after;
+		node->*Next = after != nullptr ? after->*Next : head;
+		if (node->*Next != nullptr)
+		{
+			(node->*Next)->*Prev = node;
+		}
+		else
+		{
+			tail = node;
+		}
+		if (after != nullptr)
+		{
+			after->*Next = node;
+		}
+		else
+		{
+			head = node;
+		}
+		count += 1;
 	}
 
-	std::set<OrderID> get_all_user_orders(UserID user_id) const
+	void unlink(OrderNode *node) noexcept
 	{
-		std::set<OrderID> result;
-		for (const auto &[order_id, it] : bid_map)
+		if (node->*Prev != nullptr)
 		{
-			if (it->user_id == user_id)
-			{
-				result.insert(order_id);
-			}
+			(node->*Prev)->*Next = node->*Next;
 		}
-		for (const auto &[order_id, it] : ask_map)
+		else
 		{
-			if (it->user_id == user_id)
-			{
-				result.insert(order_id);
-			}
+			head = node->*Next;
 		}
-		return result;
+		if (node->*Next != nullptr)
+		{
+			(node->*Next)->*Prev = node->*Prev;
+		}
+		else
+		{
+			tail = node->*Prev;
+		}
+		node->*Prev = nullptr;
+		node->*Next = nullptr;
+		count -= 1;
 	}
 };
 
-struct Transaction
+using LevelQueue = OrderList<&OrderNode::prev, &OrderNode::next>;
+using UserOrderList = OrderList<&OrderNode::user_prev, &OrderNode::user_next>;
+
+// All resting orders at a single price
+struct PriceLevel
 {
 	float price;
-	float volume;
-	UserID buyer_id;
-	UserID seller_id;
-	OrderID buyer_order_id;
-	OrderID seller_order_id;
+	int64_t tick = 0; // Only meaningful for books with a tick size
+	LevelQueue orders;
+	double volume = 0.0; // Total volume of `orders`, kept up to date by the book on every insert, fill and cancel
+
+	bool empty() const noexcept
+	{
+		return orders.empty();
+	}
 };
 
-struct SimulationStepResult
+// Price levels of one side of a book with unrestricted `float` prices, sorted best first
+template <typename Compare>
+class LevelMap
 {
-	std::map<SecurityTicker, std::map<OrderID, float>> partially_transacted_orders;
-	std::map<SecurityTicker, std::set<OrderID>> fully_transacted_orders;
-	std::map<SecurityTicker, std::set<OrderID>> cancelled_orders;
-	std::map<SecurityTicker, std::vector<Transaction>> transactions;
-	std::map<SecurityTicker, BookDepth> order_book_depth_per_security;
-	std::map<SecurityTicker, FlatOrderBook> order_book_per_security;
-	std::vector<std::vector<float>> portfolios;
-	std::map<UserID, Username> user_id_to_username_map;
-	uint32_t current_step;
-	bool has_next_step;
-	std::map<SecurityTicker, std::vector<LimitOrder>> v2_submitted_orders;
-	std::map<SecurityTicker, std::vector<OrderID>> v2_cancelled_orders;
-	std::map<SecurityTicker, std::map<OrderID, float>> v2_transacted_orders;
-};
+	std::map<float, PriceLevel, Compare, PoolAllocator<std::pair<const float, PriceLevel>>> levels;
 
-class ISecurity;
-class IPortfolioManager;
+public:
+	bool empty() const noexcept
+	{
+		return levels.empty();
+	}
 
-class ISimulation
-{
-protected:
-	std::vector<SecurityTicker> tickers = {};
-	std::map<SecurityTicker, SecurityID> ticker_to_id = {};
-	std::map<SecurityTicker, std::shared_ptr<ISecurity>> ticker_to_security = {};
-	std::vector<std::shared_ptr<ISecurity>> securities_vector = {};
-	const float T;
-	const uint32_t N;
-	uint32_t tick = 0;
-	std::map<UserID, Username> user_id_to_username = {};
+	PriceLevel *best() noexcept
+	{
+		return levels.empty() ? nullptr : &levels.begin()->second;
+	}
 
-protected:
-	std::vector<std::shared_ptr<ISecurity>> &get_securities() noexcept
+	const PriceLevel *best() const noexcept
 	{
-		return securities_vector;
+		return levels.empty() ? nullptr : &levels.begin()->second;
 	}
-	void increment_tick() noexcept
+
+	PriceLevel &find_or_create(float price, int64_t tick)
 	{
-		tick += 1;
+		return levels.try_emplace(price, PriceLevel{.price = price, .tick = tick}).first->second;
 	}
-	void reset_tick_to_zero() noexcept
+
+	// Same as `find_or_create`, but amortized O(1) when `price` is worse than every level
+	PriceLevel &find_or_append(float price, int64_t tick)
 	{
-		tick = 0;
+		return levels.try_emplace(levels.end(), price, PriceLevel{.price = price, .tick = tick})->second;
 	}
 
-public:
-	explicit ISimulation(
-		const std::map<SecurityTicker, std::shared_ptr<ISecurity>> &securities,
-		float T, uint32_t N) : T{T}, N{N}
+	void erase(PriceLevel *level)
 	{
-		uint32_t security_id = 0;
-		for (const auto &[ticker, security] : securities)
-		{
-			tickers.push_back(ticker);
-			ticker_to_id.emplace(ticker, security_id);
-			ticker_to_security.emplace(ticker, security);
-			securities_vector.push_back(security);
-			security_id += 1;
-		}
+		levels.erase(level->price);
 	}
-	virtual ~ISimulation() = default;
 
-	// Utility methods
-	const std::vector<SecurityTicker> &get_all_tickers() const noexcept
+	void erase_best() noexcept
 	{
-		return tickers;
-	};
-	const SecurityTicker &get_security_ticker(SecurityID security_id) const
+		levels.erase(levels.begin());
+	}
+
+	// Visits levels best first while `callback` returns `true`, then erases all of those levels at once
+	template <typename F>
+	void erase_best_while(F &&callback)
 	{
-		if (security_id >= tickers.size())
+		auto last = levels.begin();
+		while (last != levels.end() && callback(last->second))
 		{
-			throw IDNotFoundError(fmt::format("The id `{}` doesn't exist.", security_id));
+			++last;
 		}
-		return tickers.at(security_id);
-	};
-	SecurityID get_security_id(const SecurityTicker &security_ticker) const
+		levels.erase(levels.begin(), last);
+	}
+
+	// Visits the best `max_levels` levels, best first
+	template <typename F>
+	void for_each(F &&callback, std::size_t max_levels = std::numeric_limits<std::size_t>::max()) const
 	{
-		const auto it = ticker_to_id.find(security_ticker);
-		if (it == ticker_to_id.end())
+		for (auto it = levels.begin(); it != levels.end() && max_levels > 0; ++it, max_levels--)
 		{
-			throw IDNotFoundError(fmt::format("The ticker `{}` doesn't exist.", security_ticker));
+			callback(it->second);
 		}
-		return it->second;
-	};
-	const std::map<UserID, Username> &get_user_id_to_username() const noexcept
-	{
-		return user_id_to_username;
 	}
-	uint32_t get_securities_count() const noexcept
+
+	void clear() noexcept
 	{
-		return securities_vector.size();
+		levels.clear();
 	}
+};
 
-	// Simulation meta information
-	float get_dt() const noexcept
+// Price levels of one side of a book with a fixed tick size.
+// Levels near the touch live in an array indexed by their tick offset from `base_tick`, with a bitmap of the
+// occupied levels to find the best one. The window widens to cover new levels up to `MAX_WIDTH` ticks, levels
+// further away go to a sparse `overflow` map and are always worse than every level of the window. A better
+// level past the window moves it there, and emptying the window brings the best overflow levels back in, so
+// the memory used is bounded by `MAX_WIDTH` plus the number of far levels.
+template <OrderSide Side>
+class LevelLadder
+{
+	static constexpr int64_t INITIAL_WIDTH = 256;
+	static constexpr int64_t MAX_WIDTH = int64_t(1) << 14;
+
+	using OverflowCompare = std::conditional_t<Side == OrderSide::BID, std::greater<int64_t>, std::less<int64_t>>;
+
+	float tick_size;
+	int64_t base_tick = 0;
+	std::vector<PriceLevel> levels = std::vector<PriceLevel>(INITIAL_WIDTH);
+	std::vector<uint64_t> occupied = std::vector<uint64_t>(INITIAL_WIDTH / 64);
+	std::size_t level_count = 0; // Levels of the window, the overflow is empty when there are none
+	int64_t best_index = -1;
+	std::map<int64_t, PriceLevel, OverflowCompare, PoolAllocator<std::pair<const int64_t, PriceLevel>>> overflow; // By tick, best first
+
+	static bool is_better(int64_t index_a, int64_t index_b) noexcept
 	{
-		return T / N;
-	};
-	float get_t() const noexcept
+		return Side == OrderSide::BID ? index_a > index_b : index_a < index_b;
+	}
+
+	int64_t width() const noexcept
 	{
-		return tick * T / N;
-	};
-	float get_T() const noexcept
+		return static_cast<int64_t>(levels.size());
+	}
+
+	bool in_window(int64_t tick) const noexcept
 	{
-		return T;
-	};
-	uint32_t get_tick() const noexcept
+		return tick >= base_tick && tick < base_tick + width();
+	}
+
+	// -1 if there is no occupied level at or below `index`
+	int64_t highest_at_or_below(int64_t index) const noexcept
 	{
-		return tick;
-	};
-	uint32_t get_N() const noexcept
+		if (index < 0)
+		{
+			return -1;
+		}
+		auto word = index >> 6;
+		auto bits = occupied[word] & (~uint64_t(0) >> (63 - (index & 63)));
+		while (true)
+		{
+			if (bits != 0)
+			{
+				return word * 64 + 63 - std::countl_zero(bits);
+			}
+			if (word == 0)
+			{
+				return -1;
+			}
+			word -= 1;
+			bits = occupied[word];
+		}
+	}
+
+	// -1 if there is no occupied level at or above `index`
+	int64_t lowest_at_or_above(int64_t index) const noexcept
 	{
-		return N;
-	};
-
-	// User management
-	virtual UserID add_user(const Username &username) = 0; // May throw
-	virtual uint32_t get_user_count() const noexcept = 0;
-	virtual std::vector<float> get_user_portfolio(UserID user_id) const = 0;								  // May throw
-	virtual void do_portfolio_callback(std::function<void(std::shared_ptr<IPortfolioManager>)> callback) = 0; // May throw
-
-	// Simulation order book information
-	virtual const LimitOrder &get_top_bid(SecurityID security_id) const = 0;							  // May throw
-	virtual const LimitOrder &get_top_ask(SecurityID security_id) const = 0;							  // May throw
-	virtual uint32_t get_bid_count(SecurityID security_id) const = 0;									  // May throw
-	virtual uint32_t get_ask_count(SecurityID security_id) const = 0;									  // May throw
-	virtual FlatOrderBook get_order_book(SecurityID security_id) const = 0;								  // May throw
-	virtual std::set<OrderID> get_all_open_user_orders(UserID user_id, SecurityID security_id) const = 0; // May throw
-	virtual BookDepth get_cumulative_book_depth(SecurityID security_id) const = 0;						  // May throw
-
-	// Simulation actions
-	virtual SimulationStepResult do_simulation_step() = 0;																	   // May throw
-	virtual OrderID submit_limit_order(UserID user_id, SecurityID security_id, OrderSide side, float price, float volume) = 0; // May throw
-	virtual void submit_cancel_order(UserID user_id, SecurityID security_id, OrderID order_id) = 0;							   // May throw
-	virtual void reset_simulation() = 0;
-	// TODO: can I do something better than this?
-	virtual OrderID direct_insert_limit_order(UserID user_id, SecurityID security_id, OrderSide side, float price, float volume) = 0;
-	virtual OrderID submit_market_order(UserID user_id, SecurityID security_id, OrderAction action, float volume) = 0; // May throw
-
-	// TODO:
-	// public:
-	// virtual uint32_t get_bid_count(SecurityID security_id) const = 0;
-	// virtual uint32_t get_ask_count(SecurityID security_id) const = 0;
-	// virtual std::optional<const LimitOrder&> try_get_top_bid(SecurityID security_id) const = 0;
-	// virtual std::optional<const LimitOrder&> try_get_top_ask(SecurityID security_id) const = 0;
-	// replace `get_N` with `get_max_tick()`?
-	// protected:
-	// virtual bool does_user_id_exist() const noexcept = 0;
-	// virtual bool does_security_id_exist() const noexcept = 0;
-};
-
-class IPortfolioManager
-{
-public:
-	virtual ~IPortfolioManager() = default;
-
-	virtual uint32_t get_user_count() const noexcept = 0;
-	virtual std::vector<std::vector<float>> get_portfolio_table() const noexcept = 0;
-	virtual void reset_user_portfolio(UserID user_id) = 0;
-	virtual float add_to_security(UserID user_id, SecurityID security_1, float addition_1) = 0;															// May throw
-	virtual float multiply_to_security(UserID user_id, SecurityID security_1, float multiplier_1) = 0;													// May throw
-	virtual float multiply_to_security_if_negative(UserID user_id, SecurityID security_1, float multiplier_1) = 0;										// May throw
-	virtual FloatPair add_to_two_securities(UserID user_id, SecurityID security_1, float addition_1, SecurityID security_2, float addition_2) = 0;		// May throw
-	virtual float multiply_and_add_1_to_2(UserID user_id, SecurityID security_1, SecurityID security_2, float multiply) = 0;							// May throw
-	virtual float multiply_and_add_1_to_2_and_set_1(UserID user_id, SecurityID security_1, SecurityID security_2, float multiply, float set_value) = 0; // May throw
-
-	// virtual void lock_with_callback(UserID user_id, std::function<void(void)> callback) = 0; // May throw
-};
-
-class ISecurity
-{
-public:
-	virtual ~ISecurity() = default;
-
-	virtual bool is_tradeable() = 0;
-	virtual void before_step(ISimulation &simulation, std::shared_ptr<IPortfolioManager> portfolio) = 0;
-	virtual void after_step(ISimulation &simulation, std::shared_ptr<IPortfolioManager> portfolio) = 0;
-	virtual void on_simulation_start(ISimulation &simulation, std::shared_ptr<IPortfolioManager> portfolio) = 0;
-	virtual void on_simulation_end(ISimulation &simulation, std::shared_ptr<IPortfolioManager> portfolio) = 0;
-	virtual void on_trade_executed(
-		ISimulation &simulation,
-		std::shared_ptr<IPortfolioManager> portfolio,
-		UserID buyer_id, UserID seller_id, float transacted_price, float transacted_volume) = 0;
-};
-
-class UserAndPortfolioManager : public IPortfolioManager
-{
-	uint32_t user_count = 0;
-	uint32_t capacity = 0;
-	const uint32_t columns;
-
-	std::unique_ptr<float[]> data = nullptr;
-	mutable std::shared_mutex data_mutex = std::shared_mutex();
-	mutable std::unique_ptr<std::mutex[]> user_mutexes;
-
-public:
-	explicit UserAndPortfolioManager(const uint32_t columns) : columns{columns} {}
+		if (index >= width())
+		{
+			return -1;
+		}
+		auto word = index >> 6;
+		auto bits = occupied[word] & (~uint64_t(0) << (index & 63));
+		while (true)
+		{
+			if (bits != 0)
+			{
+				return word * 64 + std::countr_zero(bits);
+			}
+			word += 1;
+			if (word == static_cast<int64_t>(occupied.size()))
+			{
+				return -1;
+			}
+			bits = occupied[word];
+		}
+	}
 
-	const uint32_t get_column_count() const noexcept
+	// The next occupied level after `index` in priority order
+	int64_t next_index(int64_t index) const noexcept
 	{
-		return columns;
+		return Side == OrderSide::BID ? highest_at_or_below(index - 1) : lowest_at_or_above(index + 1);
 	}
 
-	uint32_t get_user_count() const noexcept override
+	// The window width, doubled from the current one, that leaves room around the ticks `low_tick` to `high_tick`.
+	// Stops doubling past `MAX_WIDTH`.
+	int64_t width_to_cover(int64_t low_tick, int64_t high_tick) const noexcept
 	{
-		return user_count;
+		auto span = high_tick - low_tick + 1;
+		auto new_width = width();
+		while (new_width < 2 * span && new_width <= MAX_WIDTH)
+		{
+			new_width *= 2;
+		}
+		return new_width;
 	}
 
-	UserID register_new_user() noexcept
+	// Points the orders of `level` back at it once it moved
+	static void relink(PriceLevel &level) noexcept
 	{
-		auto write_lock = std::unique_lock(data_mutex);
-		auto user_id = user_count++;
-
-		if (user_count > capacity)
+		for (auto node = level.orders.head; node != nullptr; node = node->next)
 		{
-			capacity = std::max(1u, capacity * 2);
-
-			// Resize data buffer
-			auto new_data_ptr = std::make_unique<float[]>(capacity * columns);
-			std::fill(new_data_ptr.get(), new_data_ptr.get() + capacity * columns, 0.0f);
-
-			if (data != nullptr)
-			{
-				std::memcpy(new_data_ptr.get(), data.get(), (user_count - 1) * columns * sizeof(float));
-			}
-			data = std::move(new_data_ptr);
-
-			auto new_mutexes = std::make_unique<std::mutex[]>(capacity);
-			// no need to copy old ones, just replace
-			user_mutexes = std::move(new_mutexes);
+			node->level = &level;
 		}
-
-		// Zero out just the new row
-		std::fill(data.get() + user_id * columns, data.get() + (user_id + 1) * columns, 0.0f);
-		return user_id;
 	}
 
-	// Inherited methods
-	std::vector<std::vector<float>> get_portfolio_table() const noexcept override
+	// Moves the window to `new_width` ticks from `new_base_tick`. Every level of the window goes through the
+	// overflow, and the overflow levels that fit the new window come back in.
+	void move_window(int64_t new_base_tick, int64_t new_width)
 	{
-		auto read_lock = std::shared_lock(data_mutex);
-		auto table = std::vector<std::vector<float>>(user_count, std::vector<float>(columns));
-
-		for (UserID user_index = 0; user_index < user_count; user_index++)
+		for (auto index = lowest_at_or_above(0); index != -1; index = lowest_at_or_above(index + 1))
 		{
-			std::unique_lock user_lock(user_mutexes[user_index]);
-			std::memcpy(
-				table[user_index].data(),
-				data.get() + user_index * columns,
-				columns * sizeof(float));
+			relink(overflow.emplace(levels[index].tick, levels[index]).first->second);
 		}
-
-		return table;
+		if (new_width != width())
+		{
+			levels = std::vector<PriceLevel>(new_width);
+			occupied = std::vector<uint64_t>(new_width / 64);
+		}
+		else
+		{
+			std::fill(occupied.begin(), occupied.end(), uint64_t(0));
+		}
+		base_tick = new_base_tick;
+		level_count = 0;
+		// The overflow is sorted best first, so the levels of the window are one range of it
+		auto first = overflow.lower_bound(Side == OrderSide::BID ? base_tick + new_width - 1 : base_tick);
+		auto last = overflow.upper_bound(Side == OrderSide::BID ? base_tick : base_tick + new_width - 1);
+		for (auto it = first; it != last; ++it)
+		{
+			auto index = it->first - base_tick;
+			levels[index] = it->second;
+			relink(levels[index]);
+			occupied[index >> 6] |= uint64_t(1) << (index & 63);
+			level_count += 1;
+		}
+		overflow.erase(first, last);
+		best_index = Side == OrderSide::BID ? highest_at_or_below(width() - 1) : lowest_at_or_above(0);
 	}
 
-	void reset_user_portfolio(UserID user_id) override
+	// Once the window is empty, moves it to the best overflow level
+	void refill()
 	{
-		if (user_id >= user_count)
+		if (best_index < 0 && !overflow.empty())
 		{
-			throw IDNotFoundError(fmt::format("Could not find user with id `{}`.", user_id));
+			move_window(overflow.begin()->first - width() / 2, width());
 		}
-		auto read_lock = std::shared_lock(data_mutex);
-		auto user_lock = std::unique_lock(user_mutexes[user_id]);
+	}
 
-		std::fill(data.get() + user_id * columns, data.get() + (user_id + 1) * columns, 0.0f);
+public:
+	explicit LevelLadder(float tick_size) : tick_size{tick_size} {}
+
+	bool empty() const noexcept
+	{
+		return level_count == 0;
 	}
 
-	// `security_1 += addition_1`
-	// returns: the new value of the security in the portfolio
-	float add_to_security(UserID user_id, SecurityID security_1, float addition_1) override
+	PriceLevel *best() noexcept
 	{
-		if (user_id >= user_count)
-		{
-			throw IDNotFoundError(fmt::format("Could not find user_id: `{}`.", user_id));
-		}
-		if (security_1 >= columns)
-		{
-			throw IDNotFoundError(fmt::format("Could not find security_1: `{}`.", security_1));
-		}
-		auto read_lock = std::shared_lock(data_mutex);
-		auto user_lock = std::unique_lock(user_mutexes[user_id]);
+		return best_index < 0 ? nullptr : &levels[best_index];
+	}
 
-		auto &ref = data[user_id * columns + security_1];
-		ref += addition_1;
-		return ref;
+	const PriceLevel *best() const noexcept
+	{
+		return best_index < 0 ? nullptr : &levels[best_index];
 	}
 
-	// `security_1 *= multiplier_1`
-	// returns: the new value of the security in the portfolio
-	float multiply_to_security(UserID user_id, SecurityID security_1, float multiplier_1) override
+	PriceLevel &find_or_create(float price, int64_t tick)
 	{
-		if (user_id >= user_count)
+		if (!in_window(tick))
 		{
-			throw IDNotFoundError(fmt::format("Could not find user_id: `{}`.", user_id));
+			if (level_count == 0)
+			{
+				base_tick = tick - width() / 2;
+			}
+			else
+			{
+				auto low_tick = std::min(tick, base_tick + lowest_at_or_above(0));
+				auto high_tick = std::max(tick, base_tick + highest_at_or_below(width() - 1));
+				auto new_width = width_to_cover(low_tick, high_tick);
+				if (new_width <= MAX_WIDTH)
+				{
+					// Leave the same amount of free ticks on both sides of the resting levels
+					move_window(low_tick - (new_width - (high_tick - low_tick + 1)) / 2, new_width);
+				}
+				else if (is_better(tick, levels[best_index].tick))
+				{
+					// The window follows the touch, the levels left behind go to the overflow
+					move_window(tick - width() / 2, width());
+				}
+				else
+				{
+					return overflow.try_emplace(tick, PriceLevel{.price = price, .tick = tick}).first->second;
+				}
+			}
 		}
-		if (security_1 >= columns)
+		auto index = tick - base_tick;
+		auto &level = levels[index];
+		auto &word = occupied[index >> 6];
+		auto bit = uint64_t(1) << (index & 63);
+		if ((word & bit) == 0)
 		{
-			throw IDNotFoundError(fmt::format("Could not find security_1: `{}`.", security_1));
+			word |= bit;
+			level = PriceLevel{.price = price, .tick = tick};
+			level_count += 1;
+			if (best_index < 0 || is_better(index, best_index))
+			{
+				best_index = index;
+			}
 		}
-		auto read_lock = std::shared_lock(data_mutex);
-		auto user_lock = std::unique_lock(user_mutexes[user_id]);
+		return level;
+	}
 
-		auto &ref = data[user_id * columns + security_1];
-		ref *= multiplier_1;
-		return ref;
+	PriceLevel &find_or_append(float price, int64_t tick)
+	{
+		return find_or_create(price, tick);
 	}
 
-	// `security_1 *= multiplier_1` if `security_1 < 0`
-	// returns: the new value of the security in the portfolio
-	float multiply_to_security_if_negative(UserID user_id, SecurityID security_1, float multiplier_1) override
+	void erase(PriceLevel *level)
 	{
-		if (user_id >= user_count)
+		if (!in_window(level->tick))
 		{
-			throw IDNotFoundError(fmt::format("Could not find user_id: `{}`.", user_id));
+			overflow.erase(level->tick);
+			return;
 		}
-		if (security_1 >= columns)
+		auto index = level->tick - base_tick;
+		occupied[index >> 6] &= ~(uint64_t(1) << (index & 63));
+		level_count -= 1;
+		if (index == best_index)
 		{
-			throw IDNotFoundError(fmt::format("Could not find security_1: `{}`.", security_1));
+			best_index = next_index(index);
+			refill();
 		}
-		auto read_lock = std::shared_lock(data_mutex);
-		auto user_lock = std::unique_lock(user_mutexes[user_id]);
+	}
 
-		auto &ref = data[user_id * columns + security_1];
-		if (ref < 0.0)
+	void erase_best()
+	{
+		erase(&levels[best_index]);
+	}
+
+	// Visits levels best first while `callback` returns `true`, erasing each of them
+	template <typename F>
+	void erase_best_while(F &&callback)
+	{
+		while (best_index >= 0 && callback(levels[best_index]))
 		{
-			ref *= multiplier_1;
+			occupied[best_index >> 6] &= ~(uint64_t(1) << (best_index & 63));
+			level_count -= 1;
+			best_index = next_index(best_index);
+			refill();
 		}
-		return ref;
 	}
 
-	// `security_1 += addition_1`, `security_2 += addition_2`
-	// returns: a pair of the new portfolio values
-	FloatPair add_to_two_securities(UserID user_id, SecurityID security_1, float addition_1, SecurityID security_2, float addition_2) override
+	// Visits the best `max_levels` levels, best first
+	template <typename F>
+	void for_each(F &&callback, std::size_t max_levels = std::numeric_limits<std::size_t>::max()) const
 	{
-		if (user_id >= user_count)
+		for (auto index = best_index; index != -1 && max_levels > 0; index = next_index(index), max_levels--)
 		{
-			throw IDNotFoundError(fmt::format("Could not find user_id: `{}`.", user_id));
+			callback(levels[index]);
 		}
-		if (security_1 >= columns)
+		for (auto it = overflow.begin(); it != overflow.end() && max_levels > 0; ++it, max_levels--)
 		{
-			throw IDNotFoundError(fmt::format("Could not find security_1: `{}`.", security_1));
+			callback(it->second);
 		}
-		if (security_2 >= columns)
+	}
+
+	// Also gives back the memory of a window widened by earlier orders
+	void clear()
+	{
+		overflow.clear();
+		if (width() > INITIAL_WIDTH)
 		{
-			throw IDNotFoundError(fmt::format("Could not find security_2: `{}`.", security_1));
+			levels = std::vector<PriceLevel>(INITIAL_WIDTH);
+			occupied = std::vector<uint64_t>(INITIAL_WIDTH / 64);
 		}
-		if (security_1 == security_2)
+		else
 		{
-			throw std::runtime_error(fmt::format("Received the same security twice: `{}`", security_1));
+			std::fill(occupied.begin(), occupied.end(), uint64_t(0));
 		}
-		auto read_lock = std::shared_lock(data_mutex);
-		auto user_lock = std::unique_lock(user_mutexes[user_id]);
-
-		auto &ref_1 = data[user_id * columns + security_1];
-		ref_1 += addition_1;
-		auto &ref_2 = data[user_id * columns + security_2];
-		ref_2 += addition_2;
-		return {ref_1, ref_2};
+		level_count = 0;
+		best_index = -1;
 	}
+};
 
-	// `security_2 += security_1 * multiply`
-	// returns: the new value of security_2
-	float multiply_and_add_1_to_2(UserID user_id, SecurityID security_1, SecurityID security_2, float multiply) override
+// A resting order hit by `OrderBook::sweep`
+struct SweepFill
+{
+	OrderID order_id;
+	UserID user_id;
+	float price;
+	float volume;			// Traded volume
+	float remaining_volume; // `0` if the order was filled in full and left the book
+};
+
+class OrderBook
+{
+	// Books without a tick size keep their levels in a sorted map, books with one in a ladder
+	using BidLevels = std::variant<LevelMap<std::greater<float>>, LevelLadder<OrderSide::BID>>;
+	using AskLevels = std::variant<LevelMap<std::less<float>>, LevelLadder<OrderSide::ASK>>;
+
+	float tick_size;
+	double unit_ticks; // See `get_unit_ticks`
+	BidLevels bid_levels;
+	AskLevels ask_levels;
+	std::size_t bid_count = 0;
+	std::size_t ask_count = 0;
+	OrderLocator<OrderNode *> locator;
+	std::vector<UserOrderList> user_orders; // UserID -> resting orders of that user
+	BlockPool node_pool = BlockPool(sizeof(OrderNode));
+
+	// Every change is numbered and logged until it is taken by `take_delta`
+	uint64_t sequence = 0;
+	uint64_t delta_sequence = 0;
+	std::vector<OrderEvent> order_events;
+	std::vector<LevelUpdate> level_updates;
+	std::vector<uint32_t> level_update_order; // Scratch of `take_delta`, kept for its capacity
+
+	template <typename Levels>
+	static Levels make_levels(float tick_size)
 	{
-		if (user_id >= user_count)
-		{
-			throw IDNotFoundError(fmt::format("Could not find user_id: `{}`.", user_id));
-		}
-		if (security_1 >= columns)
+		if (tick_size > 0.0f)
 		{
-			throw IDNotFoundError(fmt::format("Could not find security_1: `{}`.", security_1));
+			return Levels(std::in_place_index<1>, tick_size);
 		}
-		if (security_2 >= columns)
+		return Levels(std::in_place_index<0>);
+	}
+
+	// Ticks in one unit of price when the tick size divides it (`0.01` -> `100`), `0` otherwise.
+	// Dividing by it gives the float nearest to the decimal price, where multiplying by the float
+	// tick size is off by one ulp for many prices (`10 * 0.01f` -> `0.099999994`).
+	static double get_unit_ticks(float tick_size) noexcept
+	{
+		if (tick_size <= 0.0f)
 		{
-			throw IDNotFoundError(fmt::format("Could not find security_2: `{}`.", security_1));
+			return 0.0;
 		}
-		if (security_1 == security_2)
-		{
-			throw std::runtime_error(fmt::format("Received the same security twice: `{}`", security_1));
+		auto ticks = 1.0 / tick_size;
+		auto rounded = std::round(ticks);
+		return rounded >= 1.0 && std::abs(ticks - rounded) <= rounded * 1e-6 ? rounded : 0.0;
+	}
+
+	static int64_t price_to_tick(float price, float tick_size, double unit_ticks) noexcept
+	{
+		return unit_ticks > 0.0 ? std::llround(price * unit_ticks) : std::llround(static_cast<double>(price) / tick_size);
+	}
+
+	static float tick_to_price(int64_t tick, float tick_size, double unit_ticks) noexcept
+	{
+		return static_cast<float>(unit_ticks > 0.0 ? tick / unit_ticks : tick * static_cast<double>(tick_size));
+	}
+
+	int64_t price_to_tick(float price) const noexcept
+	{
+		return price_to_tick(price, tick_size, unit_ticks);
+	}
+
+	float tick_to_price(int64_t tick) const noexcept
+	{
+		return tick_to_price(tick, tick_size, unit_ticks);
+	}
+
+	void record_order(BookEventType type, const LimitOrder &order)
+	{
+		sequence += 1;
+		order_events.push_back(OrderEvent{.sequence = sequence, .type = type, .order = order});
+	}
+
+	// Must be called after `record_order` for the change, and before an emptied level is erased
+	void record_level(OrderSide side, const PriceLevel &level)
+	{
+		level_updates.push_back(LevelUpdate{
+			.sequence = sequence,
+			.side = side,
+			.price = level.price,
+			.volume = level.empty() ? 0.0f : static_cast<float>(level.volume),
+			.order_count = level.orders.count});
+	}
+
+	template <typename Levels>
+	static PriceLevel &find_or_create_level(Levels &levels, float price, int64_t tick)
+	{
+		return std::visit([&](auto &side_levels) -> PriceLevel &
+		{
+			return side_levels.find_or_create(price, tick);
+		}, levels);
+	}
+
+	void add_to_level(PriceLevel &level, OrderNode *node)
+	{
+		node->level = &level;
+		level.orders.insert(node);
+		level.volume += node->order.volume;
+		record_level(node->order.side, level);
+	}
+
+	// `nodes` are new orders of one side, sorted best price first and then by order id
+	template <typename Levels>
+	void insert_sorted_into_levels(Levels &levels, std::span<OrderNode *const> nodes)
+	{
+		std::visit([&](auto &side_levels)
+		{
+			PriceLevel *level = nullptr;
+			for (auto node : nodes)
+			{
+				if (level == nullptr || level->price != node->order.price)
+				{
+					if (level != nullptr)
+					{
+						record_level(node->order.side, *level);
+					}
+					level = &side_levels.find_or_append(node->order.price, 0);
+				}
+				record_order(BookEventType::ADD, node->order);
+				node->level = level;
+				level->orders.insert(node);
+				level->volume += node->order.volume;
+			}
+			if (level != nullptr)
+			{
+				record_level(nodes.back()->order.side, *level);
+			}
+		}, levels);
+	}
+
+	// `orders` are the resting orders of one side in priority order, as returned by `get_limit_orders`
+	template <typename Levels>
+	void restore_levels(Levels &levels, std::span<const LimitOrder> orders)
+	{
+		std::visit([&](auto &side_levels)
+		{
+			PriceLevel *level = nullptr;
+			for (const auto &order : orders)
+			{
+				if (level == nullptr || level->price != order.price)
+				{
+					level = &side_levels.find_or_append(order.price, tick_size > 0.0f ? price_to_tick(order.price) : 0);
+				}
+				auto node = allocate_node(order);
+				node->level = level;
+				level->orders.insert(node);
+				level->volume += order.volume;
+				locator.insert(order.order_id, node);
+			}
+		}, levels);
+	}
+
+	template <typename Levels>
+	void remove_from_levels(Levels &levels, OrderNode *node)
+	{
+		auto level = node->level;
+		level->orders.unlink(node);
+		level->volume -= node->order.volume;
+		node->level = nullptr;
+		record_level(node->order.side, *level);
+		if (level->empty())
+		{
+			std::visit([&](auto &side_levels)
+			{
+				side_levels.erase(level);
+			}, levels);
 		}
-		auto read_lock = std::shared_lock(data_mutex);
-		auto user_lock = std::unique_lock(user_mutexes[user_id]);
+	}
 
-		auto &ref_to_multiply_from = data[user_id * columns + security_1];
-		auto &ref_to_mult_and_add = data[user_id * columns + security_2];
-		ref_to_mult_and_add += ref_to_multiply_from * multiply;
-		return ref_to_mult_and_add;
+	template <typename Levels>
+	static const PriceLevel &best_level(const Levels &levels)
+	{
+		return *std::visit([](const auto &side_levels)
+		{
+			return side_levels.best();
+		}, levels);
 	}
 
-	// `security_2 += security_1 * multiply`, then `security_1 = set_value`
-	// returns: the new value of security_2
-	float multiply_and_add_1_to_2_and_set_1(UserID user_id, SecurityID security_1, SecurityID security_2, float multiply, float set_value) override
+	// Removes the oldest order of the best level, and returns it
+	template <typename Levels>
+	OrderNode *pop_best(Levels &levels)
 	{
-		if (user_id >= user_count)
+		return std::visit([&](auto &side_levels)
 		{
-			throw IDNotFoundError(fmt::format("Could not find user_id: `{}`.", user_id));
+			auto level = side_levels.best();
+			auto node = level->orders.head;
+			record_order(BookEventType::DELETE, node->order);
+			level->orders.unlink(node);
+			level->volume -= node->order.volume;
+			node->level = nullptr;
+			record_level(node->order.side, *level);
+			if (level->empty())
+			{
+				side_levels.erase_best();
+			}
+			return node;
+		}, levels);
+	}
+
+	// Fills `volume` against the levels best first, see `sweep`
+	template <typename Levels, typename Fills>
+	float sweep_levels(Levels &levels, std::size_t &count, float volume, Fills &fills)
+	{
+		std::visit([&](auto &side_levels)
+		{
+			side_levels.erase_best_while([&](PriceLevel &level)
+			{
+				if (volume <= 0)
+				{
+					return false;
+				}
+				auto side = level.orders.head->order.side;
+				while (volume > 0 && !level.empty())
+				{
+					auto node = level.orders.head;
+					auto &order = node->order;
+					// Same arithmetic as filling the orders one at a time, so the traded volumes are identical
+					auto traded_volume = std::min(volume, order.volume);
+					auto remaining_volume = order.volume - traded_volume;
+					volume -= traded_volume;
+					fills.push_back(SweepFill{.order_id = order.order_id, .user_id = order.user_id, .price = order.price, .volume = traded_volume, .remaining_volume = remaining_volume});
+					if (remaining_volume == 0.0f)
+					{
+						record_order(BookEventType::DELETE, order);
+						level.orders.unlink(node);
+						level.volume -= order.volume;
+						unlink_user_order(node);
+						locator.erase(order.order_id);
+						free_node(node);
+						count -= 1;
+					}
+					else
+					{
+						level.volume -= order.volume - remaining_volume;
+						order.volume = remaining_volume;
+						record_order(BookEventType::MODIFY, order);
+					}
+				}
+				// One update per level touched, the same as the last of the per order updates
+				record_level(side, level);
+				return level.empty();
+			});
+		}, levels);
+		return volume;
+	}
+
+	// Partially fills the oldest order of the best level, leaving it with `volume`
+	template <typename Levels>
+	void set_best_volume(Levels &levels, float volume)
+	{
+		std::visit([&](auto &side_levels)
+		{
+			auto level = side_levels.best();
+			auto &order = level->orders.head->order;
+			level->volume -= order.volume - volume;
+			order.volume = volume;
+			record_order(BookEventType::MODIFY, order);
+			record_level(order.side, *level);
+		}, levels);
+	}
+
+	template <typename Levels, typename F>
+	static void for_each_level(const Levels &levels, F &&callback, std::size_t max_levels = std::numeric_limits<std::size_t>::max())
+	{
+		std::visit([&](const auto &side_levels)
+		{
+			side_levels.for_each(callback, max_levels);
+		}, levels);
+	}
+
+	template <typename Levels>
+	static void copy_order_records(const Levels &levels, std::vector<OrderRecord> &records, std::size_t max_levels)
+	{
+		std::size_t count = 0;
+		for_each_level(levels, [&](const PriceLevel &level)
+		{
+			count += level.orders.count;
+		}, max_levels);
+		records.clear();
+		records.reserve(count);
+		for_each_level(levels, [&](const PriceLevel &level)
+		{
+			for (auto node = level.orders.head; node != nullptr; node = node->next)
+			{
+				records.push_back(OrderRecord{.order_id = node->order.order_id, .user_id = node->order.user_id, .price = node->order.price, .volume = node->order.volume});
+			}
+		}, max_levels);
+	}
+
+	void link_user_order(OrderNode *node)
+	{
+		auto user_id = node->order.user_id;
+		if (user_id >= user_orders.size())
+		{
+			user_orders.resize(std::size_t(user_id) + 1);
 		}
-		if (security_1 >= columns)
+		user_orders[user_id].insert(node);
+	}
+
+	void unlink_user_order(OrderNode *node) noexcept
+	{
+		user_orders[node->order.user_id].unlink(node);
+	}
+
+	OrderNode *allocate_node(const LimitOrder &order)
+	{
+		return new (node_pool.allocate()) OrderNode{.order = order};
+	}
+
+	void free_node(OrderNode *node) noexcept
+	{
+		node->~OrderNode();
+		node_pool.deallocate(node);
+	}
+
+public:
+	// A positive `tick_size` stores prices as integer ticks, `0` keeps raw float prices
+	explicit OrderBook(float tick_size = 0.0f) : tick_size{tick_size},
+												 unit_ticks{get_unit_ticks(tick_size)},
+												 bid_levels{make_levels<BidLevels>(tick_size)},
+												 ask_levels{make_levels<AskLevels>(tick_size)} {}
+	OrderBook(const OrderBook &) = delete;
+	OrderBook &operator=(const OrderBook &) = delete;
+	// Order nodes are trivially destructible and owned by `node_pool`, so the defaults release them
+	static_assert(std::is_trivially_destructible_v<OrderNode>);
+	OrderBook(OrderBook &&other) noexcept = default;
+	OrderBook &operator=(OrderBook &&other) noexcept = default;
+
+	float get_tick_size() const noexcept
+	{
+		return tick_size;
+	}
+
+	// Rounds `price` to the nearest tick, books without a tick size return it unchanged
+	float snap_price(float price) const noexcept
+	{
+		return tick_size > 0.0f ? tick_to_price(price_to_tick(price)) : price;
+	}
+
+	// Same rounding as a book with `tick_size` would do, for callers that must not touch the book
+	static float snap_price(float price, float tick_size) noexcept
+	{
+		if (tick_size <= 0.0f)
 		{
-			throw IDNotFoundError(fmt::format("Could not find security_1: `{}`.", security_1));
+			return price;
 		}
-		if (security_2 >= columns)
+		auto unit_ticks = get_unit_ticks(tick_size);
+		return tick_to_price(price_to_tick(price, tick_size, unit_ticks), tick_size, unit_ticks);
+	}
+
+	std::size_t bid_size() const
+	{
+		return bid_count;
+	}
+
+	std::size_t ask_size() const
+	{
+		return ask_count;
+	}
+
+	// Whether the best bid is at or above the best ask, compared in ticks when the book has a tick size
+	bool is_crossed() const
+	{
+		if (bid_count == 0 || ask_count == 0)
 		{
-			throw IDNotFoundError(fmt::format("Could not find security_2: `{}`.", security_1));
+			return false;
 		}
-		if (security_1 == security_2)
+		const auto &best_bid = best_level(bid_levels);
+		const auto &best_ask = best_level(ask_levels);
+		if (tick_size > 0.0f)
 		{
-			throw std::runtime_error(fmt::format("Received the same security twice: `{}`", security_1));
+			return best_bid.tick >= best_ask.tick;
 		}
-		auto read_lock = std::shared_lock(data_mutex);
-		auto user_lock = std::unique_lock(user_mutexes[user_id]);
+		return best_bid.price >= best_ask.price;
+	}
 
-		auto &ref_to_set = data[user_id * columns + security_1];
-		auto &ref_to_mult_and_add = data[user_id * columns + security_2];
-		ref_to_mult_and_add += ref_to_set * multiply;
-		ref_to_set = set_value;
-		return ref_to_mult_and_add;
+	bool has_order(OrderID order_id) const noexcept
+	{
+		return locator.contains(order_id);
 	}
-};
 
-class GenericSimulation : public ISimulation
-{
-	std::shared_ptr<UserAndPortfolioManager> user_portfolio_manager;
-	std::vector<OrderBook> order_books = {};
+	// Ticks of a book with a tick size are kept well inside `int64_t`, prices past this are refused on submission
+	static constexpr int64_t MAX_TICK = int64_t(1) << 52;
 
-	std::mutex order_queue_mutex = std::mutex();
-	std::map<SecurityID, std::vector<OrderVariant>> submitted_orders = {};
-	OrderID order_id_counter = 0;
+	// Whether `price` is a number of ticks a book with `tick_size` can represent, always true without a tick size.
+	// NaN is not.
+	static bool is_price_in_range(float price, float tick_size) noexcept
+	{
+		return tick_size <= 0.0f || static_cast<double>(price) / tick_size < static_cast<double>(MAX_TICK);
+	}
 
-public:
-	explicit GenericSimulation(
-		const std::map<SecurityTicker, std::shared_ptr<ISecurity>> &securities,
-		float T,
-		uint32_t N) : ISimulation(securities, T, N)
+	// Returns `false`, leaving the book untouched, if the id is already in the book
+	bool insert_order(const LimitOrder &order)
 	{
-		for (uint32_t i = 0; i < securities.size(); i++)
+		if (has_order(order.order_id))
 		{
-			order_books.push_back(OrderBook());
-			submitted_orders.emplace(i, std::vector<OrderVariant>());
+			return false;
 		}
-		user_portfolio_manager = std::make_shared<UserAndPortfolioManager>((uint32_t)securities.size());
+		auto tick = tick_size > 0.0f ? price_to_tick(order.price) : 0;
+		auto node = allocate_node(order);
+		if (tick_size > 0.0f)
+		{
+			node->order.price = tick_to_price(tick);
+		}
+		// The event is recorded once the order has a level, before the level update it causes
+		auto &level = order.side == OrderSide::BID ? find_or_create_level(bid_levels, node->order.price, tick)
+												   : find_or_create_level(ask_levels, node->order.price, tick);
+		record_order(BookEventType::ADD, node->order);
+		add_to_level(level, node);
+		if (order.side == OrderSide::BID)
+		{
+			bid_count += 1;
+		}
+		else
+		{
+			ask_count += 1;
+		}
+		locator.insert(order.order_id, node);
+		link_user_order(node);
+		return true;
 	}
 
-	// User management
-	UserID add_user(const Username &username) override
+	// Bulk version of `insert_order` for seeding a book, `orders` must have positive prices and increasing
+	// ids newer than every resting order. Linear in the number of orders for a book with a tick size, and
+	// a single sort followed by a linear build for a map book.
+	void insert_orders(std::span<const LimitOrder> orders)
 	{
-		auto user_id = user_portfolio_manager->register_new_user();
-		user_id_to_username.emplace(user_id, username);
-		return user_id;
-	};
-	uint32_t get_user_count() const noexcept override
+		if (tick_size > 0.0f)
+		{
+			// The ladder finds a level from its tick in O(1), and with increasing ids every queue and
+			// user list insert is O(1) too, so there is nothing to gain from sorting
+			for (const auto &order : orders)
+			{
+				insert_order(order);
+			}
+			return;
+		}
+
+		// Each level of a map book is looked up once, and levels worse than the resting ones are
+		// appended in amortized O(1). The bits of a positive float compare like its value, so
+		// (side, price, position) packs into one integer key and the sort never touches the nodes.
+		// Bids are sorted by descending price.
+		std::vector<std::pair<uint64_t, OrderNode *>> sorted_nodes;
+		sorted_nodes.reserve(orders.size());
+		for (const auto &order : orders)
+		{
+			auto node = allocate_node(order);
+			// Nodes are linked in id order, so each link is O(1)
+			locator.insert(order.order_id, node);
+			link_user_order(node);
+			auto price_bits = uint64_t(std::bit_cast<uint32_t>(node->order.price));
+			auto side_key = node->order.side == OrderSide::BID ? ~price_bits & 0xFFFFFFFF : (uint64_t(1) << 32) | price_bits;
+			sorted_nodes.emplace_back((side_key << 31) | sorted_nodes.size(), node);
+		}
+		std::sort(sorted_nodes.begin(), sorted_nodes.end(), [](const auto &a, const auto &b)
+		{
+			return a.first < b.first;
+		});
+		auto nodes = std::vector<OrderNode *>(sorted_nodes.size());
+		std::transform(sorted_nodes.begin(), sorted_nodes.end(), nodes.begin(), [](const auto &entry)
+		{
+			return entry.second;
+		});
+		auto bid_total = static_cast<std::size_t>(std::count_if(orders.begin(), orders.end(), [](const LimitOrder &order)
+		{
+			return order.side == OrderSide::BID;
+		}));
+		insert_sorted_into_levels(bid_levels, std::span<OrderNode *const>(nodes.data(), bid_total));
+		insert_sorted_into_levels(ask_levels, std::span<OrderNode *const>(nodes.data() + bid_total, nodes.size() - bid_total));
+		bid_count += bid_total;
+		ask_count += nodes.size() - bid_total;
+	}
+
+	bool cancel_order(const CancelOrder &cancel)
 	{
-		return user_portfolio_manager->get_user_count();
-	};
-	std::vector<float> get_user_portfolio(UserID user_id) const override
+		auto handle = locator.find(cancel.order_id);
+		if (handle == nullptr)
+		{
+			return false;
+		}
+		auto node = *handle;
+		record_order(BookEventType::DELETE, node->order);
+		if (node->order.side == OrderSide::BID)
+		{
+			remove_from_levels(bid_levels, node);
+			bid_count -= 1;
+		}
+		else
+		{
+			remove_from_levels(ask_levels, node);
+			ask_count -= 1;
+		}
+		unlink_user_order(node);
+		locator.erase(cancel.order_id);
+		free_node(node);
+		return true;
+	}
+
+	const LimitOrder &top_bid() const
+	{
+		if (bid_count == 0)
+		{
+			throw std::runtime_error("Bid book is empty.");
+		}
+		return best_level(bid_levels).orders.head->order;
+	}
+
+	const LimitOrder &top_ask() const
+	{
+		if (ask_count == 0)
+		{
+			throw std::runtime_error("Ask book is empty.");
+		}
+		return best_level(ask_levels).orders.head->order;
+	}
+
+	// Partially fills the top bid, leaving it with `volume`
+	void set_top_bid_volume(float volume)
+	{
+		if (bid_count == 0)
+		{
+			throw std::runtime_error("Bid book is empty.");
+		}
+		set_best_volume(bid_levels, volume);
+	}
+
+	// Partially fills the top ask, leaving it with `volume`
+	void set_top_ask_volume(float volume)
+	{
+		if (ask_count == 0)
+		{
+			throw std::runtime_error("Ask book is empty.");
+		}
+		set_best_volume(ask_levels, volume);
+	}
+
+	void pop_top_bid()
+	{
+		if (bid_count == 0)
+		{
+			throw std::runtime_error("Bid book is empty.");
+		}
+		auto node = pop_best(bid_levels);
+		unlink_user_order(node);
+		locator.erase(node->order.order_id);
+		bid_count -= 1;
+		free_node(node);
+	}
+
+	void pop_top_ask()
+	{
+		if (ask_count == 0)
+		{
+			throw std::runtime_error("Ask book is empty.");
+		}
+		auto node = pop_best(ask_levels);
+		unlink_user_order(node);
+		locator.erase(node->order.order_id);
+		ask_count -= 1;
+		free_node(node);
+	}
+
+	// Fills up to `volume` against the resting orders of `side`, best price then oldest order first.
+	// Appends one `SweepFill` per order hit to `fills`, and returns the volume that could not be filled.
+	// Levels consumed in full are erased together at the end instead of one at a time.
+	template <typename Fills>
+	float sweep(OrderSide side, float volume, Fills &fills)
+	{
+		if (side == OrderSide::BID)
+		{
+			return bid_count == 0 ? volume : sweep_levels(bid_levels, bid_count, volume, fills);
+		}
+		return ask_count == 0 ? volume : sweep_levels(ask_levels, ask_count, volume, fills);
+	}
+
+	// Cumulative depth of the best `max_levels` levels of each side, O(max_levels) from the level totals
+	BookDepth get_book_depth(std::size_t max_levels = std::numeric_limits<std::size_t>::max()) const
+	{
+		std::map<float, float> bid_depth;
+		std::map<float, float> ask_depth;
+
+		// For bids, accumulate by descending price
+		float accumulated_bid_depth = 0.0f;
+		for_each_level(bid_levels, [&](const PriceLevel &level)
+		{
+			accumulated_bid_depth += static_cast<float>(level.volume);
+			bid_depth.emplace_hint(bid_depth.begin(), level.price, accumulated_bid_depth);
+		}, max_levels);
+
+		// For asks, accumulate by ascending price
+		float accumulated_ask_depth = 0.0f;
+		for_each_level(ask_levels, [&](const PriceLevel &level)
+		{
+			accumulated_ask_depth += static_cast<float>(level.volume);
+			ask_depth.emplace_hint(ask_depth.end(), level.price, accumulated_ask_depth);
+		}, max_levels);
+
+		return {bid_depth, ask_depth};
+	}
+
+	// Same depth as `get_book_depth` as (price, cumulative volume) pairs, best level first, reusing the vectors' capacity
+	void get_book_depth(std::vector<std::pair<float, float>> &bid_depth, std::vector<std::pair<float, float>> &ask_depth) const
+	{
+		bid_depth.clear();
+		float accumulated_bid_depth = 0.0f;
+		for_each_level(bid_levels, [&](const PriceLevel &level)
+		{
+			accumulated_bid_depth += static_cast<float>(level.volume);
+			bid_depth.emplace_back(level.price, accumulated_bid_depth);
+		});
+
+		ask_depth.clear();
+		float accumulated_ask_depth = 0.0f;
+		for_each_level(ask_levels, [&](const PriceLevel &level)
+		{
+			accumulated_ask_depth += static_cast<float>(level.volume);
+			ask_depth.emplace_back(level.price, accumulated_ask_depth);
+		});
+	}
+
+	FlatOrderBook get_limit_orders() const
+	{
+		FlatOrderBook book;
+		get_limit_orders(book);
+		return book;
+	}
+
+	// Copies the resting orders into `book`, reusing its capacity
+	void get_limit_orders(FlatOrderBook &book) const
+	{
+		auto &[bids, asks] = book;
+		bids.clear();
+		reserve_reusing(bids, bid_count);
+		for_each_level(bid_levels, [&](const PriceLevel &level)
+		{
+			for (auto node = level.orders.head; node != nullptr; node = node->next)
+			{
+				bids.push_back(node->order);
+			}
+		});
+		asks.clear();
+		reserve_reusing(asks, ask_count);
+		for_each_level(ask_levels, [&](const PriceLevel &level)
+		{
+			for (auto node = level.orders.head; node != nullptr; node = node->next)
+			{
+				asks.push_back(node->order);
+			}
+		});
+	}
+
+	// The resting orders of the best `max_levels` price levels of each side, in priority order
+	void get_order_records(std::vector<OrderRecord> &bids, std::vector<OrderRecord> &asks, std::size_t max_levels = std::numeric_limits<std::size_t>::max()) const
+	{
+		copy_order_records(bid_levels, bids, max_levels);
+		copy_order_records(ask_levels, asks, max_levels);
+	}
+
+	// Writes (price, volume) of the best `bids.size() / 2` and `asks.size() / 2` levels, best first. Levels past
+	// the last one of a side get a NaN price and a volume of 0.
+	void get_top_levels(std::span<float> bids, std::span<float> asks) const
+	{
+		auto fill_levels = [](const auto &levels, std::span<float> values)
+		{
+			auto value = values.begin();
+			for_each_level(levels, [&](const PriceLevel &level)
+			{
+				*value++ = level.price;
+				*value++ = static_cast<float>(level.volume);
+			}, values.size() / 2);
+			for (; value != values.end(); value += 2)
+			{
+				value[0] = std::numeric_limits<float>::quiet_NaN();
+				value[1] = 0.0f;
+			}
+		};
+		fill_levels(bid_levels, bids);
+		fill_levels(ask_levels, asks);
+	}
+
+	// The number of resting orders of `user_id`, O(1)
+	std::size_t get_user_order_count(UserID user_id) const noexcept
+	{
+		return user_id < user_orders.size() ? user_orders[user_id].count : 0;
+	}
+
+	// The resting orders of `user_id` in order id order, O(orders owned by the user)
+	std::vector<OrderID> get_all_user_orders(UserID user_id) const
+	{
+		std::vector<OrderID> result;
+		if (user_id >= user_orders.size())
+		{
+			return result;
+		}
+		const auto &list = user_orders[user_id];
+		result.reserve(list.count);
+		for (auto node = list.head; node != nullptr; node = node->user_next)
+		{
+			result.push_back(node->order.order_id);
+		}
+		return result;
+	}
+
+	uint64_t get_sequence() const noexcept
+	{
+		return sequence;
+	}
+
+	BookSnapshot get_snapshot() const
+	{
+		return BookSnapshot{.sequence = sequence, .book = get_limit_orders()};
+	}
+
+	// The changes since the previous call, O(changes). The log keeps its capacity for the next ones.
+	BookDelta take_delta()
+	{
+		auto delta = BookDelta{};
+		take_delta(delta);
+		return delta;
+	}
+
+	// Rebuilds the book captured by `get_snapshot` in time linear in its orders: levels come best first, so each
+	// is appended, and user lists are linked in id order. The orders are not logged as changes, the change log
+	// continues from the snapshot's sequence.
+	static OrderBook from_snapshot(const BookSnapshot &snapshot, float tick_size)
+	{
+		auto book = OrderBook(tick_size);
+		book.restore_levels(book.bid_levels, snapshot.book.first);
+		book.restore_levels(book.ask_levels, snapshot.book.second);
+		book.bid_count = snapshot.book.first.size();
+		book.ask_count = snapshot.book.second.size();
+		book.locator.for_each([&](uint32_t order_id, OrderNode *node)
+		{
+			book.link_user_order(node);
+		});
+		book.sequence = snapshot.sequence;
+		book.delta_sequence = snapshot.sequence;
+		return book;
+	}
+
+	// Drops every resting order without visiting them: the order nodes are taken back in bulk and kept for the
+	// orders that follow. A map book still frees one node per price level. The book starts over like a new one,
+	// sequence included.
+	void clear()
+	{
+		std::visit([](auto &side_levels)
+		{
+			side_levels.clear();
+		}, bid_levels);
+		std::visit([](auto &side_levels)
+		{
+			side_levels.clear();
+		}, ask_levels);
+		bid_count = 0;
+		ask_count = 0;
+		locator.clear();
+		user_orders.clear();
+		node_pool.clear();
+		sequence = 0;
+		delta_sequence = 0;
+		order_events.clear();
+		level_updates.clear();
+	}
+
+	// Drops the changes since the previous delta, the next one starts from the current sequence
+	void discard_delta() noexcept
+	{
+		level_updates.clear();
+		order_events.clear();
+		delta_sequence = sequence;
+	}
+
+	// Same as `take_delta()`, written into `delta` to reuse its capacity
+	void take_delta(BookDelta &delta)
+	{
+		delta.previous_sequence = delta_sequence;
+		delta.sequence = sequence;
+		delta.level_updates.clear();
+		// Order by level, then by log position so that the last update of a level wins. Positions are sorted
+		// rather than the log itself, a stable sort would take a temporary buffer from the heap on every step.
+		level_update_order.resize(level_updates.size());
+		std::iota(level_update_order.begin(), level_update_order.end(), uint32_t(0));
+		std::sort(level_update_order.begin(), level_update_order.end(), [&](uint32_t a, uint32_t b)
+		{
+			const auto &update_a = level_updates[a];
+			const auto &update_b = level_updates[b];
+			if (update_a.side != update_b.side)
+			{
+				return update_a.side < update_b.side;
+			}
+			return update_a.price != update_b.price ? update_a.price < update_b.price : a < b;
+		});
+		for (std::size_t i = 0; i < level_update_order.size(); i++)
+		{
+			const auto &update = level_updates[level_update_order[i]];
+			auto is_last = i + 1 == level_update_order.size() ||
+						   level_updates[level_update_order[i + 1]].side != update.side ||
+						   level_updates[level_update_order[i + 1]].price != update.price;
+			if (is_last)
+			{
+				delta.level_updates.push_back(update);
+			}
+		}
+		assign_reusing(delta.order_events, order_events);
+		level_updates.clear();
+		order_events.clear();
+		delta_sequence = sequence;
+	}
+};
+
+struct Transaction
+{
+	float price;
+	float volume;
+	UserID buyer_id;
+	UserID seller_id;
+	OrderID buyer_order_id;
+	OrderID seller_order_id;
+};
+
+// A trade of `volume` at `price` gives the buyer `volume` of `security_id` for `price * volume` of `currency_id`,
+// and the seller the opposite
+struct TradeSettlement
+{
+	SecurityID security_id;
+	SecurityID currency_id;
+};
+
+struct SimulationStepResult
+{
+	std::map<SecurityTicker, std::map<OrderID, float>> partially_transacted_orders;
+	std::map<SecurityTicker, std::set<OrderID>> fully_transacted_orders;
+	std::map<SecurityTicker, std::set<OrderID>> cancelled_orders;
+	std::map<SecurityTicker, std::vector<Transaction>> transactions;
+	std::map<SecurityTicker, BookDepth> order_book_depth_per_security;
+	std::map<SecurityTicker, FlatOrderBook> order_book_per_security;
+	std::vector<std::vector<float>> portfolios;
+	std::map<UserID, Username> user_id_to_username_map;
+	uint32_t current_step;
+	bool has_next_step;
+	std::map<SecurityTicker, std::vector<LimitOrder>> v2_submitted_orders;
+	std::map<SecurityTicker, std::vector<OrderID>> v2_cancelled_orders;
+	std::map<SecurityTicker, std::map<OrderID, float>> v2_transacted_orders;
+	std::map<SecurityTicker, BookDelta> book_deltas;
+};
+
+// What happened to one security during a step. The ordered maps and sets of `SimulationStepResult`
+// are vectors sorted by order id here.
+struct SecurityStepResult
+{
+	std::vector<std::pair<OrderID, float>> partially_transacted_orders; // order_id -> new volume
+	std::vector<OrderID> fully_transacted_orders;
+	std::vector<OrderID> cancelled_orders;
+	std::vector<Transaction> transactions;
+	std::vector<std::pair<float, float>> bid_depth; // (price, cumulative volume), best level first
+	std::vector<std::pair<float, float>> ask_depth;
+	FlatOrderBook order_book;
+	std::vector<LimitOrder> v2_submitted_orders;
+	std::vector<OrderID> v2_cancelled_orders;
+	std::vector<std::pair<OrderID, float>> v2_transacted_orders;
+	BookDelta book_delta;
+};
+
+// Step results indexed by `SecurityID`. The simulation owns one and refills it every step, so its containers
+// keep their capacity; tickers and usernames stay in the simulation instead of being copied into every step.
+struct StepResult
+{
+	std::vector<SecurityStepResult> securities;
+	std::vector<float> portfolios; // user_count x securities.size(), row major
+	uint32_t user_count = 0;
+	uint32_t current_step = 0;
+	bool has_next_step = false;
+};
+
+// Caller owned buffers filled by `GenericSimulation::run_steps`, an empty span is not filled in
+struct RunStepsOutput
+{
+	std::span<float> mid_prices;	   // step_count x securities, NaN when a side of the book is empty
+	std::span<float> traded_volumes;   // step_count x securities
+	std::span<float> final_portfolios; // users x securities after the last step, for the users there were at the start
+};
+
+// What `GenericSimulation::fill_observations` writes for each agent, a row of `get_feature_count` values.
+// For each of `security_ids`, in order:
+//   bids:      `book_levels` x (price, volume), best level first
+//   asks:      `book_levels` x (price, volume), best level first
+//   spread, mid
+//   trades:    `trade_count` x (price, volume), most recent first
+//   position:  the agent's holding of the security
+//   open orders: the number of the agent's resting orders in the book
+// followed by the agent's holding of `cash_id`. Missing levels and trades have a NaN price and a volume of 0,
+// the spread and mid are NaN while a side of the book is empty.
+struct ObservationSpec
+{
+	std::vector<SecurityID> security_ids = {};
+	SecurityID cash_id = 0;
+	uint32_t book_levels = 5;
+	uint32_t trade_count = 0; // Trades of previous steps are kept for this, the simulation only remembers trades once set
+
+	std::size_t get_security_feature_count() const noexcept
+	{
+		return 4 * std::size_t(book_levels) + 2 + 2 * std::size_t(trade_count) + 2;
+	}
+
+	std::size_t get_feature_count() const noexcept
+	{
+		return security_ids.size() * get_security_feature_count() + 1;
+	}
+};
+
+// The state of a simulation at the start of a step, see `GenericSimulation::snapshot`
+struct SimulationSnapshot
+{
+	uint32_t tick = 0;
+	OrderID next_order_id = 0;
+	MatchingMode matching_mode = MatchingMode::CONTINUOUS;
+	std::vector<BookSnapshot> books;					 // SecurityID -> resting orders
+	std::vector<float> tick_sizes;						 // SecurityID -> tick size
+	std::vector<std::vector<OrderVariant>> queued_orders; // SecurityID -> orders waiting for the next step
+	uint32_t user_count = 0;
+	std::vector<float> portfolios; // user_count x securities, row major
+	std::map<UserID, Username> user_id_to_username;
+};
+
+// Which fields a step fills in, the others are left empty. Flags are combined with `|`.
+enum class StepResultOptions : uint32_t
+{
+	NONE = 0,
+	TRANSACTIONS = 1 << 0,	   // transactions
+	V1_ORDER_UPDATES = 1 << 1, // partially_transacted_orders, fully_transacted_orders, cancelled_orders
+	V2_ORDER_UPDATES = 1 << 2, // v2_submitted_orders, v2_cancelled_orders, v2_transacted_orders
+	ORDER_BOOKS = 1 << 3,	   // order_book_per_security
+	BOOK_DEPTH = 1 << 4,	   // order_book_depth_per_security
+	BOOK_DELTAS = 1 << 5,	   // book_deltas
+	PORTFOLIOS = 1 << 6,	   // portfolios
+	USERNAMES = 1 << 7,		   // user_id_to_username_map
+	ALL = (1 << 8) - 1
+};
+
+constexpr StepResultOptions operator|(StepResultOptions a, StepResultOptions b) noexcept
+{
+	return static_cast<StepResultOptions>(static_cast<uint32_t>(a) | static_cast<uint32_t>(b));
+}
+
+constexpr bool has_option(StepResultOptions options, StepResultOptions option) noexcept
+{
+	return (static_cast<uint32_t>(options) & static_cast<uint32_t>(option)) != 0;
+}
+
+class ISecurity;
+class IPortfolioManager;
+
+class ISimulation
+{
+protected:
+	std::vector<SecurityTicker> tickers = {};
+	std::map<SecurityTicker, SecurityID> ticker_to_id = {};
+	std::map<SecurityTicker, std::shared_ptr<ISecurity>> ticker_to_security = {};
+	std::vector<std::shared_ptr<ISecurity>> securities_vector = {};
+	const float T;
+	const uint32_t N;
+	uint32_t tick = 0;
+	std::map<UserID, Username> user_id_to_username = {};
+
+protected:
+	std::vector<std::shared_ptr<ISecurity>> &get_securities() noexcept
+	{
+		return securities_vector;
+	}
+	void increment_tick() noexcept
+	{
+		tick += 1;
+	}
+	void reset_tick_to_zero() noexcept
+	{
+		tick = 0;
+	}
+	void set_tick(uint32_t value) noexcept
+	{
+		tick = value;
+	}
+
+public:
+	explicit ISimulation(
+		const std::map<SecurityTicker, std::shared_ptr<ISecurity>> &securities,
+		float T, uint32_t N) : T{T}, N{N}
+	{
+		uint32_t security_id = 0;
+		for (const auto &[ticker, security] : securities)
+		{
+			tickers.push_back(ticker);
+			ticker_to_id.emplace(ticker, security_id);
+			ticker_to_security.emplace(ticker, security);
+			securities_vector.push_back(security);
+			security_id += 1;
+		}
+	}
+	virtual ~ISimulation() = default;
+
+	// Utility methods
+	const std::vector<SecurityTicker> &get_all_tickers() const noexcept
+	{
+		return tickers;
+	};
+	const SecurityTicker &get_security_ticker(SecurityID security_id) const
+	{
+		if (security_id >= tickers.size())
+		{
+			throw IDNotFoundError(fmt::format("The id `{}` doesn't exist.", security_id));
+		}
+		return tickers.at(security_id);
+	};
+	SecurityID get_security_id(const SecurityTicker &security_ticker) const
+	{
+		const auto it = ticker_to_id.find(security_ticker);
+		if (it == ticker_to_id.end())
+		{
+			throw IDNotFoundError(fmt::format("The ticker `{}` doesn't exist.", security_ticker));
+		}
+		return it->second;
+	};
+	const std::map<UserID, Username> &get_user_id_to_username() const noexcept
+	{
+		return user_id_to_username;
+	}
+	uint32_t get_securities_count() const noexcept
+	{
+		return securities_vector.size();
+	}
+
+	// Simulation meta information
+	float get_dt() const noexcept
+	{
+		return T / N;
+	};
+	float get_t() const noexcept
+	{
+		return tick * T / N;
+	};
+	float get_T() const noexcept
+	{
+		return T;
+	};
+	uint32_t get_tick() const noexcept
+	{
+		return tick;
+	};
+	uint32_t get_N() const noexcept
+	{
+		return N;
+	};
+
+	// User management
+	virtual UserID add_user(const Username &username) = 0; // May throw
+	virtual uint32_t get_user_count() const noexcept = 0;
+	virtual std::vector<float> get_user_portfolio(UserID user_id) const = 0;								  // May throw
+	virtual void do_portfolio_callback(std::function<void(std::shared_ptr<IPortfolioManager>)> callback) = 0; // May throw
+
+	// Simulation order book information
+	virtual const LimitOrder &get_top_bid(SecurityID security_id) const = 0;								 // May throw
+	virtual const LimitOrder &get_top_ask(SecurityID security_id) const = 0;								 // May throw
+	virtual uint32_t get_bid_count(SecurityID security_id) const = 0;										 // May throw
+	virtual uint32_t get_ask_count(SecurityID security_id) const = 0;										 // May throw
+	virtual FlatOrderBook get_order_book(SecurityID security_id) const = 0;									 // May throw
+	virtual std::vector<OrderID> get_all_open_user_orders(UserID user_id, SecurityID security_id) const = 0; // May throw
+	virtual BookDepth get_cumulative_book_depth(SecurityID security_id) const = 0;							 // May throw
+	virtual BookDepth get_book_depth(SecurityID security_id, uint32_t levels) const = 0;					 // May throw
+	virtual BookSnapshot get_book_snapshot(SecurityID security_id) const = 0;								 // May throw
+	virtual float get_tick_size(SecurityID security_id) const = 0;											 // May throw
+	virtual MatchingMode get_matching_mode() const noexcept = 0;
+
+	// Simulation actions
+	virtual SimulationStepResult do_simulation_step() = 0;																	   // May throw
+	virtual OrderID submit_limit_order(UserID user_id, SecurityID security_id, OrderSide side, float price, float volume) = 0; // May throw
+	virtual void submit_cancel_order(UserID user_id, SecurityID security_id, OrderID order_id) = 0;							   // May throw
+	virtual void reset_simulation() = 0;
+	// TODO: can I do something better than this?
+	virtual OrderID direct_insert_limit_order(UserID user_id, SecurityID security_id, OrderSide side, float price, float volume) = 0;
+	virtual OrderID submit_market_order(UserID user_id, SecurityID security_id, OrderAction action, float volume) = 0; // May throw
+	virtual void set_tick_size(SecurityID security_id, float tick_size) = 0;										   // May throw
+	// Seeds a book with many orders at once, crossing orders are rejected or queued for matching depending on `match_crossing`
+	virtual std::vector<OrderID> bulk_insert_limit_orders(UserID user_id, SecurityID security_id, std::span<const OrderSide> sides, std::span<const float> prices, std::span<const float> volumes, bool match_crossing) = 0; // May throw
+	virtual void set_matching_mode(MatchingMode mode) = 0;
+
+	// TODO:
+	// public:
+	// virtual uint32_t get_bid_count(SecurityID security_id) const = 0;
+	// virtual uint32_t get_ask_count(SecurityID security_id) const = 0;
+	// virtual std::optional<const LimitOrder&> try_get_top_bid(SecurityID security_id) const = 0;
+	// virtual std::optional<const LimitOrder&> try_get_top_ask(SecurityID security_id) const = 0;
+	// replace `get_N` with `get_max_tick()`?
+	// protected:
+	// virtual bool does_user_id_exist() const noexcept = 0;
+	// virtual bool does_security_id_exist() const noexcept = 0;
+};
+
+class IPortfolioManager
+{
+public:
+	virtual ~IPortfolioManager() = default;
+
+	virtual uint32_t get_user_count() const noexcept = 0;
+	virtual std::vector<std::vector<float>> get_portfolio_table() const noexcept = 0;
+	virtual void reset_user_portfolio(UserID user_id) = 0;
+	virtual float add_to_security(UserID user_id, SecurityID security_1, float addition_1) = 0;															// May throw
+	virtual float multiply_to_security(UserID user_id, SecurityID security_1, float multiplier_1) = 0;													// May throw
+	virtual float multiply_to_security_if_negative(UserID user_id, SecurityID security_1, float multiplier_1) = 0;										// May throw
+	virtual FloatPair add_to_two_securities(UserID user_id, SecurityID security_1, float addition_1, SecurityID security_2, float addition_2) = 0;		// May throw
+	virtual float multiply_and_add_1_to_2(UserID user_id, SecurityID security_1, SecurityID security_2, float multiply) = 0;							// May throw
+	virtual float multiply_and_add_1_to_2_and_set_1(UserID user_id, SecurityID security_1, SecurityID security_2, float multiply, float set_value) = 0; // May throw
+
+	// virtual void lock_with_callback(UserID user_id, std::function<void(void)> callback) = 0; // May throw
+};
+
+class ISecurity
+{
+public:
+	virtual ~ISecurity() = default;
+
+	virtual bool is_tradeable() = 0;
+	virtual void before_step(ISimulation &simulation, std::shared_ptr<IPortfolioManager> portfolio) = 0;
+	virtual void after_step(ISimulation &simulation, std::shared_ptr<IPortfolioManager> portfolio) = 0;
+	virtual void on_simulation_start(ISimulation &simulation, std::shared_ptr<IPortfolioManager> portfolio) = 0;
+	virtual void on_simulation_end(ISimulation &simulation, std::shared_ptr<IPortfolioManager> portfolio) = 0;
+	virtual void on_trade_executed(
+		ISimulation &simulation,
+		std::shared_ptr<IPortfolioManager> portfolio,
+		UserID buyer_id, UserID seller_id, float transacted_price, float transacted_volume) = 0;
+
+	// Called once per step with the trades of the step, in the order they happened, when there are any.
+	// The default calls `on_trade_executed` for each trade, securities handling them together override this.
+	virtual void on_trades_executed(ISimulation &simulation, std::shared_ptr<IPortfolioManager> portfolio, std::span<const Transaction> transactions)
+	{
+		for (const auto &transaction : transactions)
+		{
+			on_trade_executed(simulation, portfolio, transaction.buyer_id, transaction.seller_id, transaction.price, transaction.volume);
+		}
+	}
+
+	// Securities settling as a plain exchange of the security against a currency return both ids here,
+	// the simulation then settles every trade of a step in one pass and skips `on_trade_executed`
+	virtual std::optional<TradeSettlement> get_trade_settlement(ISimulation &simulation)
+	{
+		return std::nullopt;
+	}
+
+	// The instance a forked simulation uses, `self` being this security. Securities without state of their own
+	// are shared between forks (the default); securities keeping state must return a copy.
+	virtual std::shared_ptr<ISecurity> fork_security(std::shared_ptr<ISecurity> self)
+	{
+		return self;
+	}
+};
+
+// A participant driven by the simulation itself, see `GenericSimulation::run_steps`
+class IAgent
+{
+public:
+	virtual ~IAgent() = default;
+
+	// Called before every step, typically to submit or cancel orders
+	virtual void on_step(ISimulation &simulation) = 0;
+};
+
+class UserAndPortfolioManager : public IPortfolioManager
+{
+	std::atomic<uint32_t> user_count = 0; // Read without a lock by order submissions, written under `data_mutex`
+	uint32_t capacity = 0;
+	const uint32_t columns;
+
+	std::shared_ptr<float[]> data = nullptr; // Shared with the views handed out by `share_portfolio_data`
+	mutable std::shared_mutex data_mutex = std::shared_mutex();
+	mutable std::unique_ptr<std::mutex[]> user_mutexes;
+
+public:
+	explicit UserAndPortfolioManager(const uint32_t columns) : columns{columns} {}
+
+	const uint32_t get_column_count() const noexcept
+	{
+		return columns;
+	}
+
+	uint32_t get_user_count() const noexcept override
+	{
+		return user_count;
+	}
+
+	UserID register_new_user() noexcept
+	{
+		auto write_lock = std::unique_lock(data_mutex);
+		auto user_id = user_count++;
+
+		if (user_count > capacity)
+		{
+			capacity = std::max(1u, capacity * 2);
+
+			// Resize data buffer
+			auto new_data_ptr = std::make_shared<float[]>(capacity * columns);
+			std::fill(new_data_ptr.get(), new_data_ptr.get() + capacity * columns, 0.0f);
+
+			if (data != nullptr)
+			{
+				std::memcpy(new_data_ptr.get(), data.get(), (user_count - 1) * columns * sizeof(float));
+			}
+			data = std::move(new_data_ptr);
+
+			auto new_mutexes = std::make_unique<std::mutex[]>(capacity);
+			// no need to copy old ones, just replace
+			user_mutexes = std::move(new_mutexes);
+		}
+
+		// Zero out just the new row
+		std::fill(data.get() + user_id * columns, data.get() + (user_id + 1) * columns, 0.0f);
+		return user_id;
+	}
+
+	// Copies the whole table into `table` (user_count x columns, row major) under a single lock
+	void copy_portfolio_table(std::vector<float> &table) const
+	{
+		auto write_lock = std::unique_lock(data_mutex);
+		table.assign(data.get(), data.get() + std::size_t(user_count) * columns);
+	}
+
+	// Replaces the users and their portfolios with `table` (`restored_user_count x columns`, row major)
+	void restore_portfolio_table(uint32_t restored_user_count, std::span<const float> table)
+	{
+		if (table.size() != std::size_t(restored_user_count) * columns)
+		{
+			throw std::runtime_error(fmt::format("Cannot restore `{}` users from `{}` portfolio values.", restored_user_count, table.size()));
+		}
+		auto write_lock = std::unique_lock(data_mutex);
+		if (restored_user_count > capacity)
+		{
+			capacity = restored_user_count;
+			data = std::make_shared<float[]>(std::size_t(capacity) * columns);
+			user_mutexes = std::make_unique<std::mutex[]>(capacity);
+		}
+		user_count = restored_user_count;
+		std::copy(table.begin(), table.end(), data.get());
+	}
+
+	// Same as above into a caller owned buffer, which must hold exactly user_count x columns values
+	void copy_portfolio_table(std::span<float> table) const
+	{
+		auto write_lock = std::unique_lock(data_mutex);
+		if (table.size() != std::size_t(user_count) * columns)
+		{
+			throw std::runtime_error(fmt::format("Cannot copy `{}` portfolio values into a buffer of `{}`.", std::size_t(user_count) * columns, table.size()));
+		}
+		std::copy(data.get(), data.get() + table.size(), table.begin());
+	}
+
+	// Copies the portfolios of the first `table.size() / columns` users, those there were before later users were added
+	void copy_first_portfolios(std::span<float> table) const
+	{
+		auto write_lock = std::unique_lock(data_mutex);
+		if (table.size() % columns != 0 || table.size() > std::size_t(user_count) * columns)
+		{
+			throw std::runtime_error(fmt::format("Cannot copy the first portfolios of `{}` users into a buffer of `{}`.", uint32_t(user_count), table.size()));
+		}
+		std::copy(data.get(), data.get() + table.size(), table.begin());
+	}
+
+	// Copies the portfolio of one user into `portfolio`, which must hold exactly `columns` values
+	void copy_user_portfolio(UserID user_id, std::span<float> portfolio) const
+	{
+		if (user_id >= user_count)
+		{
+			throw IDNotFoundError(fmt::format("Could not find user with id `{}`.", user_id));
+		}
+		if (portfolio.size() != columns)
+		{
+			throw std::runtime_error(fmt::format("Cannot copy `{}` portfolio values into a buffer of `{}`.", columns, portfolio.size()));
+		}
+		auto read_lock = std::shared_lock(data_mutex);
+		auto user_lock = std::unique_lock(user_mutexes[user_id]);
+		std::copy(data.get() + std::size_t(user_id) * columns, data.get() + std::size_t(user_id + 1) * columns, portfolio.begin());
+	}
+
+	// The table itself (`user_count x columns`, row major) and its user count. Values change as trades settle.
+	// The storage moves when users are added or restored, the shared one then stays alive but is no longer updated.
+	std::pair<std::shared_ptr<const float[]>, uint32_t> share_portfolio_data() const
+	{
+		auto read_lock = std::shared_lock(data_mutex);
+		return {data, user_count};
+	}
+
+	// Calls `read` with the table (`user_count x columns`, row major) under a single read lock
+	template <typename F>
+	void read_portfolio_table(F &&read) const
+	{
+		auto read_lock = std::shared_lock(data_mutex);
+		read(std::span<const float>(data.get(), std::size_t(user_count) * columns));
+	}
+
+	// Inherited methods
+	std::vector<std::vector<float>> get_portfolio_table() const noexcept override
+	{
+		auto read_lock = std::shared_lock(data_mutex);
+		auto table = std::vector<std::vector<float>>(user_count, std::vector<float>(columns));
+
+		for (UserID user_index = 0; user_index < user_count; user_index++)
+		{
+			std::unique_lock user_lock(user_mutexes[user_index]);
+			std::memcpy(
+				table[user_index].data(),
+				data.get() + user_index * columns,
+				columns * sizeof(float));
+		}
+
+		return table;
+	}
+
+	// Zeroes the portfolios of every user at once
+	void reset_portfolios()
+	{
+		auto write_lock = std::unique_lock(data_mutex);
+		std::fill(data.get(), data.get() + std::size_t(user_count) * columns, 0.0f);
+	}
+
+	void reset_user_portfolio(UserID user_id) override
+	{
+		if (user_id >= user_count)
+		{
+			throw IDNotFoundError(fmt::format("Could not find user with id `{}`.", user_id));
+		}
+		auto read_lock = std::shared_lock(data_mutex);
+		auto user_lock = std::unique_lock(user_mutexes[user_id]);
+
+		std::fill(data.get() + user_id * columns, data.get() + (user_id + 1) * columns, 0.0f);
+	}
+
+	// `security_1 += addition_1`
+	// returns: the new value of the security in the portfolio
+	float add_to_security(UserID user_id, SecurityID security_1, float addition_1) override
+	{
+		if (user_id >= user_count)
+		{
+			throw IDNotFoundError(fmt::format("Could not find user_id: `{}`.", user_id));
+		}
+		if (security_1 >= columns)
+		{
+			throw IDNotFoundError(fmt::format("Could not find security_1: `{}`.", security_1));
+		}
+		auto read_lock = std::shared_lock(data_mutex);
+		auto user_lock = std::unique_lock(user_mutexes[user_id]);
+
+		auto &ref = data[user_id * columns + security_1];
+		ref += addition_1;
+		return ref;
+	}
+
+	// `security_1 *= multiplier_1`
+	// returns: the new value of the security in the portfolio
+	float multiply_to_security(UserID user_id, SecurityID security_1, float multiplier_1) override
+	{
+		if (user_id >= user_count)
+		{
+			throw IDNotFoundError(fmt::format("Could not find user_id: `{}`.", user_id));
+		}
+		if (security_1 >= columns)
+		{
+			throw IDNotFoundError(fmt::format("Could not find security_1: `{}`.", security_1));
+		}
+		auto read_lock = std::shared_lock(data_mutex);
+		auto user_lock = std::unique_lock(user_mutexes[user_id]);
+
+		auto &ref = data[user_id * columns + security_1];
+		ref *= multiplier_1;
+		return ref;
+	}
+
+	// `security_1 *= multiplier_1` if `security_1 < 0`
+	// returns: the new value of the security in the portfolio
+	float multiply_to_security_if_negative(UserID user_id, SecurityID security_1, float multiplier_1) override
+	{
+		if (user_id >= user_count)
+		{
+			throw IDNotFoundError(fmt::format("Could not find user_id: `{}`.", user_id));
+		}
+		if (security_1 >= columns)
+		{
+			throw IDNotFoundError(fmt::format("Could not find security_1: `{}`.", security_1));
+		}
+		auto read_lock = std::shared_lock(data_mutex);
+		auto user_lock = std::unique_lock(user_mutexes[user_id]);
+
+		auto &ref = data[user_id * columns + security_1];
+		if (ref < 0.0)
+		{
+			ref *= multiplier_1;
+		}
+		return ref;
+	}
+
+	// `security_1 += addition_1`, `security_2 += addition_2`
+	// returns: a pair of the new portfolio values
+	FloatPair add_to_two_securities(UserID user_id, SecurityID security_1, float addition_1, SecurityID security_2, float addition_2) override
+	{
+		if (user_id >= user_count)
+		{
+			throw IDNotFoundError(fmt::format("Could not find user_id: `{}`.", user_id));
+		}
+		if (security_1 >= columns)
+		{
+			throw IDNotFoundError(fmt::format("Could not find security_1: `{}`.", security_1));
+		}
+		if (security_2 >= columns)
+		{
+			throw IDNotFoundError(fmt::format("Could not find security_2: `{}`.", security_1));
+		}
+		if (security_1 == security_2)
+		{
+			throw std::runtime_error(fmt::format("Received the same security twice: `{}`", security_1));
+		}
+		auto read_lock = std::shared_lock(data_mutex);
+		auto user_lock = std::unique_lock(user_mutexes[user_id]);
+
+		auto &ref_1 = data[user_id * columns + security_1];
+		ref_1 += addition_1;
+		auto &ref_2 = data[user_id * columns + security_2];
+		ref_2 += addition_2;
+		return {ref_1, ref_2};
+	}
+
+	// Settles `transactions` in order: the buyer gets `volume` of `security_id` for `price * volume` of `currency_id`,
+	// the seller the opposite. Same arithmetic as two `add_to_two_securities` per trade, but the table is locked
+	// once for the whole batch instead of taking a user lock per portfolio update
+	void settle_trades(std::span<const Transaction> transactions, SecurityID security_id, SecurityID currency_id)
+	{
+		if (security_id >= columns)
+		{
+			throw IDNotFoundError(fmt::format("Could not find security_id: `{}`.", security_id));
+		}
+		if (currency_id >= columns)
+		{
+			throw IDNotFoundError(fmt::format("Could not find currency_id: `{}`.", currency_id));
+		}
+		if (security_id == currency_id)
+		{
+			throw std::runtime_error(fmt::format("Received the same security twice: `{}`", security_id));
+		}
+		auto write_lock = std::unique_lock(data_mutex);
+		for (const auto &transaction : transactions)
+		{
+			if (transaction.buyer_id >= user_count || transaction.seller_id >= user_count)
+			{
+				throw IDNotFoundError(fmt::format("Could not find user_id: `{}`.", std::max(transaction.buyer_id, transaction.seller_id)));
+			}
+		}
+
+		for (const auto &transaction : transactions)
+		{
+			auto buyer_row = data.get() + std::size_t(transaction.buyer_id) * columns;
+			buyer_row[security_id] += transaction.volume;
+			buyer_row[currency_id] += -transaction.price * transaction.volume;
+			auto seller_row = data.get() + std::size_t(transaction.seller_id) * columns;
+			seller_row[security_id] += -transaction.volume;
+			seller_row[currency_id] += transaction.price * transaction.volume;
+		}
+	}
+
+	// `security_2 += security_1 * multiply`
+	// returns: the new value of security_2
+	float multiply_and_add_1_to_2(UserID user_id, SecurityID security_1, SecurityID security_2, float multiply) override
+	{
+		if (user_id >= user_count)
+		{
+			throw IDNotFoundError(fmt::format("Could not find user_id: `{}`.", user_id));
+		}
+		if (security_1 >= columns)
+		{
+			throw IDNotFoundError(fmt::format("Could not find security_1: `{}`.", security_1));
+		}
+		if (security_2 >= columns)
+		{
+			throw IDNotFoundError(fmt::format("Could not find security_2: `{}`.", security_1));
+		}
+		if (security_1 == security_2)
+		{
+			throw std::runtime_error(fmt::format("Received the same security twice: `{}`", security_1));
+		}
+		auto read_lock = std::shared_lock(data_mutex);
+		auto user_lock = std::unique_lock(user_mutexes[user_id]);
+
+		auto &ref_to_multiply_from = data[user_id * columns + security_1];
+		auto &ref_to_mult_and_add = data[user_id * columns + security_2];
+		ref_to_mult_and_add += ref_to_multiply_from * multiply;
+		return ref_to_mult_and_add;
+	}
+
+	// `security_2 += security_1 * multiply`, then `security_1 = set_value`
+	// returns: the new value of security_2
+	float multiply_and_add_1_to_2_and_set_1(UserID user_id, SecurityID security_1, SecurityID security_2, float multiply, float set_value) override
+	{
+		if (user_id >= user_count)
+		{
+			throw IDNotFoundError(fmt::format("Could not find user_id: `{}`.", user_id));
+		}
+		if (security_1 >= columns)
+		{
+			throw IDNotFoundError(fmt::format("Could not find security_1: `{}`.", security_1));
+		}
+		if (security_2 >= columns)
+		{
+			throw IDNotFoundError(fmt::format("Could not find security_2: `{}`.", security_1));
+		}
+		if (security_1 == security_2)
+		{
+			throw std::runtime_error(fmt::format("Received the same security twice: `{}`", security_1));
+		}
+		auto read_lock = std::shared_lock(data_mutex);
+		auto user_lock = std::unique_lock(user_mutexes[user_id]);
+
+		auto &ref_to_set = data[user_id * columns + security_1];
+		auto &ref_to_mult_and_add = data[user_id * columns + security_2];
+		ref_to_mult_and_add += ref_to_set * multiply;
+		ref_to_set = set_value;
+		return ref_to_mult_and_add;
+	}
+};
+
+// Monotonic memory for containers that only live during a single simulation step, everything is
+// released at once by `reset`. When a step overflows the buffer it is grown to fit, so the following
+// steps of a similar size never reach the heap.
+class StepArena
+{
+	// Upstream of the monotonic resource, records how much the buffer overflowed by
+	class OverflowResource : public std::pmr::memory_resource
+	{
+	public:
+		std::size_t overflow_bytes = 0;
+
+	private:
+		void *do_allocate(std::size_t bytes, std::size_t alignment) override
+		{
+			overflow_bytes += bytes;
+			return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+		}
+		void do_deallocate(void *pointer, std::size_t bytes, std::size_t alignment) override
+		{
+			std::pmr::new_delete_resource()->deallocate(pointer, bytes, alignment);
+		}
+		bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+		{
+			return this == &other;
+		}
+	};
+
+	std::size_t capacity;
+	std::unique_ptr<std::byte[]> buffer;
+	OverflowResource overflow;
+	std::optional<std::pmr::monotonic_buffer_resource> resource;
+
+public:
+	explicit StepArena(std::size_t capacity = 64 * 1024) : capacity{capacity}, buffer{new std::byte[capacity]}
+	{
+		resource.emplace(buffer.get(), capacity, &overflow);
+	}
+	StepArena(const StepArena &) = delete;
+	StepArena &operator=(const StepArena &) = delete;
+
+	std::pmr::memory_resource *get() noexcept
+	{
+		return &*resource;
+	}
+
+	// Every container using the arena must have been destroyed
+	void reset()
+	{
+		if (overflow.overflow_bytes == 0)
+		{
+			resource->release();
+			return;
+		}
+		resource.reset();
+		capacity = std::bit_ceil(capacity + overflow.overflow_bytes);
+		buffer.reset(new std::byte[capacity]);
+		overflow.overflow_bytes = 0;
+		resource.emplace(buffer.get(), capacity, &overflow);
+	}
+};
+
+// Checks that an array of a batch call holds one value per item
+void check_batch_size(std::size_t size, std::size_t expected, const char *name)
+{
+	if (size != expected)
+	{
+		throw std::runtime_error(fmt::format("Expected `{}` values in `{}`, received: `{}`.", expected, name, size));
+	}
+}
+
+// Branch free checks of the sides, prices and volumes of a batch of limit orders, of the same length, only looking
+// for the culprit if one failed. Comparisons with NaN are false, so NaN and infinite values fail the range checks too.
+// With `skip_empty`, orders of volume `0` are padding and only their side is checked.
+void check_limit_order_values(std::span<const OrderSide> sides, std::span<const float> prices, std::span<const float> volumes, bool skip_empty = false)
+{
+	auto count = sides.size();
+	constexpr auto max_value = std::numeric_limits<float>::max();
+	bool all_valid = true;
+	for (std::size_t i = 0; i < count; i++)
+	{
+		all_valid &= (sides[i] == OrderSide::BID) | (sides[i] == OrderSide::ASK);
+		all_valid &= (skip_empty & (volumes[i] == 0.0f)) | ((prices[i] > 0) & (prices[i] <= max_value) & (volumes[i] > 0) & (volumes[i] <= max_value));
+	}
+	if (!all_valid)
+	{
+		for (std::size_t i = 0; i < count; i++)
+		{
+			if (sides[i] != OrderSide::BID && sides[i] != OrderSide::ASK)
+			{
+				throw std::runtime_error(fmt::format("Cannot submit a limit order with an invalid side, received: `{}` at index `{}`.", static_cast<int>(sides[i]), i));
+			}
+			if (skip_empty && volumes[i] == 0.0f)
+			{
+				continue;
+			}
+			if (!(volumes[i] > 0 && volumes[i] <= max_value))
+			{
+				throw std::runtime_error(fmt::format("Cannot submit a limit order with non-positive volume, received: `{}` at index `{}`.", volumes[i], i));
+			}
+			if (!(prices[i] > 0 && prices[i] <= max_value))
+			{
+				throw std::runtime_error(fmt::format("Cannot submit a limit order with non-positive price, received: `{}` at index `{}`.", prices[i], i));
+			}
+		}
+	}
+}
+
+// Same for the actions and volumes of a batch of market orders
+void check_market_order_values(std::span<const OrderAction> actions, std::span<const float> volumes, bool skip_empty = false)
+{
+	auto count = actions.size();
+	constexpr auto max_value = std::numeric_limits<float>::max();
+	bool all_valid = true;
+	for (std::size_t i = 0; i < count; i++)
+	{
+		all_valid &= (actions[i] == OrderAction::BUY) | (actions[i] == OrderAction::SELL);
+		all_valid &= (skip_empty & (volumes[i] == 0.0f)) | ((volumes[i] > 0) & (volumes[i] <= max_value));
+	}
+	if (!all_valid)
+	{
+		for (std::size_t i = 0; i < count; i++)
+		{
+			if (actions[i] != OrderAction::BUY && actions[i] != OrderAction::SELL)
+			{
+				throw std::runtime_error(fmt::format("Cannot submit a market order with an invalid action, received: `{}` at index `{}`.", static_cast<int>(actions[i]), i));
+			}
+			if (!(skip_empty && volumes[i] == 0.0f) && !(volumes[i] > 0 && volumes[i] <= max_value))
+			{
+				throw std::runtime_error(fmt::format("Cannot submit a market order with non-positive volume, received: `{}` at index `{}`.", volumes[i], i));
+			}
+		}
+	}
+}
+
+class GenericSimulation : public ISimulation
+{
+	std::shared_ptr<UserAndPortfolioManager> user_portfolio_manager;
+	std::vector<OrderBook> order_books = {};
+
+	// Orders submitted to one security for the next step. Submitting threads only contend on the queue of the
+	// security they trade, and the step swaps `pending` out before matching, so orders for the next step are
+	// accepted while the current one is matched. Both vectors keep their capacity from step to step.
+	struct alignas(64) SecurityOrderQueue
+	{
+		std::mutex mutex = std::mutex();
+		std::vector<OrderVariant> pending = {};	 // Filled by submissions, guarded by `mutex`
+		std::vector<OrderVariant> matching = {}; // The orders of the current step, only touched by the step
+		float tick_size = 0.0f;					 // Copy of the book's tick size, so submissions can snap prices without the book
+	};
+
+	// Guards the order books and the step state. Held for the whole step, but never by order submissions.
+	mutable std::mutex step_mutex = std::mutex();
+	std::atomic<std::thread::id> stepping_thread = std::thread::id(); // The thread running a step, if any
+	std::vector<std::unique_ptr<SecurityOrderQueue>> order_queues = {};
+	// Taken under the queue lock of the order's security, so ids increase in queue order within a security
+	std::atomic<OrderID> order_id_counter = 0;
+
+	// Everything matching the queued orders of one security produces during a step, allocated from its arena
+	struct SecurityStepScratch
+	{
+		std::pmr::map<OrderID, float> partially_transacted_orders;
+		std::pmr::set<OrderID> fully_transacted_orders;
+		std::pmr::set<OrderID> cancelled_orders;
+		std::pmr::vector<Transaction> transactions;
+		std::pmr::vector<LimitOrder> v2_submitted_orders;
+		std::pmr::vector<OrderID> v2_cancelled_orders;
+		std::pmr::map<OrderID, float> v2_transacted_orders;
+		std::pmr::vector<SweepFill> fills;
+		std::pmr::vector<MarketOrder> market_buys;
+		std::pmr::vector<MarketOrder> market_sells;
+		std::exception_ptr error = nullptr; // Set when matching threw on a pool thread
+
+		explicit SecurityStepScratch(std::pmr::memory_resource *arena) : partially_transacted_orders(arena),
+																		 fully_transacted_orders(arena),
+																		 cancelled_orders(arena),
+																		 transactions(arena),
+																		 v2_submitted_orders(arena),
+																		 v2_cancelled_orders(arena),
+																		 v2_transacted_orders(arena),
+																		 fills(arena),
+																		 market_buys(arena),
+																		 market_sells(arena) {}
+	};
+
+	// One arena and scratch per security, so that securities can be matched in parallel
+	std::vector<std::unique_ptr<StepArena>> step_arenas = {};
+	std::vector<std::optional<SecurityStepScratch>> step_scratch = {};
+	std::unique_ptr<ThreadPool> matching_pool = nullptr; // `nullptr` matches the securities one after another
+	uint64_t last_step_allocation_count = 0;
+
+	MatchingMode matching_mode = MatchingMode::CONTINUOUS;
+
+	StepResult step_result = {}; // Refilled by every step
+	StepResultOptions step_result_options = StepResultOptions::ALL;
+
+	// The most recent trades of a security, in a ring that overwrites the oldest one
+	struct TradePrints
+	{
+		std::vector<std::pair<float, float>> prints = {}; // (price, volume)
+		std::size_t next = 0;							  // Where the next trade goes
+		std::size_t count = 0;
+
+		void record(float price, float volume) noexcept
+		{
+			if (prints.empty())
+			{
+				return;
+			}
+			prints[next] = {price, volume};
+			next = (next + 1) % prints.size();
+			count = std::min(count + 1, prints.size());
+		}
+
+		// Writes (price, volume) pairs most recent first, NaN prices and 0 volumes past the oldest trade
+		void copy_recent(std::span<float> values) const noexcept
+		{
+			auto index = next;
+			for (std::size_t i = 0; i < values.size() / 2; i++)
+			{
+				if (i < count)
+				{
+					index = (index + prints.size() - 1) % prints.size();
+					values[2 * i] = prints[index].first;
+					values[2 * i + 1] = prints[index].second;
+				}
+				else
+				{
+					values[2 * i] = std::numeric_limits<float>::quiet_NaN();
+					values[2 * i + 1] = 0.0f;
+				}
+			}
+		}
+
+		void clear() noexcept
+		{
+			next = 0;
+			count = 0;
+		}
+	};
+
+	ObservationSpec observation_spec = {};
+	std::vector<TradePrints> trade_prints = {}; // SecurityID -> recent trades, only kept for `observation_spec`
+
+	// Holds the step lock for a step and marks the calling thread as the one running it, see `lock_for_reading`
+	class StepGuard
+	{
+		GenericSimulation &simulation;
+		std::unique_lock<std::mutex> step_lock;
+
+	public:
+		explicit StepGuard(GenericSimulation &simulation) : simulation{simulation}, step_lock{simulation.step_mutex}
+		{
+			simulation.stepping_thread.store(std::this_thread::get_id(), std::memory_order_relaxed);
+		}
+		StepGuard(const StepGuard &) = delete;
+		StepGuard &operator=(const StepGuard &) = delete;
+		~StepGuard()
+		{
+			simulation.stepping_thread.store(std::thread::id(), std::memory_order_relaxed);
+		}
+	};
+
+	// Book readers wait for a running step to finish, except on the thread running it: the security hooks
+	// called by the step read the books too, and it already holds the lock
+	std::unique_lock<std::mutex> lock_for_reading() const
+	{
+		if (stepping_thread.load(std::memory_order_relaxed) == std::this_thread::get_id())
+		{
+			return std::unique_lock(step_mutex, std::defer_lock);
+		}
+		return std::unique_lock(step_mutex);
+	}
+
+	// Branch free checks of the users and securities of a batch, only looking for the culprit if one failed
+	void check_batch_ids(std::span<const UserID> user_ids, std::span<const SecurityID> security_ids) const
+	{
+		auto user_count = get_user_count();
+		auto securities_count = get_securities_count();
+		bool all_valid = true;
+		for (std::size_t i = 0; i < user_ids.size(); i++)
+		{
+			all_valid &= (user_ids[i] < user_count) & (security_ids[i] < securities_count);
+		}
+		if (all_valid)
+		{
+			return;
+		}
+		for (std::size_t i = 0; i < user_ids.size(); i++)
+		{
+			if (user_ids[i] >= user_count)
+			{
+				throw IDNotFoundError(fmt::format("The user_id: `{}` doesn't exist, at index `{}`.", user_ids[i], i));
+			}
+			if (security_ids[i] >= securities_count)
+			{
+				throw IDNotFoundError(fmt::format("The security_id: `{}` doesn't exist, at index `{}`.", security_ids[i], i));
+			}
+		}
+	}
+
+	// Locks the queue of every security in `security_ids`, in security id order. A batch holds them all while it
+	// takes its ids, so its ids keep increasing in queue order within each security.
+	std::vector<std::unique_lock<std::mutex>> lock_order_queues(std::span<const SecurityID> security_ids)
+	{
+		auto used = std::vector<bool>(get_securities_count());
+		for (auto security_id : security_ids)
+		{
+			used[security_id] = true;
+		}
+		auto queue_locks = std::vector<std::unique_lock<std::mutex>>();
+		for (SecurityID security_id = 0; security_id < used.size(); security_id++)
+		{
+			if (used[security_id])
+			{
+				queue_locks.emplace_back(order_queues[security_id]->mutex);
+			}
+		}
+		return queue_locks;
+	}
+
+public:
+	explicit GenericSimulation(
+		const std::map<SecurityTicker, std::shared_ptr<ISecurity>> &securities,
+		float T,
+		uint32_t N) : ISimulation(securities, T, N)
+	{
+		for (uint32_t i = 0; i < securities.size(); i++)
+		{
+			order_books.push_back(OrderBook());
+			order_queues.push_back(std::make_unique<SecurityOrderQueue>());
+			step_arenas.push_back(std::make_unique<StepArena>());
+			step_scratch.emplace_back();
+		}
+		step_result.securities.resize(securities.size());
+		user_portfolio_manager = std::make_shared<UserAndPortfolioManager>((uint32_t)securities.size());
+	}
+
+	// User management
+	UserID add_user(const Username &username) override
+	{
+		// Waits for a running step, which copies the usernames and the portfolio table
+		auto step_lock = lock_for_reading();
+		auto user_id = user_portfolio_manager->register_new_user();
+		user_id_to_username.emplace(user_id, username);
+		return user_id;
+	};
+	uint32_t get_user_count() const noexcept override
+	{
+		return user_portfolio_manager->get_user_count();
+	};
+	std::vector<float> get_user_portfolio(UserID user_id) const override
+	{
+		if (user_id >= get_user_count())
+		{
+			throw IDNotFoundError(fmt::format("The user_id: `{}` doesn't exist.", user_id));
+		}
+		auto portfolio = std::vector<float>(get_securities_count());
+		user_portfolio_manager->copy_user_portfolio(user_id, portfolio);
+		return portfolio;
+	}
+	void do_portfolio_callback(std::function<void(std::shared_ptr<IPortfolioManager>)> callback) override
+	{
+		callback(user_portfolio_manager);
+	}
+
+	// Simulation order book information
+	const LimitOrder &get_top_bid(SecurityID security_id) const override
+	{
+		if (order_books.size() <= security_id)
+		{
+			throw IDNotFoundError(fmt::format("Could not find order book with security_id: `{}`.", security_id));
+		}
+		auto read_lock = lock_for_reading();
+		return order_books.at(security_id).top_bid();
+	};
+	const LimitOrder &get_top_ask(SecurityID security_id) const override
+	{
+		if (order_books.size() <= security_id)
+		{
+			throw IDNotFoundError(fmt::format("Could not find order book with security_id: `{}`.", security_id));
+		}
+		auto read_lock = lock_for_reading();
+		return order_books.at(security_id).top_ask();
+	};
+	uint32_t get_bid_count(SecurityID security_id) const override
+	{
+		if (order_books.size() <= security_id)
+		{
+			throw IDNotFoundError(fmt::format("Could not find order book with security_id: `{}`.", security_id));
+		}
+		auto read_lock = lock_for_reading();
+		return order_books.at(security_id).bid_size();
+	};
+	uint32_t get_ask_count(SecurityID security_id) const override
+	{
+		if (order_books.size() <= security_id)
+		{
+			throw IDNotFoundError(fmt::format("Could not find order book with security_id: `{}`.", security_id));
+		}
+		auto read_lock = lock_for_reading();
+		return order_books.at(security_id).ask_size();
+	};
+	FlatOrderBook get_order_book(SecurityID security_id) const override
+	{
+		if (tickers.size() <= security_id)
+		{
+			throw IDNotFoundError(fmt::format("The security_id: `{}` doesn't exist.", security_id));
+		}
+		auto read_lock = lock_for_reading();
+		return order_books.at(security_id).get_limit_orders();
+	};
+	std::vector<OrderID> get_all_open_user_orders(UserID user_id, SecurityID security_id) const override
+	{
+		if (user_portfolio_manager->get_user_count() <= user_id)
+		{
+			throw IDNotFoundError(fmt::format("The user_id: `{}` doesn't exist.", user_id));
+		}
+		if (tickers.size() <= security_id)
+		{
+			throw IDNotFoundError(fmt::format("The security_id: `{}` doesn't exist.", security_id));
+		}
+		auto read_lock = lock_for_reading();
+		return order_books.at(security_id).get_all_user_orders(user_id);
+	};
+	BookDepth get_cumulative_book_depth(SecurityID security_id) const override
+	{
+		if (tickers.size() <= security_id)
+		{
+			throw IDNotFoundError(fmt::format("The security_id: `{}` doesn't exist.", security_id));
+		}
+		auto read_lock = lock_for_reading();
+		return order_books.at(security_id).get_book_depth();
+	};
+	BookDepth get_book_depth(SecurityID security_id, uint32_t levels) const override
+	{
+		if (tickers.size() <= security_id)
+		{
+			throw IDNotFoundError(fmt::format("The security_id: `{}` doesn't exist.", security_id));
+		}
+		auto read_lock = lock_for_reading();
+		return order_books.at(security_id).get_book_depth(levels);
+	};
+	BookSnapshot get_book_snapshot(SecurityID security_id) const override
+	{
+		if (tickers.size() <= security_id)
+		{
+			throw IDNotFoundError(fmt::format("The security_id: `{}` doesn't exist.", security_id));
+		}
+		auto read_lock = lock_for_reading();
+		return order_books.at(security_id).get_snapshot();
+	};
+	float get_tick_size(SecurityID security_id) const override
+	{
+		if (tickers.size() <= security_id)
+		{
+			throw IDNotFoundError(fmt::format("The security_id: `{}` doesn't exist.", security_id));
+		}
+		auto read_lock = lock_for_reading();
+		return order_books.at(security_id).get_tick_size();
+	};
+	MatchingMode get_matching_mode() const noexcept override
+	{
+		return matching_mode;
+	}
+
+	// Heap allocations made by the last step, from the security hooks to the filled `StepResult`, only counted
+	// when built with `TRADERRANK_COUNT_ALLOCATIONS` (otherwise always 0). Converting it into the returned
+	// `SimulationStepResult` of `do_simulation_step` is not included.
+	uint64_t get_last_step_allocation_count() const noexcept
+	{
+		return last_step_allocation_count;
+	}
+
+	// Matches the securities of a step on `thread_count` threads, the stepping thread included.
+	// `1` matches them one after another, `0` uses one thread per hardware thread.
+	// The step results are identical whatever the number of threads.
+	void set_matching_threads(uint32_t thread_count)
+	{
+		if (thread_count == 0)
+		{
+			thread_count = std::max(1u, std::thread::hardware_concurrency());
+		}
+		auto step_lock = std::unique_lock(step_mutex);
+		matching_pool = thread_count > 1 ? std::make_unique<ThreadPool>(thread_count) : nullptr;
+	}
+
+	uint32_t get_matching_threads() const noexcept
+	{
+		return matching_pool != nullptr ? static_cast<uint32_t>(matching_pool->size()) : 1;
+	}
+
+	// Fields of the step results to fill in from the next step on, `StepResultOptions::ALL` by default
+	void set_step_result_options(StepResultOptions options)
+	{
+		auto step_lock = std::unique_lock(step_mutex);
+		step_result_options = options;
+	}
+
+	StepResultOptions get_step_result_options() const noexcept
+	{
+		return step_result_options;
+	}
+
+protected:
+	// Midpoint of the best bid and ask, or the best price of the only side with orders
+	static std::optional<float> get_auction_reference_price(const OrderBook &order_book)
+	{
+		if (order_book.bid_size() > 0 && order_book.ask_size() > 0)
+		{
+			return order_book.snap_price((order_book.top_bid().price + order_book.top_ask().price) / 2.0f);
+		}
+		if (order_book.bid_size() > 0)
+		{
+			return order_book.top_bid().price;
+		}
+		if (order_book.ask_size() > 0)
+		{
+			return order_book.top_ask().price;
+		}
+		return std::nullopt;
+	}
+
+	// Executes the orders queued for `security_id`, recording what happened in `scratch`. Only touches the
+	// book and queue of that security, so different securities can be matched at the same time.
+	void match_security_orders(SecurityID security_id, SecurityStepScratch &scratch, std::pmr::memory_resource *arena, StepResultOptions options)
+	{
+		auto &order_book = order_books.at(security_id);
+		auto &commands = order_queues[security_id]->matching;
+
+		// Keep track of market updates for a particular security, in memory released at the end of the step
+		auto &local_partially_transacted_orders = scratch.partially_transacted_orders;
+		auto &local_fully_transacted_orders = scratch.fully_transacted_orders;
+		auto &local_cancelled_orders = scratch.cancelled_orders;
+		auto &local_transactions = scratch.transactions;
+
+		auto &local_v2_submitted_orders = scratch.v2_submitted_orders;
+		auto &local_v2_cancelled_orders = scratch.v2_cancelled_orders;
+		auto &local_v2_transacted_orders = scratch.v2_transacted_orders;
+		auto &local_fills = scratch.fills;
+
+		// Order updates are only kept in the formats the step result asks for
+		auto record_v1_updates = has_option(options, StepResultOptions::V1_ORDER_UPDATES);
+		auto record_v2_updates = has_option(options, StepResultOptions::V2_ORDER_UPDATES);
+		auto record_fill = [&](OrderID order_id, float filled_volume, float remaining_volume)
+		{
+			if (record_v1_updates)
+			{
+				if (remaining_volume == 0.0f)
+				{
+					local_partially_transacted_orders.erase(order_id);
+					local_fully_transacted_orders.emplace(order_id);
+				}
+				else
+				{
+					local_partially_transacted_orders[order_id] = remaining_volume;
+				}
+			}
+			if (record_v2_updates)
+			{
+				local_v2_transacted_orders[order_id] += filled_volume;
+			}
+		};
+
+		// A call auction prices its trades off the book as it was before the step, and leaves the
+		// market orders aside until every limit order and cancel of the step has been applied
+		auto auction_reference_price = std::optional<float>();
+		auto &local_market_buys = scratch.market_buys;
+		auto &local_market_sells = scratch.market_sells;
+		if (matching_mode == MatchingMode::CALL_AUCTION)
+		{
+			auction_reference_price = get_auction_reference_price(order_book);
+		}
+
+		for (auto &variant_command : commands)
+		{
+			auto index = variant_command.index();
+
+			if (index == 0)
+			{
+				{
+					// Invariant: the market must not be crossed before submitting a new order (a call auction only uncrosses it at the end)
+					assert(matching_mode == MatchingMode::CALL_AUCTION || !order_book.is_crossed());
+				}
+
+				LimitOrder &order = std::get<0>(variant_command);
+				// Insert the order
+				order_book.insert_order(order);
+				if (record_v2_updates)
+				{
+					local_v2_submitted_orders.push_back(order);
+				}
+				if (matching_mode == MatchingMode::CALL_AUCTION)
+				{
+					continue;
+				}
+
+				// The order book is now potentially crossed, we must resolve it
+				// additionally, if it was crossed, it is due to the added order, by our invariants
+				while (order_book.bid_size() > 0 && order_book.ask_size() > 0)
+				{
+					auto &top_bid = order_book.top_bid();
+					auto &top_ask = order_book.top_ask();
+					if (order_book.is_crossed())
+					{
+						// The trades will execute on the submitted order's opposite side.
+						// If the submitted order is a bid, the market is crossed because of it,
+						// the execution price will be of the ask. And vice-versa if the crossing is ask.
+						auto transacted_price = order.side == OrderSide::BID ? top_ask.price : top_bid.price;
+						auto transacted_volume = std::min(top_bid.volume, top_ask.volume);
+
+						auto buyer_id = top_bid.user_id;
+						auto seller_id = top_ask.user_id;
+
+						auto top_bid_id = top_bid.order_id;
+						auto top_ask_id = top_ask.order_id;
+
+						// After this `top_bid` may be invalidated
+						auto remaining_bid_volume = top_bid.volume - transacted_volume;
+						record_fill(top_bid_id, transacted_volume, remaining_bid_volume);
+						if (remaining_bid_volume == 0.0f)
+						{
+							order_book.pop_top_bid();
+						}
+						else
+						{
+							order_book.set_top_bid_volume(remaining_bid_volume);
+						}
+
+						// After this `top_ask` may be invalidated
+						auto remaining_ask_volume = top_ask.volume - transacted_volume;
+						record_fill(top_ask_id, transacted_volume, remaining_ask_volume);
+						if (remaining_ask_volume == 0.0f)
+						{
+							order_book.pop_top_ask();
+						}
+						else
+						{
+							order_book.set_top_ask_volume(remaining_ask_volume);
+						}
+
+						local_transactions.push_back(Transaction{.price = transacted_price, .volume = transacted_volume, .buyer_id = buyer_id, .seller_id = seller_id, .buyer_order_id = top_bid_id, .seller_order_id = top_ask_id});
+					}
+					else
+					{
+						break;
+					}
+				}
+
+				{
+					// Invariant: the market must not be crossed after submitting an order and executing it
+					assert(!order_book.is_crossed());
+				}
+			}
+			else if (index == 1)
+			{
+				CancelOrder &order = std::get<1>(variant_command);
+				auto was_cancelled = order_book.cancel_order(order);
+				if (was_cancelled)
+				{
+					if (record_v1_updates)
+					{
+						local_cancelled_orders.insert(order.order_id);
+					}
+					if (record_v2_updates)
+					{
+						local_v2_cancelled_orders.push_back(order.order_id);
+					}
+				}
+			}
+			else if (index == 2)
+			{
+				MarketOrder &order = std::get<2>(variant_command);
+				auto action = order.action;
+				auto order_user_id = order.user_id;
+				assert(action == OrderAction::BUY || action == OrderAction::SELL);
+				if (matching_mode == MatchingMode::CALL_AUCTION)
+				{
+					(action == OrderAction::BUY ? local_market_buys : local_market_sells).push_back(order);
+					continue;
+				}
+
+				// Take the whole sweep out of the book first, then report its fills
+				local_fills.clear();
+				order.volume = order_book.sweep(action == OrderAction::BUY ? OrderSide::ASK : OrderSide::BID, order.volume, local_fills);
+				for (const auto &fill : local_fills)
+				{
+					record_fill(fill.order_id, fill.volume, fill.remaining_volume);
+
+					auto buyer_id = action == OrderAction::BUY ? order_user_id : fill.user_id;
+					auto seller_id = action == OrderAction::BUY ? fill.user_id : order_user_id;
+					auto buyer_order_id = action == OrderAction::BUY ? order.order_id : fill.order_id;
+					auto seller_order_id = action == OrderAction::BUY ? fill.order_id : order.order_id;
+					local_transactions.push_back(Transaction{.price = fill.price, .volume = fill.volume, .buyer_id = buyer_id, .seller_id = seller_id, .buyer_order_id = buyer_order_id, .seller_order_id = seller_order_id});
+				}
+			}
+			else if (index == 3)
+			{
+				assert(false);
+			}
+			else
+			{
+				assert(false);
+			}
+		}
+
+		if (matching_mode == MatchingMode::CALL_AUCTION)
+		{
+			// Pair buyers and sellers in priority order (market orders first, then best price, then oldest)
+			// while they cross. This executes the largest volume that any single price can, and the last
+			// pair and the first orders left unmatched bound the prices that execute it.
+			struct AuctionMatch
+			{
+				UserID buyer_id;
+				UserID seller_id;
+				OrderID buyer_order_id;
+				OrderID seller_order_id;
+				float volume;
+			};
+			auto matches = std::pmr::vector<AuctionMatch>(arena);
+			constexpr auto infinity = std::numeric_limits<float>::infinity();
+			auto lowest_price = -infinity;
+			auto highest_price = infinity;
+			std::size_t market_buy_index = 0;
+			std::size_t market_sell_index = 0;
+			while ((market_buy_index < local_market_buys.size() || order_book.bid_size() > 0) &&
+				   (market_sell_index < local_market_sells.size() || order_book.ask_size() > 0))
+			{
+				auto is_market_buy = market_buy_index < local_market_buys.size();
+				auto is_market_sell = market_sell_index < local_market_sells.size();
+				auto buy_price = is_market_buy ? infinity : order_book.top_bid().price;
+				auto sell_price = is_market_sell ? -infinity : order_book.top_ask().price;
+				if (buy_price < sell_price)
+				{
+					// Neither of these can trade, so the clearing price must not be above the bid nor below the ask
+					lowest_price = std::max(lowest_price, buy_price);
+					highest_price = std::min(highest_price, sell_price);
+					break;
+				}
+				lowest_price = std::max(lowest_price, sell_price);
+				highest_price = std::min(highest_price, buy_price);
+
+				auto buy_volume = is_market_buy ? local_market_buys[market_buy_index].volume : order_book.top_bid().volume;
+				auto sell_volume = is_market_sell ? local_market_sells[market_sell_index].volume : order_book.top_ask().volume;
+				auto transacted_volume = std::min(buy_volume, sell_volume);
+				auto &match = matches.emplace_back(AuctionMatch{.volume = transacted_volume});
+
+				auto remaining_buy_volume = buy_volume - transacted_volume;
+				if (is_market_buy)
+				{
+					auto &market_buy = local_market_buys[market_buy_index];
+					match.buyer_id = market_buy.user_id;
+					match.buyer_order_id = market_buy.order_id;
+					market_buy.volume = remaining_buy_volume;
+					market_buy_index += remaining_buy_volume == 0.0f;
+				}
+				else
+				{
+					const auto &top_bid = order_book.top_bid();
+					match.buyer_id = top_bid.user_id;
+					match.buyer_order_id = top_bid.order_id;
+					record_fill(match.buyer_order_id, transacted_volume, remaining_buy_volume);
+					if (remaining_buy_volume == 0.0f)
+					{
+						order_book.pop_top_bid();
+					}
+					else
+					{
+						order_book.set_top_bid_volume(remaining_buy_volume);
+					}
+				}
+
+				auto remaining_sell_volume = sell_volume - transacted_volume;
+				if (is_market_sell)
+				{
+					auto &market_sell = local_market_sells[market_sell_index];
+					match.seller_id = market_sell.user_id;
+					match.seller_order_id = market_sell.order_id;
+					market_sell.volume = remaining_sell_volume;
+					market_sell_index += remaining_sell_volume == 0.0f;
+				}
+				else
+				{
+					const auto &top_ask = order_book.top_ask();
+					match.seller_id = top_ask.user_id;
+					match.seller_order_id = top_ask.order_id;
+					record_fill(match.seller_order_id, transacted_volume, remaining_sell_volume);
+					if (remaining_sell_volume == 0.0f)
+					{
+						order_book.pop_top_ask();
+					}
+					else
+					{
+						order_book.set_top_ask_volume(remaining_sell_volume);
+					}
+				}
+			}
+
+			// Take the price closest to the book before the step within the bounds. Market orders that only
+			// met each other are unbounded, without a book to price them off they do not trade.
+			auto clearing_price = auction_reference_price;
+			if (!clearing_price.has_value() && std::isfinite(lowest_price) && std::isfinite(highest_price))
+			{
+				clearing_price = order_book.snap_price((lowest_price + highest_price) / 2.0f);
+			}
+			else if (!clearing_price.has_value() && (std::isfinite(lowest_price) || std::isfinite(highest_price)))
+			{
+				clearing_price = std::isfinite(lowest_price) ? lowest_price : highest_price;
+			}
+			if (clearing_price.has_value())
+			{
+				auto transacted_price = std::clamp(*clearing_price, lowest_price, highest_price);
+				for (const auto &match : matches)
+				{
+					local_transactions.push_back(Transaction{.price = transacted_price, .volume = match.volume, .buyer_id = match.buyer_id, .seller_id = match.seller_id, .buyer_order_id = match.buyer_order_id, .seller_order_id = match.seller_order_id});
+				}
+			}
+
+			{
+				// Invariant: the market must not be crossed after the auction
+				assert(!order_book.is_crossed());
+			}
+		}
+
+		// Reset the matched queue, keeping its capacity for the next swap
+		commands.clear();
+	}
+
+	// Simulation actions
+	// Builds the `SimulationStepResult` of the Python API from a step result
+	SimulationStepResult make_simulation_step_result(const StepResult &result, StepResultOptions options) const
+	{
+		// Fields that were not asked for stay empty rather than holding an empty entry per ticker
+		auto step_result = SimulationStepResult{
+			.current_step = result.current_step,
+			.has_next_step = result.has_next_step};
+		if (has_option(options, StepResultOptions::USERNAMES))
+		{
+			step_result.user_id_to_username_map = get_user_id_to_username();
+		}
+		for (SecurityID security_id = 0; security_id < result.securities.size(); security_id++)
+		{
+			const auto &security = result.securities[security_id];
+			const auto &ticker = get_security_ticker(security_id);
+			if (has_option(options, StepResultOptions::V1_ORDER_UPDATES))
+			{
+				step_result.partially_transacted_orders.emplace(ticker, std::map<OrderID, float>(security.partially_transacted_orders.begin(), security.partially_transacted_orders.end()));
+				step_result.fully_transacted_orders.emplace(ticker, std::set<OrderID>(security.fully_transacted_orders.begin(), security.fully_transacted_orders.end()));
+				step_result.cancelled_orders.emplace(ticker, std::set<OrderID>(security.cancelled_orders.begin(), security.cancelled_orders.end()));
+			}
+			if (has_option(options, StepResultOptions::TRANSACTIONS))
+			{
+				step_result.transactions.emplace(ticker, security.transactions);
+			}
+			if (has_option(options, StepResultOptions::BOOK_DEPTH))
+			{
+				step_result.order_book_depth_per_security.emplace(ticker, BookDepth(
+					std::map<float, float>(security.bid_depth.begin(), security.bid_depth.end()),
+					std::map<float, float>(security.ask_depth.begin(), security.ask_depth.end())));
+			}
+			if (has_option(options, StepResultOptions::ORDER_BOOKS))
+			{
+				step_result.order_book_per_security.emplace(ticker, security.order_book);
+			}
+			if (has_option(options, StepResultOptions::V2_ORDER_UPDATES))
+			{
+				step_result.v2_submitted_orders.emplace(ticker, security.v2_submitted_orders);
+				step_result.v2_cancelled_orders.emplace(ticker, security.v2_cancelled_orders);
+				step_result.v2_transacted_orders.emplace(ticker, std::map<OrderID, float>(security.v2_transacted_orders.begin(), security.v2_transacted_orders.end()));
+			}
+			if (has_option(options, StepResultOptions::BOOK_DELTAS))
+			{
+				step_result.book_deltas.emplace(ticker, security.book_delta);
+			}
+		}
+		if (has_option(options, StepResultOptions::PORTFOLIOS))
+		{
+			auto columns = result.securities.size();
+			step_result.portfolios.reserve(result.user_count);
+			for (UserID user_id = 0; user_id < result.user_count; user_id++)
+			{
+				auto row = result.portfolios.begin() + user_id * columns;
+				step_result.portfolios.emplace_back(row, row + columns);
+			}
+		}
+		return step_result;
+	}
+
+	// Runs a step, writing the fields of `options` (`step_result_options` if not given) into `step_result`.
+	// Returns the options used. The caller holds a `StepGuard`.
+	StepResultOptions do_simulation_step_inner(std::optional<StepResultOptions> options_override = std::nullopt)
+	{
+		auto allocations_before = get_heap_allocation_count();
+		auto options = options_override.value_or(step_result_options);
+		// Perform a simulaiton step
+		auto step = get_tick(); // step ∈ [0, ..., N] inclusive
+		if (step > get_N())
+		{
+			throw std::runtime_error("Passed simulation endpoint!");
+		}
+
+		auto t = get_t();	// t ∈ [0, ..., T]
+		auto dt = get_dt(); // dt = T / N
+
+		if (step == 0)
+		{
+			for (auto &security : get_securities())
+			{
+				security->on_simulation_start(*this, user_portfolio_manager);
+			}
+		}
+
+		for (auto &security : get_securities())
+		{
+			security->before_step(*this, user_portfolio_manager);
+		}
+
+		auto &securities = get_securities();
+		for (SecurityID security_id = 0; security_id < get_securities_count(); security_id++)
+		{
+			step_scratch[security_id].emplace(step_arenas[security_id]->get());
+		}
+
+		// Take the orders submitted so far, later submissions go to the next step
+		for (auto &queue : order_queues)
+		{
+			auto queue_lock = std::unique_lock(queue->mutex);
+			std::swap(queue->pending, queue->matching);
+		}
+
+		// Securities only share the portfolios, which matching does not touch, so each security is matched
+		// on its own (in parallel with a matching pool). Trades are settled and reported afterwards in
+		// security id order, so the results do not depend on how the matching was scheduled.
+		if (matching_pool != nullptr)
+		{
+			matching_pool->parallel_for(get_securities_count(), [&](std::size_t security_id)
+			{
+				auto &scratch = *step_scratch[security_id];
+				try
+				{
+					match_security_orders(static_cast<SecurityID>(security_id), scratch, step_arenas[security_id]->get(), options);
+				}
+				catch (...)
+				{
+					scratch.error = std::current_exception();
+				}
+			});
+			for (auto &scratch : step_scratch)
+			{
+				if (scratch->error)
+				{
+					std::rethrow_exception(scratch->error);
+				}
+			}
+		}
+		else
+		{
+			for (SecurityID security_id = 0; security_id < get_securities_count(); security_id++)
+			{
+				match_security_orders(security_id, *step_scratch[security_id], step_arenas[security_id]->get(), options);
+			}
+		}
+
+		for (SecurityID security_id = 0; security_id < get_securities_count(); security_id++)
+		{
+			auto &security_class = securities.at(security_id);
+			auto &scratch = *step_scratch[security_id];
+			auto &local_partially_transacted_orders = scratch.partially_transacted_orders;
+			auto &local_fully_transacted_orders = scratch.fully_transacted_orders;
+			auto &local_cancelled_orders = scratch.cancelled_orders;
+			auto &local_transactions = scratch.transactions;
+			auto &local_v2_submitted_orders = scratch.v2_submitted_orders;
+			auto &local_v2_cancelled_orders = scratch.v2_cancelled_orders;
+			auto &local_v2_transacted_orders = scratch.v2_transacted_orders;
+
+			// Plain security against cash trades are settled in one batch, other securities resolve each trade themselves
+			if (auto settlement = security_class->get_trade_settlement(*this))
+			{
+				user_portfolio_manager->settle_trades(local_transactions, settlement->security_id, settlement->currency_id);
+			}
+			else if (!local_transactions.empty())
+			{
+				security_class->on_trades_executed(*this, user_portfolio_manager, std::span<const Transaction>(local_transactions));
+			}
+			if (!trade_prints.empty())
+			{
+				for (const auto &transaction : local_transactions)
+				{
+					trade_prints[security_id].record(transaction.price, transaction.volume);
+				}
+			}
+
+			// Save the differences to the step result, the assignments reuse its capacity
+			auto &result = step_result.securities[security_id];
+			assign_reusing(result.partially_transacted_orders, local_partially_transacted_orders);
+			assign_reusing(result.fully_transacted_orders, local_fully_transacted_orders);
+			assign_reusing(result.cancelled_orders, local_cancelled_orders);
+			if (has_option(options, StepResultOptions::TRANSACTIONS))
+			{
+				assign_reusing(result.transactions, local_transactions);
+			}
+			else
+			{
+				result.transactions.clear();
+			}
+
+			assign_reusing(result.v2_submitted_orders, local_v2_submitted_orders);
+			assign_reusing(result.v2_cancelled_orders, local_v2_cancelled_orders);
+			assign_reusing(result.v2_transacted_orders, local_v2_transacted_orders);
+
+			// Every scratch container of the security is gone, its memory is reused by the next step
+			step_scratch[security_id].reset();
+			step_arenas[security_id]->reset();
+		}
+
+		for (auto &security : get_securities())
+		{
+			security->after_step(*this, user_portfolio_manager);
+		}
+
+		if (step == N)
+		{
+			for (auto &security : get_securities())
+			{
+				security->on_simulation_end(*this, user_portfolio_manager);
+			}
+		}
+
+		for (SecurityID security_id = 0; security_id < get_securities_count(); security_id++)
+		{
+			auto &result = step_result.securities[security_id];
+			auto &order_book = order_books.at(security_id);
+			if (has_option(options, StepResultOptions::BOOK_DEPTH))
+			{
+				order_book.get_book_depth(result.bid_depth, result.ask_depth);
+			}
+			else
+			{
+				result.bid_depth.clear();
+				result.ask_depth.clear();
+			}
+			if (has_option(options, StepResultOptions::ORDER_BOOKS))
+			{
+				order_book.get_limit_orders(result.order_book);
+			}
+			else
+			{
+				result.order_book.first.clear();
+				result.order_book.second.clear();
+			}
+			if (has_option(options, StepResultOptions::BOOK_DELTAS))
+			{
+				order_book.take_delta(result.book_delta);
+			}
+			else
+			{
+				// The log is still drained, a later delta then reports the gap through its `previous_sequence`
+				order_book.discard_delta();
+				result.book_delta = BookDelta{.previous_sequence = order_book.get_sequence(), .sequence = order_book.get_sequence()};
+			}
+		}
+		if (has_option(options, StepResultOptions::PORTFOLIOS))
+		{
+			user_portfolio_manager->copy_portfolio_table(step_result.portfolios);
+		}
+		else
+		{
+			step_result.portfolios.clear();
+		}
+		// Taken from the copied table when there is one, so the two always agree
+		step_result.user_count = has_option(options, StepResultOptions::PORTFOLIOS)
+									 ? static_cast<uint32_t>(step_result.portfolios.size() / get_securities_count())
+									 : user_portfolio_manager->get_user_count();
+
+		increment_tick();
+		step_result.current_step = get_tick() - 1;
+		step_result.has_next_step = get_tick() <= get_N();
+		last_step_allocation_count = get_heap_allocation_count() - allocations_before;
+		return options;
+	};
+
+public:
+	SimulationStepResult do_simulation_step() override
+	{
+		auto step_guard = StepGuard(*this);
+		auto options = do_simulation_step_inner();
+		return make_simulation_step_result(step_result, options);
+	}
+
+	// Copies the portfolio table into a caller owned `users x securities` buffer
+	void copy_portfolio_table(std::span<float> table) const
+	{
+		user_portfolio_manager->copy_portfolio_table(table);
+	}
+
+	// The resting orders of the best `max_levels` price levels of each side (bids, asks), in priority order
+	std::pair<std::vector<OrderRecord>, std::vector<OrderRecord>> get_order_records(SecurityID security_id, uint32_t max_levels = std::numeric_limits<uint32_t>::max()) const
+	{
+		if (tickers.size() <= security_id)
+		{
+			throw IDNotFoundError(fmt::format("The security_id: `{}` doesn't exist.", security_id));
+		}
+		auto records = std::pair<std::vector<OrderRecord>, std::vector<OrderRecord>>();
+		auto read_lock = lock_for_reading();
+		order_books[security_id].get_order_records(records.first, records.second, max_levels);
+		return records;
+	}
+
+	// The live portfolio table (`users x securities`, row major) and its user count. Only read it between steps:
+	// trades are settled into it in place. Adding a user or restoring a snapshot moves it, leaving the shared
+	// storage alive but stale.
+	std::pair<std::shared_ptr<const float[]>, uint32_t> share_portfolio_data() const
+	{
+		return user_portfolio_manager->share_portfolio_data();
+	}
+
+	// Sets what `fill_observations` writes. The recent trades are kept from the next step on.
+	void set_observation_spec(const ObservationSpec &spec)
 	{
-		if (user_id >= get_user_count())
+		for (std::size_t i = 0; i < spec.security_ids.size(); i++)
 		{
-			throw IDNotFoundError(fmt::format("The user_id: `{}` doesn't exist.", user_id));
+			if (spec.security_ids[i] >= get_securities_count())
+			{
+				throw IDNotFoundError(fmt::format("The security_id: `{}` doesn't exist, at index `{}`.", spec.security_ids[i], i));
+			}
+		}
+		if (spec.cash_id >= get_securities_count())
+		{
+			throw IDNotFoundError(fmt::format("The security_id: `{}` doesn't exist.", spec.cash_id));
+		}
+		auto step_lock = std::unique_lock(step_mutex);
+		observation_spec = spec;
+		trade_prints.clear();
+		if (spec.trade_count > 0)
+		{
+			trade_prints.resize(get_securities_count());
+			for (auto security_id : spec.security_ids)
+			{
+				trade_prints[security_id].prints.resize(spec.trade_count);
+			}
 		}
-		return user_portfolio_manager->get_portfolio_table()[user_id];
 	}
-	void do_portfolio_callback(std::function<void(std::shared_ptr<IPortfolioManager>)> callback) override
+
+	// A copy, the spec can be replaced by another thread once the lock is released
+	ObservationSpec get_observation_spec() const
 	{
-		callback(user_portfolio_manager);
+		auto read_lock = lock_for_reading();
+		return observation_spec;
 	}
 
-	// Simulation order book information
-	const LimitOrder &get_top_bid(SecurityID security_id) const override
+	// Writes the best bid price, best bid volume, best ask price and best ask volume of every security into
+	// `output`, `securities x 4`, reading each book once under a single lock. The volumes are those of the whole
+	// best levels, the prices of an empty side are NaN and its volume `0`.
+	void get_top_of_book(std::span<float> output) const
 	{
-		if (order_books.size() <= security_id)
+		check_batch_size(output.size(), std::size_t(get_securities_count()) * 4, "output");
+		auto read_lock = lock_for_reading();
+		for (SecurityID security_id = 0; security_id < get_securities_count(); security_id++)
 		{
-			throw IDNotFoundError(fmt::format("Could not find order book with security_id: `{}`.", security_id));
+			auto values = output.subspan(std::size_t(security_id) * 4, 4);
+			order_books[security_id].get_top_levels(values.first(2), values.last(2));
 		}
-		return order_books.at(security_id).top_bid();
-	};
-	const LimitOrder &get_top_ask(SecurityID security_id) const override
+	}
+
+	// Writes the observation of every user of `user_ids` into `observations`, `user_ids.size() x features`
+	// row major, see `ObservationSpec`. The books are read once: the market features are written to the first
+	// row and copied to the others, then the portfolio values of each user are filled in from the table.
+	void fill_observations(std::span<const UserID> user_ids, std::span<float> observations) const
 	{
-		if (order_books.size() <= security_id)
+		// Held from the size check on, so the spec the output was sized for is the one filled in
+		auto read_lock = lock_for_reading();
+		auto feature_count = observation_spec.get_feature_count();
+		check_batch_size(observations.size(), user_ids.size() * feature_count, "observations");
+		auto user_count = get_user_count();
+		for (std::size_t i = 0; i < user_ids.size(); i++)
 		{
-			throw IDNotFoundError(fmt::format("Could not find order book with security_id: `{}`.", security_id));
+			if (user_ids[i] >= user_count)
+			{
+				throw IDNotFoundError(fmt::format("The user_id: `{}` doesn't exist, at index `{}`.", user_ids[i], i));
+			}
 		}
-		return order_books.at(security_id).top_ask();
-	};
-	uint32_t get_bid_count(SecurityID security_id) const override
-	{
-		if (order_books.size() <= security_id)
+		if (user_ids.empty())
 		{
-			throw IDNotFoundError(fmt::format("Could not find order book with security_id: `{}`.", security_id));
+			return;
 		}
-		return order_books.at(security_id).bid_size();
-	};
-	uint32_t get_ask_count(SecurityID security_id) const override
-	{
-		if (order_books.size() <= security_id)
+
+		const auto &security_ids = observation_spec.security_ids;
+		auto security_feature_count = observation_spec.get_security_feature_count();
+		auto level_values = 2 * std::size_t(observation_spec.book_levels);
+		auto first_row = observations.first(feature_count);
+		for (std::size_t i = 0; i < security_ids.size(); i++)
 		{
-			throw IDNotFoundError(fmt::format("Could not find order book with security_id: `{}`.", security_id));
+			const auto &order_book = order_books[security_ids[i]];
+			auto features = first_row.subspan(i * security_feature_count, security_feature_count);
+			order_book.get_top_levels(features.first(level_values), features.subspan(level_values, level_values));
+			auto has_both_sides = order_book.bid_size() > 0 && order_book.ask_size() > 0;
+			auto top_bid = has_both_sides ? order_book.top_bid().price : 0.0f;
+			auto top_ask = has_both_sides ? order_book.top_ask().price : 0.0f;
+			features[2 * level_values] = has_both_sides ? top_ask - top_bid : std::numeric_limits<float>::quiet_NaN();
+			features[2 * level_values + 1] = has_both_sides ? (top_bid + top_ask) / 2.0f : std::numeric_limits<float>::quiet_NaN();
+			auto trades = features.subspan(2 * level_values + 2, 2 * std::size_t(observation_spec.trade_count));
+			if (!trade_prints.empty()) // Only kept with a `trade_count`, `trades` is empty otherwise
+			{
+				trade_prints[security_ids[i]].copy_recent(trades);
+			}
 		}
-		return order_books.at(security_id).ask_size();
-	};
-	FlatOrderBook get_order_book(SecurityID security_id) const override
+		for (std::size_t row = 1; row < user_ids.size(); row++)
+		{
+			std::copy(first_row.begin(), first_row.end(), observations.begin() + row * feature_count);
+		}
+
+		auto columns = get_securities_count();
+		user_portfolio_manager->read_portfolio_table([&](std::span<const float> table)
+		{
+			for (std::size_t row = 0; row < user_ids.size(); row++)
+			{
+				auto user_id = user_ids[row];
+				auto portfolio = table.subspan(std::size_t(user_id) * columns, columns);
+				auto features = observations.subspan(row * feature_count, feature_count);
+				for (std::size_t i = 0; i < security_ids.size(); i++)
+				{
+					auto security_features = features.subspan(i * security_feature_count, security_feature_count);
+					security_features[security_feature_count - 2] = portfolio[security_ids[i]];
+					security_features[security_feature_count - 1] = static_cast<float>(order_books[security_ids[i]].get_user_order_count(user_id));
+				}
+				features.back() = portfolio[observation_spec.cash_id];
+			}
+		});
+	}
+
+	// Same step as `do_simulation_step`, without building the ticker keyed maps. The returned result is owned
+	// by the simulation and only valid until the next step.
+	const StepResult &do_simulation_step_flat()
 	{
-		if (tickers.size() <= security_id)
+		auto step_guard = StepGuard(*this);
+		do_simulation_step_inner();
+		return step_result;
+	}
+
+	// Captures the books, queued orders, portfolios, users and tick, to go back to with `restore` or to `fork`.
+	// The state kept by the securities themselves is not part of it.
+	SimulationSnapshot snapshot()
+	{
+		auto step_lock = std::unique_lock(step_mutex);
+		auto snapshot = SimulationSnapshot{
+			.tick = get_tick(),
+			.next_order_id = order_id_counter.load(),
+			.matching_mode = matching_mode,
+			.user_count = user_portfolio_manager->get_user_count(),
+			.user_id_to_username = user_id_to_username};
+		for (SecurityID security_id = 0; security_id < get_securities_count(); security_id++)
 		{
-			throw IDNotFoundError(fmt::format("The security_id: `{}` doesn't exist.", security_id));
+			snapshot.books.push_back(order_books[security_id].get_snapshot());
+			snapshot.tick_sizes.push_back(order_books[security_id].get_tick_size());
+			auto &queue = *order_queues[security_id];
+			auto queue_lock = std::unique_lock(queue.mutex);
+			snapshot.queued_orders.push_back(queue.pending);
 		}
-		return order_books.at(security_id).get_limit_orders();
-	};
-	std::set<OrderID> get_all_open_user_orders(UserID user_id, SecurityID security_id) const override
+		user_portfolio_manager->copy_portfolio_table(snapshot.portfolios);
+		return snapshot;
+	}
+
+	// Puts the simulation back in the state of `snapshot`, order ids handed out since are handed out again
+	void restore(const SimulationSnapshot &snapshot)
 	{
-		if (user_portfolio_manager->get_user_count() <= user_id)
+		if (snapshot.books.size() != get_securities_count())
 		{
-			throw IDNotFoundError(fmt::format("The user_id: `{}` doesn't exist.", user_id));
+			throw std::runtime_error(fmt::format("Cannot restore a snapshot of `{}` securities into a simulation of `{}`.", snapshot.books.size(), get_securities_count()));
 		}
-		if (tickers.size() <= security_id)
+		auto step_lock = std::unique_lock(step_mutex);
+		for (SecurityID security_id = 0; security_id < get_securities_count(); security_id++)
 		{
-			throw IDNotFoundError(fmt::format("The security_id: `{}` doesn't exist.", security_id));
+			order_books[security_id] = OrderBook::from_snapshot(snapshot.books[security_id], snapshot.tick_sizes[security_id]);
+			auto &queue = *order_queues[security_id];
+			auto queue_lock = std::unique_lock(queue.mutex);
+			queue.pending = snapshot.queued_orders[security_id];
+			queue.tick_size = snapshot.tick_sizes[security_id];
 		}
-		return order_books.at(security_id).get_all_user_orders(user_id);
-	};
-	BookDepth get_cumulative_book_depth(SecurityID security_id) const override
-	{
-		if (tickers.size() <= security_id)
+		user_portfolio_manager->restore_portfolio_table(snapshot.user_count, snapshot.portfolios);
+		user_id_to_username = snapshot.user_id_to_username;
+		order_id_counter.store(snapshot.next_order_id);
+		matching_mode = snapshot.matching_mode;
+		set_tick(snapshot.tick);
+		// The recent trades are not part of the snapshot, they are kept again from the next step on
+		for (auto &prints : trade_prints)
 		{
-			throw IDNotFoundError(fmt::format("The security_id: `{}` doesn't exist.", security_id));
+			prints.clear();
 		}
-		return order_books.at(security_id).get_book_depth();
-	};
+	}
 
-protected:
-	// Simulation actions
-	SimulationStepResult do_simulation_step_inner()
+	// A new simulation in the state of this one, which both then run independently. Each security decides
+	// whether the fork shares it or gets a copy, see `ISecurity::fork_security`.
+	std::shared_ptr<GenericSimulation> fork()
 	{
-		auto submitted_orders_lock = std::unique_lock(order_queue_mutex);
-		// Perform a simulaiton step
-		auto step = get_tick(); // step ∈ [0, ..., N] inclusive
-		if (step > get_N())
+		auto state = snapshot();
+		auto forked_securities = std::map<SecurityTicker, std::shared_ptr<ISecurity>>();
+		for (const auto &[ticker, security] : ticker_to_security)
 		{
-			throw std::runtime_error("Passed simulation endpoint!");
+			forked_securities.emplace(ticker, security->fork_security(security));
 		}
+		auto forked = std::make_shared<GenericSimulation>(forked_securities, T, N);
+		forked->restore(state);
+		forked->set_step_result_options(step_result_options);
+		forked->set_matching_threads(get_matching_threads());
+		forked->observation_spec = observation_spec;
+		forked->trade_prints = trade_prints;
+		return forked;
+	}
 
-		auto t = get_t();	// t ∈ [0, ..., T]
-		auto dt = get_dt(); // dt = T / N
-
-		if (step == 0)
+	// Runs up to `step_count` steps without returning to the caller, stopping early at the end of the simulation.
+	// Every agent submits its orders before each step. Only the non-empty outputs are filled in, and only the
+	// step results they need are built. Users added by the agents are left out of the final portfolios, which are
+	// sized for the users there were at the start. Returns the number of steps run.
+	uint32_t run_steps(uint32_t step_count, std::span<const std::shared_ptr<IAgent>> agents, RunStepsOutput output)
+	{
+		auto securities_count = get_securities_count();
+		auto step_values = std::size_t(step_count) * securities_count;
+		if (!output.mid_prices.empty() && output.mid_prices.size() != step_values)
 		{
-			for (auto &security : get_securities())
-			{
-				security->on_simulation_start(*this, user_portfolio_manager);
-			}
+			throw std::runtime_error(fmt::format("Expected `{}` mid prices for `{}` steps, received: `{}`.", step_values, step_count, output.mid_prices.size()));
 		}
-
-		for (auto &security : get_securities())
+		if (!output.traded_volumes.empty() && output.traded_volumes.size() != step_values)
 		{
-			security->before_step(*this, user_portfolio_manager);
+			throw std::runtime_error(fmt::format("Expected `{}` traded volumes for `{}` steps, received: `{}`.", step_values, step_count, output.traded_volumes.size()));
 		}
-
-		// Keep track of market updates
-		std::map<SecurityTicker, std::map<OrderID, float>> partially_transacted_orders = {}; // ticker -> order_id -> new volume
-		std::map<SecurityTicker, std::set<OrderID>> fully_transacted_orders = {};
-		std::map<SecurityTicker, std::set<OrderID>> cancelled_orders = {};
-		std::map<SecurityTicker, std::vector<Transaction>> transactions = {};
-
-		std::map<SecurityTicker, std::vector<LimitOrder>> v2_submitted_orders = {};
-		std::map<SecurityTicker, std::vector<OrderID>> v2_cancelled_orders = {};
-		std::map<SecurityTicker, std::map<OrderID, float>> v2_transacted_orders = {};
-
-		auto &securities = get_securities();
-		// Here would the command queues normally be
-		for (SecurityID security_id = 0; security_id < get_securities_count(); security_id++)
+		auto portfolio_values = std::size_t(get_user_count()) * securities_count;
+		if (!output.final_portfolios.empty() && output.final_portfolios.size() != portfolio_values)
 		{
-			auto &security_class = securities.at(security_id);
-			auto &order_book = order_books.at(security_id);
-			auto &commands = submitted_orders.at(security_id);
-
-			// Keep track of market updates for a particular security
-			auto local_partially_transacted_orders = std::map<OrderID, float>();
-			auto local_fully_transacted_orders = std::set<OrderID>();
-			auto local_cancelled_orders = std::set<OrderID>();
-			auto local_transactions = std::vector<Transaction>();
-
-			auto local_v2_submitted_orders = std::vector<LimitOrder>();
-			auto local_v2_cancelled_orders = std::vector<OrderID>();
-			auto local_v2_transacted_orders = std::map<OrderID, float>();
+			throw std::runtime_error(fmt::format("Expected `{}` portfolio values, received: `{}`.", portfolio_values, output.final_portfolios.size()));
+		}
 
-			for (auto &variant_command : commands)
+		// The traded volumes are summed from the transactions, nothing else of the step results is read
+		auto options = output.traded_volumes.empty() ? StepResultOptions::NONE : StepResultOptions::TRANSACTIONS;
+		uint32_t steps_run = 0;
+		while (steps_run < step_count && get_tick() <= get_N())
+		{
+			for (const auto &agent : agents)
 			{
-				auto index = variant_command.index();
-
-				if (index == 0)
-				{
-					{
-						// Invariant: the market must not be crossed before submitting a new order
-						const auto has_orders_on_both_sides = order_book.bid_size() > 0 && order_book.ask_size() > 0;
-						const auto is_market_crossed = has_orders_on_both_sides && (order_book.top_bid().price >= order_book.top_ask().price);
-						assert(!is_market_crossed);
-					}
-
-					LimitOrder &order = std::get<0>(variant_command);
-					// Insert the order
-					order_book.insert_order(order);
-					local_v2_submitted_orders.push_back(order);
-
-					// The order book is now potentially crossed, we must resolve it
-					// additionally, if it was crossed, it is due to the added order, by our invariants
-					while (order_book.bid_size() > 0 && order_book.ask_size() > 0)
-					{
-						auto &top_bid = order_book.top_bid();
-						auto &top_ask = order_book.top_ask();
-						if (top_bid.price >= top_ask.price)
-						{
-							// The trades will execute on the submitted order's opposite side.
-							// If the submitted order is a bid, the market is crossed because of it,
-							// the execution price will be of the ask. And vice-versa if the crossing is ask.
-							auto transacted_price = order.side == OrderSide::BID ? top_ask.price : top_bid.price;
-							auto transacted_volume = std::min(top_bid.volume, top_ask.volume);
-
-							auto buyer_id = top_bid.user_id;
-							auto seller_id = top_ask.user_id;
-
-							auto top_bid_id = top_bid.order_id;
-							auto top_ask_id = top_ask.order_id;
-
-							// After this `top_bid` may be invalidated
-							auto remaining_bid_volume = top_bid.volume - transacted_volume;
-							if (remaining_bid_volume == 0.0f)
-							{
-								local_partially_transacted_orders.erase(top_bid_id);
-								local_fully_transacted_orders.emplace(top_bid_id);
-								order_book.pop_top_bid();
-							}
-							else
-							{
-								top_bid.volume = remaining_bid_volume;
-								local_partially_transacted_orders[top_bid_id] = remaining_bid_volume;
-							}
-
-							// After this `top_ask` may be invalidated
-							auto remaining_ask_volume = top_ask.volume - transacted_volume;
-							if (remaining_ask_volume == 0.0f)
-							{
-								local_partially_transacted_orders.erase(top_ask_id);
-								local_fully_transacted_orders.emplace(top_ask_id);
-								order_book.pop_top_ask();
-							}
-							else
-							{
-								top_ask.volume = remaining_ask_volume;
-								local_partially_transacted_orders[top_ask_id] = remaining_ask_volume;
-							}
-
-							local_v2_transacted_orders[top_bid_id] += transacted_volume;
-							local_v2_transacted_orders[top_ask_id] += transacted_volume;
-
-							// Perform custom security trade resolution
-							// Must often this is used to simply modify security and cash accounts
-							security_class->on_trade_executed(*this, user_portfolio_manager, buyer_id, seller_id, transacted_price, transacted_volume);
-							local_transactions.push_back(Transaction{.price = transacted_price, .volume = transacted_volume, .buyer_id = buyer_id, .seller_id = seller_id, .buyer_order_id = top_bid_id, .seller_order_id = top_ask_id});
-						}
-						else
-						{
-							break;
-						}
-					}
+				agent->on_step(*this);
+			}
+			auto step_guard = StepGuard(*this);
+			do_simulation_step_inner(options);
 
-					{
-						// Invariant: the market must not be crossed after submitting an order and executing it
-						const auto has_orders_on_both_sides = order_book.bid_size() > 0 && order_book.ask_size() > 0;
-						const auto is_market_crossed = has_orders_on_both_sides && (order_book.top_bid().price >= order_book.top_ask().price);
-						assert(!is_market_crossed);
-					}
-				}
-				else if (index == 1)
+			auto row = std::size_t(steps_run) * securities_count;
+			for (SecurityID security_id = 0; security_id < securities_count; security_id++)
+			{
+				if (!output.mid_prices.empty())
 				{
-					CancelOrder &order = std::get<1>(variant_command);
-					auto was_cancelled = order_book.cancel_order(order);
-					if (was_cancelled)
-					{
-						local_cancelled_orders.insert(order.order_id);
-						local_v2_cancelled_orders.push_back(order.order_id);
-					}
+					const auto &order_book = order_books[security_id];
+					output.mid_prices[row + security_id] = order_book.bid_size() > 0 && order_book.ask_size() > 0
+															   ? (order_book.top_bid().price + order_book.top_ask().price) / 2.0f
+															   : std::numeric_limits<float>::quiet_NaN();
 				}
-				else if (index == 2)
+				if (!output.traded_volumes.empty())
 				{
-					MarketOrder &order = std::get<2>(variant_command);
-					auto action = order.action;
-					auto order_user_id = order.user_id;
-					assert(action == OrderAction::BUY || action == OrderAction::SELL);
-					while (order.volume > 0)
+					float traded_volume = 0.0f;
+					for (const auto &transaction : step_result.securities[security_id].transactions)
 					{
-						if (action == OrderAction::BUY && order_book.ask_size() > 0)
-						{
-							// The market order is buying, so we must go to the ask side
-							auto &top_ask = order_book.top_ask();
-							auto top_ask_order_id = top_ask.order_id;
-							auto top_ask_user_id = top_ask.user_id;
-							auto transacted_volume = std::min(order.volume, top_ask.volume);
-							auto transacted_price = top_ask.price;
-
-							auto remaining_order_volume = order.volume - transacted_volume;
-							auto remaining_ask_volume = top_ask.volume - transacted_volume;
-							assert(remaining_order_volume == 0 || remaining_ask_volume == 0);
-
-							order.volume = remaining_order_volume;
-							if (remaining_ask_volume == 0.0f)
-							{
-								local_partially_transacted_orders.erase(top_ask_order_id);
-								local_fully_transacted_orders.emplace(top_ask_order_id);
-								order_book.pop_top_ask();
-							}
-							else
-							{
-								top_ask.volume = remaining_ask_volume;
-								local_partially_transacted_orders[top_ask_order_id] = remaining_ask_volume;
-							}
-							local_v2_transacted_orders[top_ask_order_id] += transacted_volume;
-
-							security_class->on_trade_executed(*this, user_portfolio_manager, order_user_id, top_ask_user_id, transacted_price, transacted_volume);
-							local_transactions.push_back(Transaction{.price = transacted_price, .volume = transacted_volume, .buyer_id = order_user_id, .seller_id = top_ask_user_id});
-						}
-						else if (action == OrderAction::SELL && order_book.bid_size() > 0)
-						{
-							// The market order is selling, so we must go to the bid side
-							auto &top_bid = order_book.top_bid();
-							auto top_bid_order_id = top_bid.order_id;
-							auto top_bid_user_id = top_bid.user_id;
-							auto transacted_volume = std::min(order.volume, top_bid.volume);
-							auto transacted_price = top_bid.price;
-
-							auto remaining_order_volume = order.volume - transacted_volume;
-							auto remaining_bid_volume = top_bid.volume - transacted_volume;
-							assert(remaining_order_volume == 0 || remaining_bid_volume == 0);
-
-							order.volume = remaining_order_volume;
-							if (remaining_bid_volume == 0.0f)
-							{
-								local_partially_transacted_orders.erase(top_bid_order_id);
-								local_fully_transacted_orders.emplace(top_bid_order_id);
-								order_book.pop_top_bid();
-							}
-							else
-							{
-								top_bid.volume = remaining_bid_volume;
-								local_partially_transacted_orders[top_bid_order_id] = remaining_bid_volume;
-							}
-							local_v2_transacted_orders[top_bid_order_id] += transacted_volume;
-
-							security_class->on_trade_executed(*this, user_portfolio_manager, top_bid_user_id, order_user_id, transacted_price, transacted_volume);
-							local_transactions.push_back(Transaction{.price = transacted_price, .volume = transacted_volume, .buyer_id = top_bid_user_id, .seller_id = order_user_id});
-						}
-						else
-						{
-							break;
-						}
+						traded_volume += transaction.volume;
 					}
+					output.traded_volumes[row + security_id] = traded_volume;
 				}
-				else if (index == 3)
-				{
-					assert(false);
-				}
-				else
-				{
-					assert(false);
-				}
-			}
-
-			// Save the differences to a simulation step object
-			const auto &ticker = get_security_ticker(security_id);
-			partially_transacted_orders.emplace(ticker, local_partially_transacted_orders);
-			fully_transacted_orders.emplace(ticker, local_fully_transacted_orders);
-			cancelled_orders.emplace(ticker, local_cancelled_orders);
-			transactions.emplace(ticker, local_transactions);
-
-			v2_submitted_orders.emplace(ticker, local_v2_submitted_orders);
-			v2_cancelled_orders.emplace(ticker, local_v2_cancelled_orders);
-			v2_transacted_orders.emplace(ticker, local_v2_transacted_orders);
-
-			// Reset the submitted_order[security_id] vector
-			commands.clear();
-		}
-
-		for (auto &security : get_securities())
-		{
-			security->after_step(*this, user_portfolio_manager);
-		}
-
-		if (step == N)
-		{
-			for (auto &security : get_securities())
-			{
-				security->on_simulation_end(*this, user_portfolio_manager);
 			}
+			steps_run++;
 		}
 
-		auto order_book_depth_per_security = std::map<SecurityTicker, BookDepth>();
-		auto order_book_per_security = std::map<SecurityTicker, FlatOrderBook>();
-		for (SecurityID security_id = 0; security_id < get_securities_count(); security_id++)
+		if (!output.final_portfolios.empty())
 		{
-			auto &ticker = get_security_ticker(security_id);
-			order_book_depth_per_security[ticker] = get_cumulative_book_depth(security_id);
-			order_book_per_security[ticker] = get_order_book(security_id);
+			user_portfolio_manager->copy_first_portfolios(output.final_portfolios);
 		}
-
-		increment_tick();
-		return SimulationStepResult{
-			.partially_transacted_orders = partially_transacted_orders,
-			.fully_transacted_orders = fully_transacted_orders,
-			.cancelled_orders = cancelled_orders,
-			.transactions = transactions,
-			.order_book_depth_per_security = order_book_depth_per_security,
-			.order_book_per_security = order_book_per_security,
-			.portfolios = user_portfolio_manager->get_portfolio_table(),
-			.user_id_to_username_map = get_user_id_to_username(),
-			.current_step = get_tick() - 1,
-			.has_next_step = get_tick() <= get_N(),
-			.v2_submitted_orders = v2_submitted_orders,
-			.v2_cancelled_orders = v2_cancelled_orders,
-			.v2_transacted_orders = v2_transacted_orders};
-	};
-
-public:
-	SimulationStepResult do_simulation_step() override
-	{
-		return do_simulation_step_inner();
+		return steps_run;
 	}
 
 	OrderID submit_limit_order(UserID user_id, SecurityID security_id, OrderSide side, float price, float volume) override
@@ -1110,9 +3767,19 @@ public:
 		{
 			throw std::runtime_error(fmt::format("Cannot submit a limit order with non-positive price, received: `{}`.", price));
 		}
-		auto order_queue_lock = std::unique_lock(order_queue_mutex);
-		auto order_id = order_id_counter++;
-		submitted_orders.at(security_id).push_back(LimitOrder{.user_id = user_id, .order_id = order_id, .side = side, .price = price, .volume = volume});
+		auto &queue = *order_queues[security_id];
+		auto queue_lock = std::unique_lock(queue.mutex);
+		if (!OrderBook::is_price_in_range(price, queue.tick_size))
+		{
+			throw std::runtime_error(fmt::format("Cannot submit a limit order with a price of more than `{}` ticks, received: `{}`.", OrderBook::MAX_TICK, price));
+		}
+		price = OrderBook::snap_price(price, queue.tick_size);
+		if (price <= 0)
+		{
+			throw std::runtime_error(fmt::format("Cannot submit a limit order with a price below the tick size, received: `{}`.", price));
+		}
+		auto order_id = order_id_counter.fetch_add(1, std::memory_order_relaxed);
+		queue.pending.push_back(LimitOrder{.user_id = user_id, .order_id = order_id, .side = side, .price = price, .volume = volume});
 		return order_id;
 	};
 	void submit_cancel_order(UserID user_id, SecurityID security_id, OrderID order_id) override
@@ -1125,31 +3792,30 @@ public:
 		{
 			throw IDNotFoundError(fmt::format("The security_id: `{}` doesn't exist.", security_id));
 		}
-		auto order_queue_lock = std::unique_lock(order_queue_mutex);
-		submitted_orders.at(security_id).push_back(CancelOrder{.user_id = user_id, .order_id = order_id});
+		auto &queue = *order_queues[security_id];
+		auto queue_lock = std::unique_lock(queue.mutex);
+		queue.pending.push_back(CancelOrder{.user_id = user_id, .order_id = order_id});
 	};
 	void reset_simulation() override
 	{
-		auto order_queue_lock = std::unique_lock(order_queue_mutex);
-		for (auto &[security_id, vec] : submitted_orders)
+		auto step_lock = std::unique_lock(step_mutex);
+		for (auto &queue : order_queues)
 		{
-			vec.clear();
+			auto queue_lock = std::unique_lock(queue->mutex);
+			queue->pending.clear();
+			queue->matching.clear();
 		}
 		for (auto &order_book : order_books)
 		{
-			while (order_book.ask_size() != 0)
-			{
-				order_book.pop_top_ask();
-			}
-			while (order_book.bid_size() != 0)
-			{
-				order_book.pop_top_bid();
-			}
+			order_book.clear();
 		}
-		for (UserID user_id = 0; user_id < user_portfolio_manager->get_user_count(); user_id++)
+		user_portfolio_manager->reset_portfolios();
+		for (auto &prints : trade_prints)
 		{
-			user_portfolio_manager->reset_user_portfolio(user_id);
+			prints.clear();
 		}
+		// Nothing refers to the old orders anymore, so their ids are handed out again
+		order_id_counter.store(0);
 		reset_tick_to_zero();
 	};
 	OrderID direct_insert_limit_order(UserID user_id, SecurityID security_id, OrderSide side, float price, float volume) override
@@ -1170,12 +3836,108 @@ public:
 		{
 			throw std::runtime_error(fmt::format("Cannot submit a limit order with non-positive price, received: `{}`.", price));
 		}
-		auto order_queue_lock = std::unique_lock(order_queue_mutex);
+		auto step_lock = std::unique_lock(step_mutex);
 		auto &order_book = order_books.at(security_id);
-		auto order_id = order_id_counter++;
+		if (!OrderBook::is_price_in_range(price, order_book.get_tick_size()))
+		{
+			throw std::runtime_error(fmt::format("Cannot submit a limit order with a price of more than `{}` ticks, received: `{}`.", OrderBook::MAX_TICK, price));
+		}
+		price = order_book.snap_price(price);
+		if (price <= 0)
+		{
+			throw std::runtime_error(fmt::format("Cannot submit a limit order with a price below the tick size, received: `{}`.", price));
+		}
+		auto order_id = order_id_counter.fetch_add(1, std::memory_order_relaxed);
 		order_book.insert_order(LimitOrder{.user_id = user_id, .order_id = order_id, .side = side, .price = price, .volume = volume});
 		return order_id;
 	}
+	std::vector<OrderID> bulk_insert_limit_orders(UserID user_id, SecurityID security_id, std::span<const OrderSide> sides, std::span<const float> prices,
+												  std::span<const float> volumes, bool match_crossing) override
+	{
+		if (user_id >= get_user_count())
+		{
+			throw IDNotFoundError(fmt::format("The user_id: `{}` doesn't exist.", user_id));
+		}
+		if (security_id >= get_securities_count())
+		{
+			throw IDNotFoundError(fmt::format("The security_id: `{}` doesn't exist.", security_id));
+		}
+		if (prices.size() != sides.size() || volumes.size() != sides.size())
+		{
+			throw std::runtime_error(fmt::format("Cannot bulk insert limit orders from arrays of different lengths, received: `{}`, `{}` and `{}`.", sides.size(), prices.size(), volumes.size()));
+		}
+		auto count = sides.size();
+
+		check_limit_order_values(sides, prices, volumes);
+
+		auto step_lock = std::unique_lock(step_mutex);
+		auto &order_book = order_books.at(security_id);
+		auto orders = std::vector<LimitOrder>();
+		orders.reserve(count);
+		for (std::size_t i = 0; i < count; i++)
+		{
+			if (!OrderBook::is_price_in_range(prices[i], order_book.get_tick_size()))
+			{
+				throw std::runtime_error(fmt::format("Cannot submit a limit order with a price of more than `{}` ticks, received: `{}` at index `{}`.", OrderBook::MAX_TICK, prices[i], i));
+			}
+			auto price = order_book.snap_price(prices[i]);
+			if (price <= 0)
+			{
+				throw std::runtime_error(fmt::format("Cannot submit a limit order with a price below the tick size, received: `{}` at index `{}`.", prices[i], i));
+			}
+			// Ids are only handed out once the whole batch is known to be valid
+			orders.push_back(LimitOrder{.user_id = user_id, .order_id = 0, .side = sides[i], .price = price, .volume = volumes[i]});
+		}
+
+		// An order crosses if it would trade against the resting orders or the other side of the batch
+		auto best_bid = order_book.bid_size() != 0 ? order_book.top_bid().price : -std::numeric_limits<float>::infinity();
+		auto best_ask = order_book.ask_size() != 0 ? order_book.top_ask().price : std::numeric_limits<float>::infinity();
+		for (const auto &order : orders)
+		{
+			if (order.side == OrderSide::BID)
+			{
+				best_bid = std::max(best_bid, order.price);
+			}
+			else
+			{
+				best_ask = std::min(best_ask, order.price);
+			}
+		}
+		auto is_crossing = [&](const LimitOrder &order)
+		{
+			return order.side == OrderSide::BID ? order.price >= best_ask : order.price <= best_bid;
+		};
+		auto crossing_count = std::count_if(orders.begin(), orders.end(), is_crossing);
+		if (crossing_count != 0 && !match_crossing)
+		{
+			throw std::runtime_error(fmt::format("Cannot bulk insert `{}` limit orders that cross the book, the best bid would be `{}` and the best ask `{}`.", crossing_count, best_bid, best_ask));
+		}
+
+		// Ids follow the order of the arrays, which is also the time priority within a level.
+		// Crossing orders go through the matching engine on the next step like submitted orders,
+		// the others are built into the book directly
+		auto order_ids = std::vector<OrderID>(count);
+		{
+			auto &queue = *order_queues[security_id];
+			auto queue_lock = std::unique_lock(queue.mutex);
+			auto first_order_id = order_id_counter.fetch_add(static_cast<OrderID>(count), std::memory_order_relaxed);
+			for (std::size_t i = 0; i < count; i++)
+			{
+				orders[i].order_id = first_order_id + static_cast<OrderID>(i);
+				order_ids[i] = orders[i].order_id;
+				if (crossing_count != 0 && is_crossing(orders[i]))
+				{
+					queue.pending.push_back(orders[i]);
+				}
+			}
+		}
+		if (crossing_count != 0)
+		{
+			std::erase_if(orders, is_crossing);
+		}
+		order_book.insert_orders(orders);
+		return order_ids;
+	}
 	OrderID submit_market_order(UserID user_id, SecurityID security_id, OrderAction action, float volume) override
 	{
 		if (user_id >= get_user_count())
@@ -1188,12 +3950,112 @@ public:
 		}
 		if (volume <= 0)
 		{
-			throw std::runtime_error(fmt::format("Cannot submit a limit order with non-positive volume, received: `{}`.", volume));
+			throw std::runtime_error(fmt::format("Cannot submit a limit order with non-positive volume, received: `{}`.", volume));
+		}
+		auto &queue = *order_queues[security_id];
+		auto queue_lock = std::unique_lock(queue.mutex);
+		auto order_id = order_id_counter.fetch_add(1, std::memory_order_relaxed);
+		queue.pending.push_back(MarketOrder{.user_id = user_id, .order_id = order_id, .action = action, .volume = volume});
+		return order_id;
+	}
+
+	// Batch forms of the submissions above, order `i` being made of the `i`th value of every array. A batch is
+	// checked in full before anything is queued, so an invalid order rejects the whole batch. Its ids are
+	// consecutive and follow the arrays, and are written to `order_ids`.
+	void submit_limit_orders(std::span<const UserID> user_ids, std::span<const SecurityID> security_ids, std::span<const OrderSide> sides,
+							 std::span<const float> prices, std::span<const float> volumes, std::span<OrderID> order_ids)
+	{
+		auto count = user_ids.size();
+		check_batch_size(security_ids.size(), count, "security_ids");
+		check_batch_size(sides.size(), count, "sides");
+		check_batch_size(prices.size(), count, "prices");
+		check_batch_size(volumes.size(), count, "volumes");
+		check_batch_size(order_ids.size(), count, "order_ids");
+		check_batch_ids(user_ids, security_ids);
+
+		check_limit_order_values(sides, prices, volumes);
+
+		auto queue_locks = lock_order_queues(security_ids);
+		for (std::size_t i = 0; i < count; i++)
+		{
+			if (!OrderBook::is_price_in_range(prices[i], order_queues[security_ids[i]]->tick_size))
+			{
+				throw std::runtime_error(fmt::format("Cannot submit a limit order with a price of more than `{}` ticks, received: `{}` at index `{}`.", OrderBook::MAX_TICK, prices[i], i));
+			}
+			if (OrderBook::snap_price(prices[i], order_queues[security_ids[i]]->tick_size) <= 0)
+			{
+				throw std::runtime_error(fmt::format("Cannot submit a limit order with a price below the tick size, received: `{}` at index `{}`.", prices[i], i));
+			}
+		}
+		auto first_order_id = order_id_counter.fetch_add(static_cast<OrderID>(count), std::memory_order_relaxed);
+		for (std::size_t i = 0; i < count; i++)
+		{
+			auto &queue = *order_queues[security_ids[i]];
+			order_ids[i] = first_order_id + static_cast<OrderID>(i);
+			queue.pending.push_back(LimitOrder{
+				.user_id = user_ids[i],
+				.order_id = order_ids[i],
+				.side = sides[i],
+				.price = OrderBook::snap_price(prices[i], queue.tick_size),
+				.volume = volumes[i]});
+		}
+	}
+	void submit_cancel_orders(std::span<const UserID> user_ids, std::span<const SecurityID> security_ids, std::span<const OrderID> order_ids)
+	{
+		check_batch_size(security_ids.size(), user_ids.size(), "security_ids");
+		check_batch_size(order_ids.size(), user_ids.size(), "order_ids");
+		check_batch_ids(user_ids, security_ids);
+
+		auto queue_locks = lock_order_queues(security_ids);
+		for (std::size_t i = 0; i < user_ids.size(); i++)
+		{
+			order_queues[security_ids[i]]->pending.push_back(CancelOrder{.user_id = user_ids[i], .order_id = order_ids[i]});
+		}
+	}
+	void submit_market_orders(std::span<const UserID> user_ids, std::span<const SecurityID> security_ids, std::span<const OrderAction> actions,
+							  std::span<const float> volumes, std::span<OrderID> order_ids)
+	{
+		auto count = user_ids.size();
+		check_batch_size(security_ids.size(), count, "security_ids");
+		check_batch_size(actions.size(), count, "actions");
+		check_batch_size(volumes.size(), count, "volumes");
+		check_batch_size(order_ids.size(), count, "order_ids");
+		check_batch_ids(user_ids, security_ids);
+
+		check_market_order_values(actions, volumes);
+
+		auto queue_locks = lock_order_queues(security_ids);
+		auto first_order_id = order_id_counter.fetch_add(static_cast<OrderID>(count), std::memory_order_relaxed);
+		for (std::size_t i = 0; i < count; i++)
+		{
+			order_ids[i] = first_order_id + static_cast<OrderID>(i);
+			order_queues[security_ids[i]]->pending.push_back(MarketOrder{.user_id = user_ids[i], .order_id = order_ids[i], .action = actions[i], .volume = volumes[i]});
+		}
+	}
+	void set_tick_size(SecurityID security_id, float tick_size) override
+	{
+		if (security_id >= get_securities_count())
+		{
+			throw IDNotFoundError(fmt::format("The security_id: `{}` doesn't exist.", security_id));
+		}
+		if (tick_size < 0)
+		{
+			throw std::runtime_error(fmt::format("Cannot set a negative tick size, received: `{}`.", tick_size));
+		}
+		auto step_lock = std::unique_lock(step_mutex);
+		auto &order_book = order_books.at(security_id);
+		if (order_book.bid_size() > 0 || order_book.ask_size() > 0)
+		{
+			throw std::runtime_error(fmt::format("Cannot change the tick size of security_id: `{}` while it has resting orders.", security_id));
 		}
-		auto order_queue_lock = std::unique_lock(order_queue_mutex);
-		auto order_id = order_id_counter++;
-		submitted_orders.at(security_id).push_back(MarketOrder{.user_id = user_id, .order_id = order_id, .action = action, .volume = volume});
-		return order_id;
+		order_book = OrderBook(tick_size);
+		auto queue_lock = std::unique_lock(order_queues[security_id]->mutex);
+		order_queues[security_id]->tick_size = tick_size;
+	}
+	void set_matching_mode(MatchingMode mode) override
+	{
+		auto step_lock = std::unique_lock(step_mutex);
+		matching_mode = mode;
 	}
 };
 
@@ -1274,6 +4136,10 @@ namespace GenericSecurities
 			// The bond seller losses the bond, but gets money
 			portfolio->add_to_two_securities(seller, bond_id, -quantity, cad_id, price * quantity);
 		}
+		std::optional<TradeSettlement> get_trade_settlement(ISimulation &simulation) override
+		{
+			return TradeSettlement{simulation.get_security_id(ticker), simulation.get_security_id(currency)};
+		}
 	};
 
 	class GenericStock : public ISecurity
@@ -1326,6 +4192,10 @@ namespace GenericSecurities
 			// The seller losses the stock, but gets money
 			portfolio->add_to_two_securities(seller, stock_id, -quantity, cad_id, price * quantity);
 		}
+		std::optional<TradeSettlement> get_trade_settlement(ISimulation &simulation) override
+		{
+			return TradeSettlement{simulation.get_security_id(ticker), simulation.get_security_id(currency)};
+		}
 	};
 
 	class MarginCash : public ISecurity
@@ -1334,111 +4204,658 @@ namespace GenericSecurities
 		float margin_interest_rate;
 		float starting_cash;
 
-	public:
-		explicit MarginCash(const SecurityTicker &ticker, float margin_interest_rate, float starting_cash) : ticker{ticker}, margin_interest_rate{margin_interest_rate}, starting_cash{starting_cash} {}
+	public:
+		explicit MarginCash(const SecurityTicker &ticker, float margin_interest_rate, float starting_cash) : ticker{ticker}, margin_interest_rate{margin_interest_rate}, starting_cash{starting_cash} {}
+
+		// Inherited via ISecurity
+		bool is_tradeable() override
+		{
+			return false;
+		}
+		void before_step(ISimulation &simulation, std::shared_ptr<IPortfolioManager> portfolio) override {}
+		void after_step(ISimulation &simulation, std::shared_ptr<IPortfolioManager> portfolio) override
+		{
+			auto dt = simulation.get_dt();
+			auto margin_cash_id = simulation.get_security_id(ticker);
+			for (UserID user_id = 0; user_id < portfolio->get_user_count(); user_id++)
+			{
+				portfolio->multiply_to_security_if_negative(user_id, margin_cash_id, 1 + dt * margin_interest_rate);
+			}
+		}
+		void on_simulation_start(ISimulation &simulation, std::shared_ptr<IPortfolioManager> portfolio) override
+		{
+			auto margin_cash_id = simulation.get_security_id(ticker);
+			for (UserID user_id = 0; user_id < portfolio->get_user_count(); user_id++)
+			{
+				portfolio->add_to_security(user_id, margin_cash_id, starting_cash);
+			}
+		}
+		void on_simulation_end(ISimulation &simulation, std::shared_ptr<IPortfolioManager> portfolio) override {}
+		void on_trade_executed(
+			ISimulation &simulation, std::shared_ptr<IPortfolioManager> portfolio,
+			UserID buyer, UserID seller, float price, float quantity) override
+		{
+		}
+	};
+
+	class DividendStock : public ISecurity
+	{
+		SecurityTicker ticker;
+		SecurityTicker currency;
+		std::function<float(uint32_t)> dividend_function;
+
+	public:
+		explicit DividendStock(
+			const SecurityTicker &ticker,
+			const SecurityTicker &currency,
+			const std::function<float(uint32_t)> dividend_function) : ticker{ticker}, currency{currency}, dividend_function{dividend_function}
+		{
+		}
+
+		// Inherited via ISecurity
+		bool is_tradeable() override
+		{
+			return true;
+		}
+		void before_step(ISimulation &simulation, std::shared_ptr<IPortfolioManager> portfolio) override {}
+		void after_step(ISimulation &simulation, std::shared_ptr<IPortfolioManager> portfolio) override
+		{
+			auto dt = simulation.get_dt();
+			auto dividend = dividend_function(simulation.get_tick());
+			auto stock_id = simulation.get_security_id(ticker);
+			auto currency_id = simulation.get_security_id(currency);
+
+			for (UserID user_id = 0; user_id < portfolio->get_user_count(); user_id++)
+			{
+				portfolio->multiply_and_add_1_to_2(user_id, stock_id, currency_id, dt * dividend);
+			}
+		}
+		void on_simulation_start(ISimulation &simulation, std::shared_ptr<IPortfolioManager> portfolio) override {}
+		void on_simulation_end(ISimulation &simulation, std::shared_ptr<IPortfolioManager> portfolio) override
+		{
+			// At the end convert to CAD at midpoint price, or `100.0f`
+			auto stock_id = simulation.get_security_id(ticker);
+			auto currency_id = simulation.get_security_id(currency);
+
+			auto close_bid_price = 100.0f;
+			auto close_ask_price = 100.0f;
+			if (simulation.get_bid_count(stock_id) > 0)
+			{
+				close_bid_price = simulation.get_top_bid(stock_id).price;
+			}
+			if (simulation.get_ask_count(stock_id) > 0)
+			{
+				close_ask_price = simulation.get_top_ask(stock_id).price;
+			}
+
+			for (UserID index_user = 0; index_user < portfolio->get_user_count(); index_user++)
+			{
+				portfolio->multiply_and_add_1_to_2_and_set_1(
+					index_user, stock_id, currency_id, (close_bid_price + close_ask_price) / 2.0f, 0.0f);
+			}
+		}
+		void on_trade_executed(
+			ISimulation &simulation, std::shared_ptr<IPortfolioManager> portfolio,
+			UserID buyer, UserID seller, float price, float quantity) override
+		{
+			auto stock_id = simulation.get_security_id(ticker);
+			auto cad_id = simulation.get_security_id(currency);
+			// The buyer gets the stock, but losses money
+			portfolio->add_to_two_securities(buyer, stock_id, quantity, cad_id, -price * quantity);
+			// The seller losses the stock, but gets money
+			portfolio->add_to_two_securities(seller, stock_id, -quantity, cad_id, price * quantity);
+		}
+		std::optional<TradeSettlement> get_trade_settlement(ISimulation &simulation) override
+		{
+			return TradeSettlement{simulation.get_security_id(ticker), simulation.get_security_id(currency)};
+		}
+	};
+
+};
+
+namespace GenericAgents
+{
+	// Every step, submits `orders_per_step` limit orders on random sides, priced around the mid (or the
+	// only side, or `initial_price` on an empty book) with normally distributed offsets, and a market order
+	// with probability `market_order_probability`. Its limit orders are cancelled after `order_lifetime` steps.
+	class NoiseTrader : public IAgent
+	{
+		UserID user_id;
+		SecurityID security_id;
+		uint32_t orders_per_step;
+		float price_deviation;
+		float max_volume;
+		float market_order_probability;
+		uint32_t order_lifetime;
+		float initial_price;
+		std::mt19937 rng;
+		std::deque<std::pair<uint32_t, OrderID>> open_orders = {}; // (step submitted, order id), oldest first
+
+	public:
+		explicit NoiseTrader(UserID user_id, SecurityID security_id, uint32_t orders_per_step, float price_deviation, float max_volume,
+							 float market_order_probability, uint32_t order_lifetime, float initial_price, uint32_t seed) : user_id{user_id},
+																															security_id{security_id},
+																															orders_per_step{orders_per_step},
+																															price_deviation{price_deviation},
+																															max_volume{max_volume},
+																															market_order_probability{market_order_probability},
+																															order_lifetime{order_lifetime},
+																															initial_price{initial_price},
+																															rng{seed} {}
+
+		void on_step(ISimulation &simulation) override
+		{
+			auto step = simulation.get_tick();
+			while (!open_orders.empty() && open_orders.front().first + order_lifetime <= step)
+			{
+				// Orders that traded in full are no longer in the book, cancelling them does nothing
+				simulation.submit_cancel_order(user_id, security_id, open_orders.front().second);
+				open_orders.pop_front();
+			}
+
+			auto has_bids = simulation.get_bid_count(security_id) > 0;
+			auto has_asks = simulation.get_ask_count(security_id) > 0;
+			auto reference_price = initial_price;
+			if (has_bids && has_asks)
+			{
+				reference_price = (simulation.get_top_bid(security_id).price + simulation.get_top_ask(security_id).price) / 2.0f;
+			}
+			else if (has_bids || has_asks)
+			{
+				reference_price = has_bids ? simulation.get_top_bid(security_id).price : simulation.get_top_ask(security_id).price;
+			}
+
+			auto coin = std::bernoulli_distribution(0.5);
+			auto offset = std::normal_distribution<float>(0.0f, price_deviation);
+			auto volume = std::uniform_int_distribution<uint32_t>(1, std::max(1u, static_cast<uint32_t>(max_volume)));
+			for (uint32_t i = 0; i < orders_per_step; i++)
+			{
+				auto side = coin(rng) ? OrderSide::BID : OrderSide::ASK;
+				auto price = reference_price + offset(rng);
+				auto order_volume = static_cast<float>(volume(rng));
+				if (price > simulation.get_tick_size(security_id))
+				{
+					open_orders.emplace_back(step, simulation.submit_limit_order(user_id, security_id, side, price, order_volume));
+				}
+			}
+			if (std::bernoulli_distribution(market_order_probability)(rng))
+			{
+				auto action = coin(rng) ? OrderAction::BUY : OrderAction::SELL;
+				simulation.submit_market_order(user_id, security_id, action, static_cast<float>(volume(rng)));
+			}
+		}
+	};
+};
+
+// Independent simulations with the same securities and users, stepped together on a thread pool.
+// Batched inputs and outputs are row-major arrays whose first dimension is the simulation index.
+class SimulationEnsemble
+{
+	std::vector<std::shared_ptr<GenericSimulation>> simulations = {};
+	std::vector<std::exception_ptr> errors = {};
+	std::unique_ptr<ThreadPool> pool = nullptr; // `nullptr` runs the simulations one after another
+	uint32_t user_count = 0;
+	uint32_t securities_count = 0;
+
+	// Calls `callback(simulation_index)` for every simulation on the pool, then rethrows the first error
+	template <typename F>
+	void for_each_simulation(F &&callback)
+	{
+		auto run = [&](std::size_t index)
+		{
+			try
+			{
+				callback(static_cast<uint32_t>(index));
+			}
+			catch (...)
+			{
+				errors[index] = std::current_exception();
+			}
+		};
+		if (pool != nullptr)
+		{
+			pool->parallel_for(simulations.size(), run);
+		}
+		else
+		{
+			for (std::size_t index = 0; index < simulations.size(); index++)
+			{
+				run(index);
+			}
+		}
+		for (auto &error : errors)
+		{
+			if (error)
+			{
+				auto first_error = std::exchange(error, nullptr);
+				std::fill(errors.begin(), errors.end(), nullptr);
+				std::rethrow_exception(first_error);
+			}
+		}
+	}
+
+	// Checks the users, securities and prices of the orders of one simulation, `prices` being empty for market
+	// orders. Run on every simulation before any order of a batch is submitted.
+	void check_simulation_orders(uint32_t simulation_index, std::size_t per_simulation, std::span<const UserID> user_ids, std::span<const SecurityID> security_ids,
+								 std::span<const float> prices, std::span<const float> volumes) const
+	{
+		const auto &simulation = *simulations[simulation_index];
+		auto simulation_user_count = simulation.get_user_count();
+		for (auto i = simulation_index * per_simulation; i < (simulation_index + 1) * per_simulation; i++)
+		{
+			if (volumes[i] == 0.0f)
+			{
+				continue;
+			}
+			if (user_ids[i] >= simulation_user_count)
+			{
+				throw IDNotFoundError(fmt::format("The user_id: `{}` doesn't exist, at index `{}`.", user_ids[i], i));
+			}
+			if (security_ids[i] >= securities_count)
+			{
+				throw IDNotFoundError(fmt::format("The security_id: `{}` doesn't exist, at index `{}`.", security_ids[i], i));
+			}
+			if (prices.empty())
+			{
+				continue;
+			}
+			auto tick_size = simulation.get_tick_size(security_ids[i]);
+			if (!OrderBook::is_price_in_range(prices[i], tick_size))
+			{
+				throw std::runtime_error(fmt::format("Cannot submit a limit order with a price of more than `{}` ticks, received: `{}` at index `{}`.", OrderBook::MAX_TICK, prices[i], i));
+			}
+			if (OrderBook::snap_price(prices[i], tick_size) <= 0)
+			{
+				throw std::runtime_error(fmt::format("Cannot submit a limit order with a price below the tick size, received: `{}` at index `{}`.", prices[i], i));
+			}
+		}
+	}
+
+public:
+	// The securities are shared by every simulation, so they must not keep state of their own.
+	// `thread_count` works as in `GenericSimulation::set_matching_threads`. The step results of the simulations
+	// default to `StepResultOptions::NONE`, the ensemble is observed through its batched getters.
+	explicit SimulationEnsemble(
+		const std::map<SecurityTicker, std::shared_ptr<ISecurity>> &securities,
+		float T,
+		uint32_t N,
+		uint32_t simulation_count,
+		const std::vector<Username> &usernames,
+		uint32_t thread_count) : user_count{static_cast<uint32_t>(usernames.size())},
+								 securities_count{static_cast<uint32_t>(securities.size())}
+	{
+		for (uint32_t i = 0; i < simulation_count; i++)
+		{
+			auto simulation = std::make_shared<GenericSimulation>(securities, T, N);
+			for (const auto &username : usernames)
+			{
+				simulation->add_user(username);
+			}
+			simulation->set_step_result_options(StepResultOptions::NONE);
+			simulations.push_back(std::move(simulation));
+		}
+		errors.resize(simulation_count);
+		set_threads(thread_count);
+	}
+
+	void set_threads(uint32_t thread_count)
+	{
+		if (thread_count == 0)
+		{
+			thread_count = std::max(1u, std::thread::hardware_concurrency());
+		}
+		pool = thread_count > 1 ? std::make_unique<ThreadPool>(thread_count) : nullptr;
+	}
+
+	uint32_t get_threads() const noexcept
+	{
+		return pool != nullptr ? static_cast<uint32_t>(pool->size()) : 1;
+	}
+
+	uint32_t get_simulation_count() const noexcept
+	{
+		return static_cast<uint32_t>(simulations.size());
+	}
+
+	uint32_t get_user_count() const noexcept
+	{
+		return user_count;
+	}
+
+	uint32_t get_securities_count() const noexcept
+	{
+		return securities_count;
+	}
+
+	std::shared_ptr<GenericSimulation> get_simulation(uint32_t simulation_index) const
+	{
+		if (simulation_index >= simulations.size())
+		{
+			throw IDNotFoundError(fmt::format("The simulation_index: `{}` doesn't exist.", simulation_index));
+		}
+		return simulations[simulation_index];
+	}
+
+	void set_step_result_options(StepResultOptions options)
+	{
+		for (auto &simulation : simulations)
+		{
+			simulation->set_step_result_options(options);
+		}
+	}
+
+	void set_tick_size(SecurityID security_id, float tick_size)
+	{
+		for (auto &simulation : simulations)
+		{
+			simulation->set_tick_size(security_id, tick_size);
+		}
+	}
+
+	// Steps every simulation once, their results are read with `get_simulation(i)->do_simulation_step_flat`
+	// style accessors or the batched getters below
+	void do_simulation_steps()
+	{
+		for_each_simulation([&](uint32_t simulation_index)
+		{
+			simulations[simulation_index]->do_simulation_step_flat();
+		});
+	}
+
+	void reset_simulations()
+	{
+		for_each_simulation([&](uint32_t simulation_index)
+		{
+			simulations[simulation_index]->reset_simulation();
+		});
+	}
+
+	// Every argument holds `simulation_count x orders_per_simulation` values. Entries with a volume of `0`
+	// are skipped and get the id `std::numeric_limits<OrderID>::max()`. The whole batch is checked before any
+	// order is submitted, so an invalid order rejects all of it.
+	void submit_limit_orders(std::span<const UserID> user_ids, std::span<const SecurityID> security_ids, std::span<const OrderSide> sides,
+							 std::span<const float> prices, std::span<const float> volumes, std::span<OrderID> order_ids)
+	{
+		auto count = user_ids.size();
+		if (count % std::max<std::size_t>(simulations.size(), 1) != 0)
+		{
+			throw std::runtime_error(fmt::format("Cannot split `{}` orders evenly over `{}` simulations.", count, simulations.size()));
+		}
+		check_batch_size(security_ids.size(), count, "security_ids");
+		check_batch_size(sides.size(), count, "sides");
+		check_batch_size(prices.size(), count, "prices");
+		check_batch_size(volumes.size(), count, "volumes");
+		check_batch_size(order_ids.size(), count, "order_ids");
+		check_limit_order_values(sides, prices, volumes, true);
+		auto per_simulation = simulations.empty() ? 0 : count / simulations.size();
+		for_each_simulation([&](uint32_t simulation_index)
+		{
+			check_simulation_orders(simulation_index, per_simulation, user_ids, security_ids, prices, volumes);
+		});
+		for_each_simulation([&](uint32_t simulation_index)
+		{
+			auto &simulation = *simulations[simulation_index];
+			for (auto i = simulation_index * per_simulation; i < (simulation_index + 1) * per_simulation; i++)
+			{
+				order_ids[i] = volumes[i] == 0.0f ? std::numeric_limits<OrderID>::max()
+												  : simulation.submit_limit_order(user_ids[i], security_ids[i], sides[i], prices[i], volumes[i]);
+			}
+		});
+	}
+
+	// Same layout as `submit_limit_orders`
+	void submit_market_orders(std::span<const UserID> user_ids, std::span<const SecurityID> security_ids, std::span<const OrderAction> actions,
+							  std::span<const float> volumes, std::span<OrderID> order_ids)
+	{
+		auto count = user_ids.size();
+		if (count % std::max<std::size_t>(simulations.size(), 1) != 0)
+		{
+			throw std::runtime_error(fmt::format("Cannot split `{}` orders evenly over `{}` simulations.", count, simulations.size()));
+		}
+		check_batch_size(security_ids.size(), count, "security_ids");
+		check_batch_size(actions.size(), count, "actions");
+		check_batch_size(volumes.size(), count, "volumes");
+		check_batch_size(order_ids.size(), count, "order_ids");
+		check_market_order_values(actions, volumes, true);
+		auto per_simulation = simulations.empty() ? 0 : count / simulations.size();
+		for_each_simulation([&](uint32_t simulation_index)
+		{
+			check_simulation_orders(simulation_index, per_simulation, user_ids, security_ids, {}, volumes);
+		});
+		for_each_simulation([&](uint32_t simulation_index)
+		{
+			auto &simulation = *simulations[simulation_index];
+			for (auto i = simulation_index * per_simulation; i < (simulation_index + 1) * per_simulation; i++)
+			{
+				order_ids[i] = volumes[i] == 0.0f ? std::numeric_limits<OrderID>::max()
+												  : simulation.submit_market_order(user_ids[i], security_ids[i], actions[i], volumes[i]);
+			}
+		});
+	}
+
+	// Same layout as `submit_limit_orders`, entries with the id `std::numeric_limits<OrderID>::max()` are skipped
+	void submit_cancel_orders(std::span<const UserID> user_ids, std::span<const SecurityID> security_ids, std::span<const OrderID> order_ids)
+	{
+		auto count = user_ids.size();
+		if (count % std::max<std::size_t>(simulations.size(), 1) != 0)
+		{
+			throw std::runtime_error(fmt::format("Cannot split `{}` orders evenly over `{}` simulations.", count, simulations.size()));
+		}
+		check_batch_size(security_ids.size(), count, "security_ids");
+		check_batch_size(order_ids.size(), count, "order_ids");
+		auto per_simulation = simulations.empty() ? 0 : count / simulations.size();
+		for_each_simulation([&](uint32_t simulation_index)
+		{
+			auto &simulation = *simulations[simulation_index];
+			for (auto i = simulation_index * per_simulation; i < (simulation_index + 1) * per_simulation; i++)
+			{
+				if (order_ids[i] != std::numeric_limits<OrderID>::max())
+				{
+					simulation.submit_cancel_order(user_ids[i], security_ids[i], order_ids[i]);
+				}
+			}
+		});
+	}
+
+	// Fills `simulation_count x securities x 4` values, those of each simulation as `GenericSimulation::get_top_of_book`
+	void get_top_of_book(std::span<float> output) const
+	{
+		auto table_size = std::size_t(securities_count) * 4;
+		check_batch_size(output.size(), simulations.size() * table_size, "output");
+		for (std::size_t i = 0; i < simulations.size(); i++)
+		{
+			simulations[i]->get_top_of_book(output.subspan(i * table_size, table_size));
+		}
+	}
 
-		// Inherited via ISecurity
-		bool is_tradeable() override
+	// Fills `simulation_count x users x securities` values
+	void get_portfolios(std::span<float> output) const
+	{
+		auto table_size = std::size_t(user_count) * securities_count;
+		check_batch_size(output.size(), simulations.size() * table_size, "output");
+		for (std::size_t i = 0; i < simulations.size(); i++)
 		{
-			return false;
+			simulations[i]->copy_portfolio_table(output.subspan(i * table_size, table_size));
 		}
-		void before_step(ISimulation &simulation, std::shared_ptr<IPortfolioManager> portfolio) override {}
-		void after_step(ISimulation &simulation, std::shared_ptr<IPortfolioManager> portfolio) override
+	}
+};
+
+// Steps a simulation on a thread of its own, one step every `interval_seconds` (back to back with `0`), until
+// the simulation ends or `stop` is called. Results are queued for `pop`. Once `max_queued` results wait, the
+// thread waits for the consumer rather than drop any, so every book delta is delivered.
+class SimulationStepper
+{
+	std::shared_ptr<ISimulation> simulation;
+	std::chrono::steady_clock::duration interval;
+	std::size_t max_queued;
+	std::function<void()> on_result; // Called on the stepping thread after each queued result
+
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::deque<SimulationStepResult> results = {};
+	std::exception_ptr error = nullptr; // Thrown by the step or `on_result`, rethrown by `pop`
+	bool running = false;
+	bool stopping = false;
+	std::thread thread;
+
+	void step_loop()
+	{
+		auto next_step = std::chrono::steady_clock::now();
+		auto failed = false;
+		try
 		{
-			auto dt = simulation.get_dt();
-			auto margin_cash_id = simulation.get_security_id(ticker);
-			for (UserID user_id = 0; user_id < portfolio->get_user_count(); user_id++)
+			while (true)
 			{
-				portfolio->multiply_to_security_if_negative(user_id, margin_cash_id, 1 + dt * margin_interest_rate);
+				{
+					auto lock = std::unique_lock(mutex);
+					changed.wait_until(lock, next_step, [&]
+					{
+						return stopping;
+					});
+					changed.wait(lock, [&]
+					{
+						return stopping || results.size() < max_queued;
+					});
+					if (stopping)
+					{
+						break;
+					}
+				}
+				auto result = simulation->do_simulation_step();
+				auto has_next_step = result.has_next_step;
+				{
+					auto lock = std::unique_lock(mutex);
+					results.push_back(std::move(result));
+				}
+				changed.notify_all();
+				if (on_result)
+				{
+					on_result();
+				}
+				if (!has_next_step)
+				{
+					break;
+				}
+				// A late step does not make the next ones catch up
+				next_step = std::max(next_step + interval, std::chrono::steady_clock::now());
 			}
 		}
-		void on_simulation_start(ISimulation &simulation, std::shared_ptr<IPortfolioManager> portfolio) override
+		catch (...)
 		{
-			auto margin_cash_id = simulation.get_security_id(ticker);
-			for (UserID user_id = 0; user_id < portfolio->get_user_count(); user_id++)
+			auto lock = std::unique_lock(mutex);
+			error = std::current_exception();
+			failed = true;
+		}
+		{
+			auto lock = std::unique_lock(mutex);
+			running = false;
+		}
+		changed.notify_all();
+		if (failed && on_result)
+		{
+			// Wake the consumer so it sees the error
+			try
+			{
+				on_result();
+			}
+			catch (...)
 			{
-				portfolio->add_to_security(user_id, margin_cash_id, starting_cash);
 			}
 		}
-		void on_simulation_end(ISimulation &simulation, std::shared_ptr<IPortfolioManager> portfolio) override {}
-		void on_trade_executed(
-			ISimulation &simulation, std::shared_ptr<IPortfolioManager> portfolio,
-			UserID buyer, UserID seller, float price, float quantity) override
+	}
+
+public:
+	explicit SimulationStepper(
+		std::shared_ptr<ISimulation> simulation,
+		double interval_seconds,
+		std::size_t max_queued = 64,
+		std::function<void()> on_result = nullptr) : simulation{std::move(simulation)},
+													 interval{std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(interval_seconds))},
+													 max_queued{std::max<std::size_t>(max_queued, 1)},
+													 on_result{std::move(on_result)}
+	{
+		if (interval_seconds < 0.0)
 		{
+			throw std::runtime_error(fmt::format("Cannot step every `{}` seconds.", interval_seconds));
 		}
-	};
+	}
+	SimulationStepper(const SimulationStepper &) = delete;
+	SimulationStepper &operator=(const SimulationStepper &) = delete;
+	~SimulationStepper()
+	{
+		stop();
+	}
 
-	class DividendStock : public ISecurity
+	void start()
 	{
-		SecurityTicker ticker;
-		SecurityTicker currency;
-		std::function<float(uint32_t)> dividend_function;
+		stop();
+		auto lock = std::unique_lock(mutex);
+		running = true;
+		stopping = false;
+		error = nullptr;
+		thread = std::thread(&SimulationStepper::step_loop, this);
+	}
 
-	public:
-		explicit DividendStock(
-			const SecurityTicker &ticker,
-			const SecurityTicker &currency,
-			const std::function<float(uint32_t)> dividend_function) : ticker{ticker}, currency{currency}, dividend_function{dividend_function}
+	// Waits for a running step to finish, the queued results are kept
+	void stop()
+	{
+		{
+			auto lock = std::unique_lock(mutex);
+			stopping = true;
+		}
+		changed.notify_all();
+		if (thread.joinable())
 		{
+			thread.join();
 		}
+	}
 
-		// Inherited via ISecurity
-		bool is_tradeable() override
+	bool is_running()
+	{
+		auto lock = std::unique_lock(mutex);
+		return running;
+	}
+
+	std::size_t get_queued_count()
+	{
+		auto lock = std::unique_lock(mutex);
+		return results.size();
+	}
+
+	// The oldest queued result. Waits up to `timeout_seconds` (forever if not given) while the stepper runs,
+	// `std::nullopt` if none came. Once the results are drained, rethrows what stopped the stepping thread.
+	std::optional<SimulationStepResult> pop(std::optional<double> timeout_seconds = std::nullopt)
+	{
+		auto lock = std::unique_lock(mutex);
+		auto ready = [&]
 		{
-			return true;
+			return !results.empty() || !running;
+		};
+		if (timeout_seconds.has_value())
+		{
+			changed.wait_for(lock, std::chrono::duration<double>(*timeout_seconds), ready);
 		}
-		void before_step(ISimulation &simulation, std::shared_ptr<IPortfolioManager> portfolio) override {}
-		void after_step(ISimulation &simulation, std::shared_ptr<IPortfolioManager> portfolio) override
+		else
 		{
-			auto dt = simulation.get_dt();
-			auto dividend = dividend_function(simulation.get_tick());
-			auto stock_id = simulation.get_security_id(ticker);
-			auto currency_id = simulation.get_security_id(currency);
-
-			for (UserID user_id = 0; user_id < portfolio->get_user_count(); user_id++)
-			{
-				portfolio->multiply_and_add_1_to_2(user_id, stock_id, currency_id, dt * dividend);
-			}
+			changed.wait(lock, ready);
 		}
-		void on_simulation_start(ISimulation &simulation, std::shared_ptr<IPortfolioManager> portfolio) override {}
-		void on_simulation_end(ISimulation &simulation, std::shared_ptr<IPortfolioManager> portfolio) override
+		if (results.empty())
 		{
-			// At the end convert to CAD at midpoint price, or `100.0f`
-			auto stock_id = simulation.get_security_id(ticker);
-			auto currency_id = simulation.get_security_id(currency);
-
-			auto close_bid_price = 100.0f;
-			auto close_ask_price = 100.0f;
-			if (simulation.get_bid_count(stock_id) > 0)
-			{
-				close_bid_price = simulation.get_top_bid(stock_id).price;
-			}
-			if (simulation.get_ask_count(stock_id) > 0)
-			{
-				close_ask_price = simulation.get_top_ask(stock_id).price;
-			}
-
-			for (UserID index_user = 0; index_user < portfolio->get_user_count(); index_user++)
+			if (error)
 			{
-				portfolio->multiply_and_add_1_to_2_and_set_1(
-					index_user, stock_id, currency_id, (close_bid_price + close_ask_price) / 2.0f, 0.0f);
+				std::rethrow_exception(std::exchange(error, nullptr));
 			}
+			return std::nullopt;
 		}
-		void on_trade_executed(
-			ISimulation &simulation, std::shared_ptr<IPortfolioManager> portfolio,
-			UserID buyer, UserID seller, float price, float quantity) override
-		{
-			auto stock_id = simulation.get_security_id(ticker);
-			auto cad_id = simulation.get_security_id(currency);
-			// The buyer gets the stock, but losses money
-			portfolio->add_to_two_securities(buyer, stock_id, quantity, cad_id, -price * quantity);
-			// The seller losses the stock, but gets money
-			portfolio->add_to_two_securities(seller, stock_id, -quantity, cad_id, price * quantity);
-		}
-	};
-
+		auto result = std::move(results.front());
+		results.pop_front();
+		lock.unlock();
+		changed.notify_all();
+		return result;
+	}
 };
 
+#ifndef TRADERRANK_ENGINE_ONLY
 class PyISecurity : public ISecurity
 {
 public:
@@ -1468,6 +4885,40 @@ public:
 	{
 		PYBIND11_OVERRIDE_PURE(void, ISecurity, on_trade_executed, sim, pm, b, s, p, v);
 	}
+	// Securities overriding `on_trades_executed` get the trades as one `Transaction` structured array, the others
+	// get an `on_trade_executed` call per trade. The GIL is held across all of them.
+	void on_trades_executed(ISimulation &sim, std::shared_ptr<IPortfolioManager> pm, std::span<const Transaction> transactions) override
+	{
+		py::gil_scoped_acquire gil;
+		if (auto override = py::get_override(static_cast<const ISecurity *>(this), "on_trades_executed"))
+		{
+			auto trades = py::array_t<Transaction>(static_cast<py::ssize_t>(transactions.size()));
+			std::copy(transactions.begin(), transactions.end(), trades.mutable_data());
+			override(sim, pm, trades);
+			return;
+		}
+		ISecurity::on_trades_executed(sim, pm, transactions);
+	}
+	std::optional<TradeSettlement> get_trade_settlement(ISimulation &sim) override
+	{
+		PYBIND11_OVERRIDE(std::optional<TradeSettlement>, ISecurity, get_trade_settlement, sim);
+	}
+	// Python securities can hold any state, so forking one that does not say how is an error
+	std::shared_ptr<ISecurity> fork_security(std::shared_ptr<ISecurity> self) override
+	{
+		PYBIND11_OVERRIDE_PURE(std::shared_ptr<ISecurity>, ISecurity, fork_security, self);
+	}
+};
+
+class PyIAgent : public IAgent
+{
+public:
+	using IAgent::IAgent;
+
+	void on_step(ISimulation &sim) override
+	{
+		PYBIND11_OVERRIDE_PURE(void, IAgent, on_step, sim);
+	}
 };
 
 class PyIPortfolioManager : public IPortfolioManager
@@ -1555,14 +5006,30 @@ public:
 	{
 		PYBIND11_OVERRIDE_PURE(FlatOrderBook, ISimulation, get_order_book, sid);
 	}
-	std::set<OrderID> get_all_open_user_orders(UserID uid, SecurityID sid) const override
+	std::vector<OrderID> get_all_open_user_orders(UserID uid, SecurityID sid) const override
 	{
-		PYBIND11_OVERRIDE_PURE(std::set<OrderID>, ISimulation, get_all_open_user_orders, uid, sid);
+		PYBIND11_OVERRIDE_PURE(std::vector<OrderID>, ISimulation, get_all_open_user_orders, uid, sid);
 	}
 	BookDepth get_cumulative_book_depth(SecurityID sid) const override
 	{
 		PYBIND11_OVERRIDE_PURE(BookDepth, ISimulation, get_cumulative_book_depth, sid);
 	}
+	BookDepth get_book_depth(SecurityID sid, uint32_t levels) const override
+	{
+		PYBIND11_OVERRIDE_PURE(BookDepth, ISimulation, get_book_depth, sid, levels);
+	}
+	BookSnapshot get_book_snapshot(SecurityID sid) const override
+	{
+		PYBIND11_OVERRIDE_PURE(BookSnapshot, ISimulation, get_book_snapshot, sid);
+	}
+	float get_tick_size(SecurityID sid) const override
+	{
+		PYBIND11_OVERRIDE_PURE(float, ISimulation, get_tick_size, sid);
+	}
+	MatchingMode get_matching_mode() const noexcept override
+	{
+		PYBIND11_OVERRIDE_PURE(MatchingMode, ISimulation, get_matching_mode);
+	}
 	SimulationStepResult do_simulation_step() override
 	{
 		PYBIND11_OVERRIDE_PURE(SimulationStepResult, ISimulation, do_simulation_step);
@@ -1583,14 +5050,61 @@ public:
 	{
 		PYBIND11_OVERRIDE_PURE(OrderID, ISimulation, direct_insert_limit_order, uid, sid, s, p, v);
 	}
+	std::vector<OrderID> bulk_insert_limit_orders(UserID uid, SecurityID sid, std::span<const OrderSide> s, std::span<const float> p, std::span<const float> v, bool m) override
+	{
+		PYBIND11_OVERRIDE_PURE(std::vector<OrderID>, ISimulation, bulk_insert_limit_orders, uid, sid, std::vector<OrderSide>(s.begin(), s.end()),
+							   std::vector<float>(p.begin(), p.end()), std::vector<float>(v.begin(), v.end()), m);
+	}
 	OrderID submit_market_order(UserID uid, SecurityID sid, OrderAction a, float v) override
 	{
 		PYBIND11_OVERRIDE_PURE(OrderID, ISimulation, submit_market_order, uid, sid, a, v);
 	}
+	void set_tick_size(SecurityID sid, float ts) override
+	{
+		PYBIND11_OVERRIDE_PURE(void, ISimulation, set_tick_size, sid, ts);
+	}
+	void set_matching_mode(MatchingMode mode) override
+	{
+		PYBIND11_OVERRIDE_PURE(void, ISimulation, set_matching_mode, mode);
+	}
+};
+
+// Destroying a stepper joins its thread, which may be waiting for the GIL in a Python override or callback
+struct GilReleasingStepperDelete
+{
+	void operator()(SimulationStepper *stepper) const
+	{
+		py::gil_scoped_release release;
+		delete stepper;
+	}
 };
 
+// A numpy structured array taking over `values` without copying them
+template <typename T>
+py::array_t<T> adopt_as_array(std::vector<T> &&values)
+{
+	auto owned = new std::vector<T>(std::move(values));
+	auto owner = py::capsule(owned, [](void *pointer)
+	{
+		delete static_cast<std::vector<T> *>(pointer);
+	});
+	return py::array_t<T>(static_cast<py::ssize_t>(owned->size()), owned->data(), owner);
+}
+
+// A read-only `rows x columns` numpy array over `data`, which keeps `owner` alive
+py::array_t<float> make_read_only_view(const float *data, std::size_t rows, std::size_t columns, py::handle owner)
+{
+	auto view = py::array_t<float>(std::vector<py::ssize_t>{static_cast<py::ssize_t>(rows), static_cast<py::ssize_t>(columns)}, data, owner);
+	view.attr("setflags")(py::arg("write") = false);
+	return view;
+}
+
 PYBIND11_MODULE(Server, m)
 {
+	// Structured dtypes of the numpy exports
+	PYBIND11_NUMPY_DTYPE(OrderRecord, order_id, user_id, price, volume);
+	PYBIND11_NUMPY_DTYPE(Transaction, price, volume, buyer_id, seller_id, buyer_order_id, seller_order_id);
+
 	py::enum_<OrderSide>(m, "OrderSide")
 		.value("BID", OrderSide::BID)
 		.value("ASK", OrderSide::ASK)
@@ -1601,6 +5115,24 @@ PYBIND11_MODULE(Server, m)
 		.value("SELL", OrderAction::SELL)
 		.export_values();
 
+	py::enum_<MatchingMode>(m, "MatchingMode")
+		.value("CONTINUOUS", MatchingMode::CONTINUOUS)
+		.value("CALL_AUCTION", MatchingMode::CALL_AUCTION)
+		.export_values();
+
+	// Combined with `|` from Python, which gives a plain int
+	py::enum_<StepResultOptions>(m, "StepResultOptions", py::arithmetic())
+		.value("NONE", StepResultOptions::NONE)
+		.value("TRANSACTIONS", StepResultOptions::TRANSACTIONS)
+		.value("V1_ORDER_UPDATES", StepResultOptions::V1_ORDER_UPDATES)
+		.value("V2_ORDER_UPDATES", StepResultOptions::V2_ORDER_UPDATES)
+		.value("ORDER_BOOKS", StepResultOptions::ORDER_BOOKS)
+		.value("BOOK_DEPTH", StepResultOptions::BOOK_DEPTH)
+		.value("BOOK_DELTAS", StepResultOptions::BOOK_DELTAS)
+		.value("PORTFOLIOS", StepResultOptions::PORTFOLIOS)
+		.value("USERNAMES", StepResultOptions::USERNAMES)
+		.value("ALL", StepResultOptions::ALL);
+
 	py::class_<LimitOrder>(m, "LimitOrder")
 		.def(py::init<>())
 		.def_readwrite("user_id", &LimitOrder::user_id)
@@ -1622,6 +5154,39 @@ PYBIND11_MODULE(Server, m)
 		.def_readwrite("buyer_order_id", &Transaction::buyer_order_id)
 		.def_readwrite("seller_order_id", &Transaction::seller_order_id);
 
+	py::class_<TradeSettlement>(m, "TradeSettlement")
+		.def(py::init<SecurityID, SecurityID>(), py::arg("security_id"), py::arg("currency_id"))
+		.def_readwrite("security_id", &TradeSettlement::security_id)
+		.def_readwrite("currency_id", &TradeSettlement::currency_id);
+
+	py::enum_<BookEventType>(m, "BookEventType")
+		.value("ADD", BookEventType::ADD)
+		.value("MODIFY", BookEventType::MODIFY)
+		.value("DELETE", BookEventType::DELETE)
+		.export_values();
+
+	py::class_<OrderEvent>(m, "OrderEvent")
+		.def_readwrite("sequence", &OrderEvent::sequence)
+		.def_readwrite("type", &OrderEvent::type)
+		.def_readwrite("order", &OrderEvent::order);
+
+	py::class_<LevelUpdate>(m, "LevelUpdate")
+		.def_readwrite("sequence", &LevelUpdate::sequence)
+		.def_readwrite("side", &LevelUpdate::side)
+		.def_readwrite("price", &LevelUpdate::price)
+		.def_readwrite("volume", &LevelUpdate::volume)
+		.def_readwrite("order_count", &LevelUpdate::order_count);
+
+	py::class_<BookDelta>(m, "BookDelta")
+		.def_readwrite("previous_sequence", &BookDelta::previous_sequence)
+		.def_readwrite("sequence", &BookDelta::sequence)
+		.def_readwrite("level_updates", &BookDelta::level_updates)
+		.def_readwrite("order_events", &BookDelta::order_events);
+
+	py::class_<BookSnapshot>(m, "BookSnapshot")
+		.def_readwrite("sequence", &BookSnapshot::sequence)
+		.def_readwrite("book", &BookSnapshot::book);
+
 	py::bind_vector<std::vector<LimitOrder>>(m, "LimitOrderList");
 	py::bind_map<std::map<float, float>>(m, "PriceDepthMap");
 
@@ -1630,6 +5195,16 @@ PYBIND11_MODULE(Server, m)
 		.def_readwrite("fully_transacted_orders", &SimulationStepResult::fully_transacted_orders)
 		.def_readwrite("cancelled_orders", &SimulationStepResult::cancelled_orders)
 		.def_readwrite("transactions", &SimulationStepResult::transactions)
+		// The transactions of each ticker as a structured array, one copy of each vector
+		.def_property_readonly("transaction_records", [](const SimulationStepResult &self)
+		{
+			auto records = py::dict();
+			for (const auto &[ticker, transactions] : self.transactions)
+			{
+				records[py::str(ticker)] = py::array_t<Transaction>(static_cast<py::ssize_t>(transactions.size()), transactions.data());
+			}
+			return records;
+		})
 		.def_readwrite("order_book_depth_per_security", &SimulationStepResult::order_book_depth_per_security)
 		.def_readwrite("order_book_per_security", &SimulationStepResult::order_book_per_security)
 		.def_readwrite("portfolios", &SimulationStepResult::portfolios)
@@ -1638,7 +5213,58 @@ PYBIND11_MODULE(Server, m)
 		.def_readwrite("has_next_step", &SimulationStepResult::has_next_step)
 		.def_readwrite("v2_submitted_orders", &SimulationStepResult::v2_submitted_orders)
 		.def_readwrite("v2_cancelled_orders", &SimulationStepResult::v2_cancelled_orders)
-		.def_readwrite("v2_transacted_orders", &SimulationStepResult::v2_transacted_orders);
+		.def_readwrite("v2_transacted_orders", &SimulationStepResult::v2_transacted_orders)
+		.def_readwrite("book_deltas", &SimulationStepResult::book_deltas);
+
+	// Fields are converted to Python when read, so only the ones used are paid for
+	py::class_<SecurityStepResult>(m, "SecurityStepResult")
+		.def_readonly("partially_transacted_orders", &SecurityStepResult::partially_transacted_orders)
+		.def_readonly("fully_transacted_orders", &SecurityStepResult::fully_transacted_orders)
+		.def_readonly("cancelled_orders", &SecurityStepResult::cancelled_orders)
+		.def_readonly("transactions", &SecurityStepResult::transactions)
+		// A read-only structured array over `transactions`, valid until the next step
+		.def_property_readonly("transaction_records", [](py::object self)
+		{
+			const auto &transactions = self.cast<const SecurityStepResult &>().transactions;
+			auto records = py::array_t<Transaction>(static_cast<py::ssize_t>(transactions.size()), transactions.data(), self);
+			records.attr("setflags")(py::arg("write") = false);
+			return records;
+		})
+		.def_readonly("bid_depth", &SecurityStepResult::bid_depth)
+		.def_readonly("ask_depth", &SecurityStepResult::ask_depth)
+		.def_readonly("order_book", &SecurityStepResult::order_book)
+		.def_readonly("v2_submitted_orders", &SecurityStepResult::v2_submitted_orders)
+		.def_readonly("v2_cancelled_orders", &SecurityStepResult::v2_cancelled_orders)
+		.def_readonly("v2_transacted_orders", &SecurityStepResult::v2_transacted_orders)
+		.def_readonly("book_delta", &SecurityStepResult::book_delta);
+
+	py::class_<StepResult>(m, "StepResult")
+		.def("__len__", [](const StepResult &self)
+		{
+			return self.securities.size();
+		})
+		.def("__getitem__", [](const StepResult &self, SecurityID security_id) -> const SecurityStepResult &
+		{
+			if (security_id >= self.securities.size())
+			{
+				throw py::index_error(fmt::format("The security_id: `{}` doesn't exist.", security_id));
+			}
+			return self.securities[security_id];
+		}, py::arg("security_id"), py::return_value_policy::reference_internal)
+		// A `users x securities` view, valid until the next step
+		.def_property_readonly("portfolios", [](py::object self)
+		{
+			const auto &result = self.cast<const StepResult &>();
+			auto columns = result.securities.size();
+			return make_read_only_view(result.portfolios.data(), columns == 0 ? 0 : result.portfolios.size() / columns, columns, self);
+		})
+		.def_readonly("user_count", &StepResult::user_count)
+		.def_readonly("current_step", &StepResult::current_step)
+		.def_readonly("has_next_step", &StepResult::has_next_step);
+
+	py::class_<IAgent, PyIAgent, std::shared_ptr<IAgent>>(m, "IAgent")
+		.def(py::init<>())
+		.def("on_step", &IAgent::on_step, py::arg("simulation"));
 
 	py::class_<ISecurity, PyISecurity, std::shared_ptr<ISecurity>>(m, "ISecurity")
 		.def(py::init<>())
@@ -1649,7 +5275,27 @@ PYBIND11_MODULE(Server, m)
 		.def("on_simulation_end", &ISecurity::on_simulation_end, py::arg("simulation"), py::arg("portfolio"))
 		.def("on_trade_executed", &ISecurity::on_trade_executed,
 			 py::arg("simulation"), py::arg("portfolio"), py::arg("buyer_id"),
-			 py::arg("seller_id"), py::arg("transacted_price"), py::arg("transacted_volume"));
+			 py::arg("seller_id"), py::arg("transacted_price"), py::arg("transacted_volume"))
+		// `trades` is a `Transaction` structured array, the default calls `on_trade_executed` for each one
+		.def("on_trades_executed", [](ISecurity &self, ISimulation &simulation, std::shared_ptr<IPortfolioManager> portfolio, py::array_t<Transaction, py::array::c_style | py::array::forcecast> trades)
+		{
+			self.ISecurity::on_trades_executed(simulation, portfolio, std::span<const Transaction>(trades.data(), trades.size()));
+		}, py::arg("simulation"), py::arg("portfolio"), py::arg("trades"))
+		.def("get_trade_settlement", &ISecurity::get_trade_settlement, py::arg("simulation"))
+		.def("fork_security", &ISecurity::fork_security, py::arg("self_security"));
+
+	py::class_<ObservationSpec>(m, "ObservationSpec")
+		.def(py::init<>())
+		.def_readwrite("security_ids", &ObservationSpec::security_ids)
+		.def_readwrite("cash_id", &ObservationSpec::cash_id)
+		.def_readwrite("book_levels", &ObservationSpec::book_levels)
+		.def_readwrite("trade_count", &ObservationSpec::trade_count)
+		.def("get_security_feature_count", &ObservationSpec::get_security_feature_count)
+		.def("get_feature_count", &ObservationSpec::get_feature_count);
+
+	py::class_<SimulationSnapshot>(m, "SimulationSnapshot")
+		.def_readonly("tick", &SimulationSnapshot::tick)
+		.def_readonly("user_count", &SimulationSnapshot::user_count);
 
 	py::class_<IPortfolioManager, PyIPortfolioManager, std::shared_ptr<IPortfolioManager>>(m, "IPortfolioManager")
 		.def(py::init<>())
@@ -1678,27 +5324,338 @@ PYBIND11_MODULE(Server, m)
 		.def("get_T", &ISimulation::get_T)
 		.def("get_tick", &ISimulation::get_tick)
 		.def("get_N", &ISimulation::get_N)
-		.def("add_user", &ISimulation::add_user, py::arg("username"))
+		.def("add_user", &ISimulation::add_user, py::arg("username"), py::call_guard<py::gil_scoped_release>())
 		.def("get_user_count", &ISimulation::get_user_count)
 		.def("get_user_portfolio", &ISimulation::get_user_portfolio)
-		.def("get_top_bid", &ISimulation::get_top_bid, py::arg("security_id"))
-		.def("get_top_ask", &ISimulation::get_top_ask, py::arg("security_id"))
-		.def("get_bid_count", &ISimulation::get_bid_count, py::arg("security_id"))
-		.def("get_ask_count", &ISimulation::get_ask_count, py::arg("security_id"))
-		.def("get_order_book", &ISimulation::get_order_book, py::arg("security_id"))
-		.def("get_all_open_user_orders", &ISimulation::get_all_open_user_orders, py::arg("user_id"), py::arg("security_id"))
-		.def("get_cumulative_book_depth", &ISimulation::get_cumulative_book_depth, py::arg("security_id"))
-		.def("do_simulation_step", &ISimulation::do_simulation_step)
+		.def("get_top_bid", &ISimulation::get_top_bid, py::arg("security_id"), py::call_guard<py::gil_scoped_release>())
+		.def("get_top_ask", &ISimulation::get_top_ask, py::arg("security_id"), py::call_guard<py::gil_scoped_release>())
+		.def("get_bid_count", &ISimulation::get_bid_count, py::arg("security_id"), py::call_guard<py::gil_scoped_release>())
+		.def("get_ask_count", &ISimulation::get_ask_count, py::arg("security_id"), py::call_guard<py::gil_scoped_release>())
+		.def("get_order_book", &ISimulation::get_order_book, py::arg("security_id"), py::call_guard<py::gil_scoped_release>())
+		.def("get_all_open_user_orders", &ISimulation::get_all_open_user_orders, py::arg("user_id"), py::arg("security_id"), py::call_guard<py::gil_scoped_release>())
+		.def("get_cumulative_book_depth", &ISimulation::get_cumulative_book_depth, py::arg("security_id"), py::call_guard<py::gil_scoped_release>())
+		.def("get_book_depth", &ISimulation::get_book_depth, py::arg("security_id"), py::arg("levels"), py::call_guard<py::gil_scoped_release>())
+		.def("get_book_snapshot", &ISimulation::get_book_snapshot, py::arg("security_id"), py::call_guard<py::gil_scoped_release>())
+		.def("get_tick_size", &ISimulation::get_tick_size, py::arg("security_id"), py::call_guard<py::gil_scoped_release>())
+		.def("get_matching_mode", &ISimulation::get_matching_mode)
+		.def("do_simulation_step", &ISimulation::do_simulation_step, py::call_guard<py::gil_scoped_release>())
+		// Submissions only touch the queue of their security, so other Python threads can run meanwhile
 		.def("submit_limit_order", &ISimulation::submit_limit_order,
-			 py::arg("user_id"), py::arg("security_id"), py::arg("side"), py::arg("price"), py::arg("volume"))
+			 py::arg("user_id"), py::arg("security_id"), py::arg("side"), py::arg("price"), py::arg("volume"), py::call_guard<py::gil_scoped_release>())
 		.def("submit_cancel_order", &ISimulation::submit_cancel_order,
-			 py::arg("user_id"), py::arg("security_id"), py::arg("order_id"))
-		.def("reset_simulation", &ISimulation::reset_simulation)
-		.def("direct_insert_limit_order", &ISimulation::direct_insert_limit_order, py::arg("user_id"), py::arg("security_id"), py::arg("side"), py::arg("price"), py::arg("volume"))
-		.def("submit_market_order", &ISimulation::submit_market_order, py::arg("user_id"), py::arg("security_id"), py::arg("action"), py::arg("volume"));
+			 py::arg("user_id"), py::arg("security_id"), py::arg("order_id"), py::call_guard<py::gil_scoped_release>())
+		.def("reset_simulation", &ISimulation::reset_simulation, py::call_guard<py::gil_scoped_release>())
+		.def("direct_insert_limit_order", &ISimulation::direct_insert_limit_order, py::arg("user_id"), py::arg("security_id"), py::arg("side"), py::arg("price"), py::arg("volume"), py::call_guard<py::gil_scoped_release>())
+		.def("bulk_insert_limit_orders", [](ISimulation &self, UserID user_id, SecurityID security_id,
+											py::array_t<uint8_t, py::array::c_style | py::array::forcecast> sides,
+											py::array_t<float, py::array::c_style | py::array::forcecast> prices,
+											py::array_t<float, py::array::c_style | py::array::forcecast> volumes,
+											bool match_crossing)
+		{
+			if (sides.ndim() != 1 || prices.ndim() != 1 || volumes.ndim() != 1)
+			{
+				throw std::runtime_error("Cannot bulk insert limit orders from arrays that are not one dimensional.");
+			}
+			// Prices and volumes are read in place, the sides are widened from raw `uint8` values to `OrderSide`
+			auto order_sides = std::vector<OrderSide>(sides.size());
+			std::transform(sides.data(), sides.data() + sides.size(), order_sides.begin(), [](uint8_t side)
+			{
+				return static_cast<OrderSide>(side);
+			});
+			auto order_ids = std::vector<OrderID>();
+			{
+				py::gil_scoped_release release;
+				order_ids = self.bulk_insert_limit_orders(user_id, security_id, order_sides, std::span<const float>(prices.data(), prices.size()),
+														  std::span<const float>(volumes.data(), volumes.size()), match_crossing);
+			}
+			return py::array_t<OrderID>(order_ids.size(), order_ids.data());
+		}, py::arg("user_id"), py::arg("security_id"), py::arg("sides"), py::arg("prices"), py::arg("volumes"), py::arg("match_crossing") = false)
+		.def("submit_market_order", &ISimulation::submit_market_order, py::arg("user_id"), py::arg("security_id"), py::arg("action"), py::arg("volume"), py::call_guard<py::gil_scoped_release>())
+		.def("set_tick_size", &ISimulation::set_tick_size, py::arg("security_id"), py::arg("tick_size"), py::call_guard<py::gil_scoped_release>())
+		.def("set_matching_mode", &ISimulation::set_matching_mode, py::arg("mode"), py::call_guard<py::gil_scoped_release>());
 
 	py::class_<GenericSimulation, ISimulation, std::shared_ptr<GenericSimulation>>(m, "GenericSimulation")
-		.def(py::init<const std::map<SecurityTicker, std::shared_ptr<ISecurity>> &, float, uint32_t>());
+		.def(py::init<const std::map<SecurityTicker, std::shared_ptr<ISecurity>> &, float, uint32_t>())
+		.def("get_last_step_allocation_count", &GenericSimulation::get_last_step_allocation_count)
+		// Batch submissions from one dimensional arrays, returning the ids of the orders
+		.def("submit_limit_orders", [](GenericSimulation &self,
+									   py::array_t<UserID, py::array::c_style | py::array::forcecast> user_ids,
+									   py::array_t<SecurityID, py::array::c_style | py::array::forcecast> security_ids,
+									   py::array_t<uint8_t, py::array::c_style | py::array::forcecast> sides,
+									   py::array_t<float, py::array::c_style | py::array::forcecast> prices,
+									   py::array_t<float, py::array::c_style | py::array::forcecast> volumes)
+		{
+			auto order_sides = std::vector<OrderSide>(sides.size());
+			std::transform(sides.data(), sides.data() + sides.size(), order_sides.begin(), [](uint8_t side)
+			{
+				return static_cast<OrderSide>(side);
+			});
+			auto order_ids = py::array_t<OrderID>(user_ids.size());
+			{
+				py::gil_scoped_release release;
+				self.submit_limit_orders(std::span(user_ids.data(), user_ids.size()), std::span(security_ids.data(), security_ids.size()), order_sides,
+										 std::span(prices.data(), prices.size()), std::span(volumes.data(), volumes.size()),
+										 std::span(order_ids.mutable_data(), order_ids.size()));
+			}
+			return order_ids;
+		}, py::arg("user_ids"), py::arg("security_ids"), py::arg("sides"), py::arg("prices"), py::arg("volumes"))
+		.def("submit_cancel_orders", [](GenericSimulation &self,
+										py::array_t<UserID, py::array::c_style | py::array::forcecast> user_ids,
+										py::array_t<SecurityID, py::array::c_style | py::array::forcecast> security_ids,
+										py::array_t<OrderID, py::array::c_style | py::array::forcecast> order_ids)
+		{
+			py::gil_scoped_release release;
+			self.submit_cancel_orders(std::span(user_ids.data(), user_ids.size()), std::span(security_ids.data(), security_ids.size()),
+									  std::span(order_ids.data(), order_ids.size()));
+		}, py::arg("user_ids"), py::arg("security_ids"), py::arg("order_ids"))
+		.def("submit_market_orders", [](GenericSimulation &self,
+										py::array_t<UserID, py::array::c_style | py::array::forcecast> user_ids,
+										py::array_t<SecurityID, py::array::c_style | py::array::forcecast> security_ids,
+										py::array_t<uint8_t, py::array::c_style | py::array::forcecast> actions,
+										py::array_t<float, py::array::c_style | py::array::forcecast> volumes)
+		{
+			auto order_actions = std::vector<OrderAction>(actions.size());
+			std::transform(actions.data(), actions.data() + actions.size(), order_actions.begin(), [](uint8_t action)
+			{
+				return static_cast<OrderAction>(action);
+			});
+			auto order_ids = py::array_t<OrderID>(user_ids.size());
+			{
+				py::gil_scoped_release release;
+				self.submit_market_orders(std::span(user_ids.data(), user_ids.size()), std::span(security_ids.data(), security_ids.size()), order_actions,
+										  std::span(volumes.data(), volumes.size()), std::span(order_ids.mutable_data(), order_ids.size()));
+			}
+			return order_ids;
+		}, py::arg("user_ids"), py::arg("security_ids"), py::arg("actions"), py::arg("volumes"))
+		// Returns (bids, asks) structured arrays of (order_id, user_id, price, volume), of the best `max_levels` levels if given
+		.def("get_order_records", [](const GenericSimulation &self, SecurityID security_id, std::optional<uint32_t> max_levels)
+		{
+			auto records = std::pair<std::vector<OrderRecord>, std::vector<OrderRecord>>();
+			{
+				py::gil_scoped_release release;
+				records = self.get_order_records(security_id, max_levels.value_or(std::numeric_limits<uint32_t>::max()));
+			}
+			return py::make_tuple(adopt_as_array(std::move(records.first)), adopt_as_array(std::move(records.second)));
+		}, py::arg("security_id"), py::arg("max_levels") = std::nullopt)
+		// A read-only `users x securities` view of the live table, see `GenericSimulation::share_portfolio_data`.
+		// It owns a share of the storage, take a new one after adding users or restoring a snapshot.
+		.def("get_portfolio_view", [](const GenericSimulation &self)
+		{
+			auto [data, user_count] = self.share_portfolio_data();
+			auto values = data.get();
+			auto owner = py::capsule(new std::shared_ptr<const float[]>(std::move(data)), [](void *pointer)
+			{
+				delete static_cast<std::shared_ptr<const float[]> *>(pointer);
+			});
+			return make_read_only_view(values, user_count, self.get_securities_count(), owner);
+		})
+		// Copies the table into `out`, a C contiguous `users x securities` float32 array
+		.def("copy_portfolio_table", [](const GenericSimulation &self, py::array out)
+		{
+			if (!py::isinstance<py::array_t<float, py::array::c_style>>(out))
+			{
+				throw std::runtime_error("Cannot copy the portfolio table into an array that is not C contiguous float32.");
+			}
+			if (out.ndim() != 2 || out.shape(0) != self.get_user_count() || out.shape(1) != self.get_securities_count())
+			{
+				throw std::runtime_error(fmt::format("Cannot copy the portfolio table into an array that is not `{} x {}`.", self.get_user_count(), self.get_securities_count()));
+			}
+			auto table = std::span<float>(static_cast<float *>(out.mutable_data()), out.size());
+			py::gil_scoped_release release;
+			self.copy_portfolio_table(table);
+		}, py::arg("out"))
+		.def("set_observation_spec", &GenericSimulation::set_observation_spec, py::arg("spec"), py::call_guard<py::gil_scoped_release>())
+		.def("get_observation_spec", &GenericSimulation::get_observation_spec, py::call_guard<py::gil_scoped_release>())
+		// Fills `out`, a C contiguous `len(user_ids) x features` float32 array, or a new one if not given, see `ObservationSpec`
+		.def("fill_observations", [](const GenericSimulation &self, py::array_t<UserID, py::array::c_style | py::array::forcecast> user_ids, std::optional<py::array> out)
+		{
+			auto spec = ObservationSpec();
+			{
+				py::gil_scoped_release release;
+				spec = self.get_observation_spec();
+			}
+			auto feature_count = static_cast<py::ssize_t>(spec.get_feature_count());
+			auto observations = out ? *out : py::array(py::array_t<float>(std::vector<py::ssize_t>{user_ids.size(), feature_count}));
+			if (!py::isinstance<py::array_t<float, py::array::c_style>>(observations))
+			{
+				throw std::runtime_error("Cannot fill observations into an array that is not C contiguous float32.");
+			}
+			if (observations.ndim() != 2 || observations.shape(0) != user_ids.size() || observations.shape(1) != feature_count)
+			{
+				throw std::runtime_error(fmt::format("Cannot fill observations into an array that is not `{} x {}`.", user_ids.size(), feature_count));
+			}
+			auto values = std::span<float>(static_cast<float *>(observations.mutable_data()), observations.size());
+			{
+				py::gil_scoped_release release;
+				self.fill_observations(std::span(user_ids.data(), user_ids.size()), values);
+			}
+			return observations;
+		}, py::arg("user_ids"), py::arg("out") = std::nullopt)
+		.def("do_simulation_step_flat", &GenericSimulation::do_simulation_step_flat, py::return_value_policy::reference_internal, py::call_guard<py::gil_scoped_release>())
+		.def("snapshot", &GenericSimulation::snapshot, py::call_guard<py::gil_scoped_release>())
+		.def("restore", &GenericSimulation::restore, py::arg("snapshot"), py::call_guard<py::gil_scoped_release>())
+		.def("fork", &GenericSimulation::fork, py::call_guard<py::gil_scoped_release>())
+		.def("set_matching_threads", &GenericSimulation::set_matching_threads, py::arg("thread_count"), py::call_guard<py::gil_scoped_release>())
+		.def("get_matching_threads", &GenericSimulation::get_matching_threads)
+		.def("set_step_result_options", [](GenericSimulation &self, uint32_t options)
+		{
+			self.set_step_result_options(static_cast<StepResultOptions>(options & static_cast<uint32_t>(StepResultOptions::ALL)));
+		}, py::arg("options"), py::call_guard<py::gil_scoped_release>())
+		.def("get_step_result_options", [](const GenericSimulation &self)
+		{
+			return static_cast<uint32_t>(self.get_step_result_options());
+		})
+		// Returns a dict with `steps` (the number of steps run) and the requested summaries as float32 arrays
+		.def("run_steps", [](GenericSimulation &self, uint32_t step_count, const std::vector<std::shared_ptr<IAgent>> &agents,
+							 bool mid_prices, bool traded_volumes, bool final_portfolios)
+		{
+			auto securities_count = static_cast<py::ssize_t>(self.get_securities_count());
+			auto step_shape = std::vector<py::ssize_t>{static_cast<py::ssize_t>(step_count), securities_count};
+			auto mid_price_array = py::array_t<float>(mid_prices ? step_shape : std::vector<py::ssize_t>{0, securities_count});
+			auto traded_volume_array = py::array_t<float>(traded_volumes ? step_shape : std::vector<py::ssize_t>{0, securities_count});
+			auto portfolio_array = py::array_t<float>(std::vector<py::ssize_t>{final_portfolios ? static_cast<py::ssize_t>(self.get_user_count()) : 0, securities_count});
+			auto output = RunStepsOutput{
+				.mid_prices = std::span<float>(mid_price_array.mutable_data(), mid_price_array.size()),
+				.traded_volumes = std::span<float>(traded_volume_array.mutable_data(), traded_volume_array.size()),
+				.final_portfolios = std::span<float>(portfolio_array.mutable_data(), portfolio_array.size())};
+			uint32_t steps_run = 0;
+			{
+				// Python agents take the GIL back for their `on_step`
+				py::gil_scoped_release release;
+				steps_run = self.run_steps(step_count, agents, output);
+			}
+
+			auto summary = py::dict();
+			summary["steps"] = steps_run;
+			if (mid_prices)
+			{
+				mid_price_array.resize({static_cast<py::ssize_t>(steps_run), securities_count});
+				summary["mid_prices"] = mid_price_array;
+			}
+			if (traded_volumes)
+			{
+				traded_volume_array.resize({static_cast<py::ssize_t>(steps_run), securities_count});
+				summary["traded_volumes"] = traded_volume_array;
+			}
+			if (final_portfolios)
+			{
+				summary["final_portfolios"] = portfolio_array;
+			}
+			return summary;
+		}, py::arg("step_count"), py::arg("agents"), py::arg("mid_prices") = true, py::arg("traded_volumes") = true, py::arg("final_portfolios") = true);
+
+	py::module_ agents = m.def_submodule("GenericAgents", "Generic native agents");
+
+	py::class_<GenericAgents::NoiseTrader, IAgent, std::shared_ptr<GenericAgents::NoiseTrader>>(agents, "NoiseTrader")
+		.def(py::init<UserID, SecurityID, uint32_t, float, float, float, uint32_t, float, uint32_t>(),
+			 py::arg("user_id"),
+			 py::arg("security_id"),
+			 py::arg("orders_per_step"),
+			 py::arg("price_deviation"),
+			 py::arg("max_volume"),
+			 py::arg("market_order_probability"),
+			 py::arg("order_lifetime"),
+			 py::arg("initial_price"),
+			 py::arg("seed"));
+
+	// The batched methods take `simulation_count x orders_per_simulation` arrays, and release the GIL while they run
+	py::class_<SimulationEnsemble, std::shared_ptr<SimulationEnsemble>>(m, "SimulationEnsemble")
+		.def(py::init<const std::map<SecurityTicker, std::shared_ptr<ISecurity>> &, float, uint32_t, uint32_t, const std::vector<Username> &, uint32_t>(),
+			 py::arg("securities"), py::arg("T"), py::arg("N"), py::arg("simulation_count"), py::arg("usernames"), py::arg("thread_count") = 0)
+		.def("set_threads", &SimulationEnsemble::set_threads, py::arg("thread_count"), py::call_guard<py::gil_scoped_release>())
+		.def("get_threads", &SimulationEnsemble::get_threads)
+		.def("get_simulation_count", &SimulationEnsemble::get_simulation_count)
+		.def("get_user_count", &SimulationEnsemble::get_user_count)
+		.def("get_securities_count", &SimulationEnsemble::get_securities_count)
+		.def("get_simulation", &SimulationEnsemble::get_simulation, py::arg("simulation_index"))
+		.def("set_step_result_options", [](SimulationEnsemble &self, uint32_t options)
+		{
+			self.set_step_result_options(static_cast<StepResultOptions>(options & static_cast<uint32_t>(StepResultOptions::ALL)));
+		}, py::arg("options"), py::call_guard<py::gil_scoped_release>())
+		.def("set_tick_size", &SimulationEnsemble::set_tick_size, py::arg("security_id"), py::arg("tick_size"), py::call_guard<py::gil_scoped_release>())
+		.def("do_simulation_steps", &SimulationEnsemble::do_simulation_steps, py::call_guard<py::gil_scoped_release>())
+		.def("reset_simulations", &SimulationEnsemble::reset_simulations, py::call_guard<py::gil_scoped_release>())
+		.def("submit_limit_orders", [](SimulationEnsemble &self,
+									   py::array_t<UserID, py::array::c_style | py::array::forcecast> user_ids,
+									   py::array_t<SecurityID, py::array::c_style | py::array::forcecast> security_ids,
+									   py::array_t<uint8_t, py::array::c_style | py::array::forcecast> sides,
+									   py::array_t<float, py::array::c_style | py::array::forcecast> prices,
+									   py::array_t<float, py::array::c_style | py::array::forcecast> volumes)
+		{
+			auto order_sides = std::vector<OrderSide>(sides.size());
+			std::transform(sides.data(), sides.data() + sides.size(), order_sides.begin(), [](uint8_t side)
+			{
+				return static_cast<OrderSide>(side);
+			});
+			auto order_ids = py::array_t<OrderID>(std::vector<py::ssize_t>(user_ids.shape(), user_ids.shape() + user_ids.ndim()));
+			{
+				py::gil_scoped_release release;
+				self.submit_limit_orders(std::span(user_ids.data(), user_ids.size()), std::span(security_ids.data(), security_ids.size()), order_sides,
+										 std::span(prices.data(), prices.size()), std::span(volumes.data(), volumes.size()),
+										 std::span(order_ids.mutable_data(), order_ids.size()));
+			}
+			return order_ids;
+		}, py::arg("user_ids"), py::arg("security_ids"), py::arg("sides"), py::arg("prices"), py::arg("volumes"))
+		.def("submit_market_orders", [](SimulationEnsemble &self,
+										py::array_t<UserID, py::array::c_style | py::array::forcecast> user_ids,
+										py::array_t<SecurityID, py::array::c_style | py::array::forcecast> security_ids,
+										py::array_t<uint8_t, py::array::c_style | py::array::forcecast> actions,
+										py::array_t<float, py::array::c_style | py::array::forcecast> volumes)
+		{
+			auto order_actions = std::vector<OrderAction>(actions.size());
+			std::transform(actions.data(), actions.data() + actions.size(), order_actions.begin(), [](uint8_t action)
+			{
+				return static_cast<OrderAction>(action);
+			});
+			auto order_ids = py::array_t<OrderID>(std::vector<py::ssize_t>(user_ids.shape(), user_ids.shape() + user_ids.ndim()));
+			{
+				py::gil_scoped_release release;
+				self.submit_market_orders(std::span(user_ids.data(), user_ids.size()), std::span(security_ids.data(), security_ids.size()), order_actions,
+										  std::span(volumes.data(), volumes.size()), std::span(order_ids.mutable_data(), order_ids.size()));
+			}
+			return order_ids;
+		}, py::arg("user_ids"), py::arg("security_ids"), py::arg("actions"), py::arg("volumes"))
+		.def("submit_cancel_orders", [](SimulationEnsemble &self,
+										py::array_t<UserID, py::array::c_style | py::array::forcecast> user_ids,
+										py::array_t<SecurityID, py::array::c_style | py::array::forcecast> security_ids,
+										py::array_t<OrderID, py::array::c_style | py::array::forcecast> order_ids)
+		{
+			py::gil_scoped_release release;
+			self.submit_cancel_orders(std::span(user_ids.data(), user_ids.size()), std::span(security_ids.data(), security_ids.size()),
+									  std::span(order_ids.data(), order_ids.size()));
+		}, py::arg("user_ids"), py::arg("security_ids"), py::arg("order_ids"))
+		.def("get_top_of_book", [](const SimulationEnsemble &self)
+		{
+			auto output = py::array_t<float>(std::vector<py::ssize_t>{self.get_simulation_count(), self.get_securities_count(), 4});
+			auto values = std::span(output.mutable_data(), output.size());
+			{
+				// The simulations' locks can be held by a Python security stepping on another thread
+				py::gil_scoped_release release;
+				self.get_top_of_book(values);
+			}
+			return output;
+		})
+		.def("get_portfolios", [](const SimulationEnsemble &self)
+		{
+			auto output = py::array_t<float>(std::vector<py::ssize_t>{self.get_simulation_count(), self.get_user_count(), self.get_securities_count()});
+			auto values = std::span(output.mutable_data(), output.size());
+			{
+				// Same as in `get_top_of_book`
+				py::gil_scoped_release release;
+				self.get_portfolios(values);
+			}
+			return output;
+		});
+
+	// `on_result` is called from the stepping thread, e.g. `lambda: loop.call_soon_threadsafe(event.set)` to await results
+	py::class_<SimulationStepper, std::unique_ptr<SimulationStepper, GilReleasingStepperDelete>>(m, "SimulationStepper")
+		.def(py::init<std::shared_ptr<ISimulation>, double, std::size_t, std::function<void()>>(),
+			 py::arg("simulation"), py::arg("interval_seconds"), py::arg("max_queued") = 64, py::arg("on_result") = nullptr)
+		.def("start", &SimulationStepper::start, py::call_guard<py::gil_scoped_release>())
+		.def("stop", &SimulationStepper::stop, py::call_guard<py::gil_scoped_release>())
+		.def("is_running", &SimulationStepper::is_running)
+		.def("get_queued_count", &SimulationStepper::get_queued_count)
+		.def("pop", &SimulationStepper::pop, py::arg("timeout_seconds") = std::nullopt, py::call_guard<py::gil_scoped_release>());
 
 	py::module_ generic = m.def_submodule("GenericSecurities", "Generic security types");
 
@@ -1730,3 +5687,4 @@ PYBIND11_MODULE(Server, m)
 			 py::arg("currency"),
 			 py::arg("dividend_function"));
 }
+#endif
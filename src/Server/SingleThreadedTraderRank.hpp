@@ -14,6 +14,8 @@
 #include <queue>
 #include <fmt/core.h>
 
+#include "OrderLocator.hpp"
+
 namespace SingleThreadedTraderRank {
 	template<class... Ts> struct overloaded : Ts... { using Ts::operator()...; };
 	template<class... Ts> overloaded(Ts...) -> overloaded<Ts...>;
@@ -85,10 +87,12 @@ namespace SingleThreadedTraderRank {
 		using BidSet = std::set<LimitOrder, LimitOrder::BidComparator>;
 		using AskSet = std::set<LimitOrder, LimitOrder::AskComparator>;
 
+		// The variant index doubles as the side of the order
+		using OrderHandle = std::variant<BidSet::iterator, AskSet::iterator>;
+
 		BidSet bid_orders;
 		AskSet ask_orders;
-		std::map<OrderID, BidSet::iterator> bid_map;
-		std::map<OrderID, AskSet::iterator> ask_map;
+		OrderLocator<OrderHandle> locator;
 	public:
 		std::size_t bid_count() const noexcept {
 			return bid_orders.size();
@@ -99,35 +103,37 @@ namespace SingleThreadedTraderRank {
 		}
 
 		bool has_order(OrderID order_id) const noexcept {
-			return bid_map.find(order_id) != bid_map.end() || ask_map.find(order_id) != ask_map.end();
+			return locator.contains(order_id);
 		}
 
 		bool insert_order(const LimitOrder& order) noexcept {
+			if (locator.contains(order.order_id)) return false;
 			if (order.side == OrderSide::BUY) {
 				auto [it, inserted] = bid_orders.insert(order);
 				if (!inserted) return false;
-				bid_map[order.order_id] = it;
+				locator.insert(order.order_id, OrderHandle(std::in_place_index<0>, it));
 			}
 			else {
 				auto [it, inserted] = ask_orders.insert(order);
 				if (!inserted) return false;
-				ask_map[order.order_id] = it;
+				locator.insert(order.order_id, OrderHandle(std::in_place_index<1>, it));
 			}
 			return true;
 		}
 
 		bool cancel_order(const CancelOrder& cancel) noexcept {
-			if (auto it = bid_map.find(cancel.order_id_to_cancel); it != bid_map.end()) {
-				bid_orders.erase(it->second);
-				bid_map.erase(it);
-				return true;
+			auto handle = locator.find(cancel.order_id_to_cancel);
+			if (handle == nullptr) {
+				return false;
 			}
-			else if (auto it = ask_map.find(cancel.order_id_to_cancel); it != ask_map.end()) {
-				ask_orders.erase(it->second);
-				ask_map.erase(it);
-				return true;
+			if (handle->index() == 0) {
+				bid_orders.erase(std::get<0>(*handle));
+			}
+			else {
+				ask_orders.erase(std::get<1>(*handle));
 			}
-			return false;
+			locator.erase(cancel.order_id_to_cancel);
+			return true;
 		}
 
 		LimitOrder& top_bid() const {
@@ -149,7 +155,7 @@ namespace SingleThreadedTraderRank {
 				throw std::runtime_error("Bid book is empty.");
 			}
 			auto it = bid_orders.begin();
-			bid_map.erase(it->order_id);
+			locator.erase(it->order_id);
 			bid_orders.erase(it);
 		}
 
@@ -158,7 +164,7 @@ namespace SingleThreadedTraderRank {
 				throw std::runtime_error("Ask book is empty.");
 			}
 			auto it = ask_orders.begin();
-			ask_map.erase(it->order_id);
+			locator.erase(it->order_id);
 			ask_orders.erase(it);
 		}
 
@@ -191,16 +197,12 @@ namespace SingleThreadedTraderRank {
 
 		std::set<OrderID> get_all_user_orders(UserID user_id) const noexcept {
 			std::set<OrderID> result = {};
-			for (const auto& [order_id, it] : bid_map) {
-				if (it->user_id == user_id) {
-					result.insert(order_id);
-				}
-			}
-			for (const auto& [order_id, it] : ask_map) {
-				if (it->user_id == user_id) {
-					result.insert(order_id);
+			locator.for_each([&](OrderID order_id, const OrderHandle& handle) {
+				const auto& order = handle.index() == 0 ? *std::get<0>(handle) : *std::get<1>(handle);
+				if (order.user_id == user_id) {
+					result.insert(result.end(), order_id);
 				}
-			}
+			});
 			return result;
 		}
 	};
@@ -0,0 +1,105 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// A fixed set of worker threads that share the iterations of a loop.
+// The thread calling `parallel_for` takes part in the work, so a pool of `thread_count` threads
+// starts `thread_count - 1` workers. Dispatching a loop does not allocate.
+class ThreadPool {
+	std::vector<std::thread> workers = {};
+	std::mutex mutex;
+	std::condition_variable work_ready;
+	std::condition_variable work_done;
+
+	// The loop being run, type erased without allocating
+	void (*invoke)(void*, std::size_t) = nullptr;
+	void* callback = nullptr;
+	std::size_t iteration_count = 0;
+	std::atomic<std::size_t> next_iteration = 0;
+
+	std::size_t busy_workers = 0;
+	uint64_t generation = 0;
+	bool stopping = false;
+
+	void run_iterations() {
+		for (auto i = next_iteration.fetch_add(1); i < iteration_count; i = next_iteration.fetch_add(1)) {
+			invoke(callback, i);
+		}
+	}
+
+	void worker_loop() {
+		uint64_t seen_generation = 0;
+		while (true) {
+			{
+				auto lock = std::unique_lock(mutex);
+				work_ready.wait(lock, [&] { return stopping || generation != seen_generation; });
+				if (stopping) {
+					return;
+				}
+				seen_generation = generation;
+			}
+			run_iterations();
+			{
+				auto lock = std::unique_lock(mutex);
+				busy_workers -= 1;
+				if (busy_workers == 0) {
+					work_done.notify_one();
+				}
+			}
+		}
+	}
+public:
+	explicit ThreadPool(std::size_t thread_count) {
+		for (std::size_t i = 1; i < thread_count; i++) {
+			workers.emplace_back([this] { worker_loop(); });
+		}
+	}
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+	~ThreadPool() {
+		{
+			auto lock = std::unique_lock(mutex);
+			stopping = true;
+		}
+		work_ready.notify_all();
+		for (auto& worker : workers) {
+			worker.join();
+		}
+	}
+
+	std::size_t size() const noexcept {
+		return workers.size() + 1;
+	}
+
+	// Calls `callback(i)` for every `i` in [0, count) spread over the pool, and returns once all calls returned.
+	// `callback` must not throw. Only one loop runs at a time, `parallel_for` must not be called concurrently.
+	template<typename F>
+	void parallel_for(std::size_t count, F&& callback_function) {
+		if (workers.empty() || count <= 1) {
+			for (std::size_t i = 0; i < count; i++) {
+				callback_function(i);
+			}
+			return;
+		}
+		{
+			auto lock = std::unique_lock(mutex);
+			invoke = [](void* function, std::size_t i) { (*static_cast<std::remove_reference_t<F>*>(function))(i); };
+			callback = const_cast<void*>(static_cast<const void*>(&callback_function));
+			iteration_count = count;
+			next_iteration = 0;
+			busy_workers = workers.size();
+			generation += 1;
+		}
+		work_ready.notify_all();
+		run_iterations();
+		auto lock = std::unique_lock(mutex);
+		work_done.wait(lock, [&] { return busy_workers == 0; });
+	}
+};
@@ -0,0 +1,156 @@
+// Steps a simulation on one thread while users are added, orders submitted and books read on others.
+// Every step result must describe the same users in its portfolio table and its usernames.
+// Build with `-fsanitize=thread` to also check the locking.
+#include "Server.cpp"
+#include <cstdio>
+
+// Stands in for the GIL, these tests are built without Python
+static auto interpreter_lock = std::mutex();
+
+// A stock whose hook runs Python, as a `PyISecurity` override or a Python `dividend_function` would
+class InterpretedStock : public GenericSecurities::GenericStock
+{
+public:
+	using GenericStock::GenericStock;
+
+	void before_step(ISimulation &simulation, std::shared_ptr<IPortfolioManager> portfolio) override
+	{
+		auto interpreter = std::lock_guard(interpreter_lock);
+	}
+};
+
+// Adds users from a thread holding the interpreter lock while another thread steps with the hook above.
+// The bindings of calls waiting on the step lock release the GIL, without that the two threads deadlock.
+static int run_interpreter_lock_case()
+{
+	auto securities = std::map<SecurityTicker, std::shared_ptr<ISecurity>>{
+		{"CAD", std::make_shared<GenericSecurities::GenericCurrency>("CAD")},
+		{"STOCK", std::make_shared<InterpretedStock>("STOCK", "CAD")}};
+	auto simulation = std::make_shared<GenericSimulation>(securities, 1.0f, 2000);
+	simulation->set_step_result_options(StepResultOptions::NONE);
+
+	// The adder holds the interpreter lock first, as the Python thread calling `add_user` would
+	auto stepped = std::atomic<bool>(false);
+	auto added = std::atomic<bool>(false);
+	auto users_added = std::atomic<uint32_t>(0);
+	auto adder = std::thread([&]
+	{
+		auto interpreter = std::unique_lock(interpreter_lock);
+		for (uint32_t user = 0; !stepped; user++)
+		{
+			// What `py::call_guard<py::gil_scoped_release>` does around `add_user`
+			interpreter.unlock();
+			simulation->add_user(fmt::format("user{}", user));
+			interpreter.lock();
+			users_added++;
+		}
+		added = true;
+	});
+	while (users_added == 0)
+	{
+		std::this_thread::yield();
+	}
+	auto stepper = std::thread([&]
+	{
+		for (auto has_next_step = true; has_next_step;)
+		{
+			has_next_step = simulation->do_simulation_step_flat().has_next_step;
+		}
+		stepped = true;
+	});
+
+	// A deadlock never ends, give up on it after a while
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+	while (!(stepped && added) && std::chrono::steady_clock::now() < deadline)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	if (!(stepped && added))
+	{
+		std::printf("Adding users while stepping with an interpreted hook deadlocked\n");
+		std::fflush(stdout);
+		std::_Exit(1);
+	}
+	stepper.join();
+	adder.join();
+	return 0;
+}
+
+static int run_concurrent_case()
+{
+	auto securities = std::map<SecurityTicker, std::shared_ptr<ISecurity>>{
+		{"CAD", std::make_shared<GenericSecurities::GenericCurrency>("CAD")},
+		{"STOCK", std::make_shared<GenericSecurities::GenericStock>("STOCK", "CAD")}};
+	auto simulation = std::make_shared<GenericSimulation>(securities, 1.0f, 20000);
+	auto stock_id = simulation->get_security_id("STOCK");
+	simulation->set_step_result_options(StepResultOptions::TRANSACTIONS | StepResultOptions::PORTFOLIOS | StepResultOptions::USERNAMES);
+	for (uint32_t user = 0; user < 4; user++)
+	{
+		simulation->add_user(fmt::format("user{}", user));
+	}
+
+	auto done = std::atomic<bool>(false);
+	auto adder = std::thread([&]
+	{
+		for (uint32_t user = 4; user < 1000 && !done; user++)
+		{
+			simulation->add_user(fmt::format("user{}", user));
+			std::this_thread::sleep_for(std::chrono::microseconds(50));
+		}
+	});
+	auto submitter = std::thread([&]
+	{
+		auto rng = std::mt19937(1);
+		while (!done)
+		{
+			auto side = rng() & 1 ? OrderSide::BID : OrderSide::ASK;
+			auto offset = (rng() % 100) * (side == OrderSide::BID ? -0.01f : 0.01f) + (side == OrderSide::BID ? 0.2f : -0.2f);
+			simulation->submit_limit_order(rng() % 4, stock_id, side, 100.0f + offset, 1.0f + rng() % 5);
+			std::this_thread::sleep_for(std::chrono::microseconds(20));
+		}
+	});
+	auto reader = std::thread([&]
+	{
+		while (!done)
+		{
+			simulation->get_book_depth(stock_id, 5);
+			simulation->get_user_portfolio(0);
+		}
+	});
+
+	// Alternates between the two kinds of step until the end of the simulation
+	auto failures = 0;
+	auto securities_count = simulation->get_securities_count();
+	for (auto has_next_step = true; has_next_step;)
+	{
+		auto result = simulation->do_simulation_step();
+		if (result.portfolios.size() != result.user_id_to_username_map.size())
+		{
+			std::printf("Step %u: %zu portfolios for %zu usernames\n", result.current_step, result.portfolios.size(), result.user_id_to_username_map.size());
+			failures++;
+		}
+		if (!result.has_next_step)
+		{
+			break;
+		}
+		const auto &flat = simulation->do_simulation_step_flat();
+		if (flat.portfolios.size() != std::size_t(flat.user_count) * securities_count)
+		{
+			std::printf("Step %u: %zu portfolio values for %u users\n", flat.current_step, flat.portfolios.size(), flat.user_count);
+			failures++;
+		}
+		has_next_step = flat.has_next_step;
+	}
+	done = true;
+	adder.join();
+	submitter.join();
+	reader.join();
+	return failures;
+}
+
+int main()
+{
+	auto failures = run_concurrent_case() + run_interpreter_lock_case();
+	std::printf("%s\n", failures == 0 ? "passed" : "failed");
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,110 @@
+// Drives order ids through many chunks of an `OrderLocator` and checks that the memory follows the live ids:
+// chunks whose orders are all gone are released, including the newest one once a newer chunk is started, and
+// kept for reuse by a clear.
+#include "OrderLocator.hpp"
+#include <cstdio>
+#include <deque>
+#include <random>
+#include <unordered_map>
+
+static int failures = 0;
+
+static void check(bool condition, const char *message, uint32_t id)
+{
+	if (!condition)
+	{
+		std::printf("%s, at id %u\n", message, id);
+		failures++;
+	}
+}
+
+// Every order lives for `lifetime` ids (0 erases it before the next id), optionally with one order that never leaves
+static void run_window(uint32_t id_count, uint32_t lifetime, bool keep_first)
+{
+	auto locator = OrderLocator<uint32_t>();
+	auto live = std::deque<uint32_t>();
+	std::size_t max_chunks = 0;
+	for (uint32_t id = 0; id < id_count; id++)
+	{
+		locator.insert(id, id);
+		live.push_back(id);
+		if (live.size() > lifetime)
+		{
+			if (!(keep_first && live.front() == 0))
+			{
+				locator.erase(live.front());
+			}
+			live.pop_front();
+		}
+		max_chunks = std::max(max_chunks, locator.chunk_count());
+	}
+	// The window spans at most two chunks, plus the one of the order that stays
+	check(max_chunks <= 2 + std::size_t(keep_first), "Too many chunks for the live window", id_count);
+	check(locator.size() == live.size() + std::size_t(keep_first), "Wrong number of live ids", id_count);
+	check(!keep_first || locator.contains(0), "The first order was lost", 0);
+}
+
+// Random lifetimes, checked against a map of the live ids
+static void run_random(uint32_t id_count)
+{
+	auto locator = OrderLocator<uint32_t>();
+	auto expected = std::unordered_map<uint32_t, uint32_t>();
+	auto live = std::vector<uint32_t>();
+	auto rng = std::mt19937(7);
+	for (uint32_t id = 0; id < id_count; id++)
+	{
+		locator.insert(id, id * 3);
+		expected.emplace(id, id * 3);
+		live.push_back(id);
+		while (live.size() > 1000 || (!live.empty() && rng() % 2 == 0))
+		{
+			auto index = rng() % live.size();
+			check(locator.erase(live[index]), "Could not erase a live id", live[index]);
+			expected.erase(live[index]);
+			live[index] = live.back();
+			live.pop_back();
+		}
+	}
+	for (auto [id, handle] : expected)
+	{
+		auto found = locator.find(id);
+		check(found != nullptr && *found == handle, "A live id is missing", id);
+	}
+	check(locator.size() == expected.size(), "Wrong number of live ids", id_count);
+}
+
+// Ids over several chunks, then a clear: the emptied chunks are kept and reused without their old ids
+static void run_clear()
+{
+	auto locator = OrderLocator<uint32_t>();
+	for (uint32_t id = 0; id < 20'000; id++)
+	{
+		locator.insert(id, id);
+	}
+	auto chunks = locator.chunk_count();
+	locator.clear();
+	check(locator.size() == 0 && locator.chunk_count() == 0, "Ids left after clear", 0);
+	check(locator.spare_chunk_count() == std::min<std::size_t>(chunks, 4), "The chunks were not kept after clear", 0);
+	for (uint32_t id = 0; id < 20'000; id += 2)
+	{
+		check(locator.insert(id, id + 1), "Could not insert an id after clear", id);
+	}
+	for (uint32_t id = 0; id < 20'000; id++)
+	{
+		auto found = locator.find(id);
+		check(id % 2 == 0 ? found != nullptr && *found == id + 1 : found == nullptr, "Stale id after clear", id);
+	}
+	check(locator.size() == 10'000, "Wrong number of live ids after clear", 20'000);
+}
+
+int main()
+{
+	run_window(4'000'000, 0, false);
+	run_window(4'000'000, 0, true);
+	run_window(4'000'000, 100, false);
+	run_window(4'000'000, 100, true);
+	run_random(500'000);
+	run_clear();
+	std::printf("%s\n", failures == 0 ? "passed" : "failed");
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,72 @@
+// Steps simulations at a steady order flow and checks that, once warmed up, a whole `do_simulation_step_flat`
+// makes no heap allocation. Needs `TRADERRANK_COUNT_ALLOCATIONS`, otherwise every count reads 0.
+#include "Server.cpp"
+#include <cstdio>
+#include <deque>
+#include <random>
+
+#ifndef TRADERRANK_COUNT_ALLOCATIONS
+#error "StepAllocationTest must be built with TRADERRANK_COUNT_ALLOCATIONS"
+#endif
+
+static constexpr uint32_t WARM_UP_STEPS = 2000;
+static constexpr uint32_t STEADY_STEPS = 5000;
+
+// Limit orders around 100 that are cancelled after 50 steps, with some market orders, on a book of `tick_size`
+static int run(float tick_size)
+{
+	auto securities = std::map<SecurityTicker, std::shared_ptr<ISecurity>>{
+		{"CAD", std::make_shared<GenericSecurities::GenericCurrency>("CAD")},
+		{"STOCK", std::make_shared<GenericSecurities::GenericStock>("STOCK", "CAD")}};
+	auto simulation = GenericSimulation(securities, 1.0f, WARM_UP_STEPS + STEADY_STEPS);
+	auto stock_id = simulation.get_security_id("STOCK");
+	simulation.set_tick_size(stock_id, tick_size);
+	for (uint32_t user = 0; user < 5; user++)
+	{
+		simulation.add_user(fmt::format("user{}", user));
+	}
+
+	auto rng = std::mt19937(3);
+	auto submitted = std::deque<std::pair<uint32_t, OrderID>>();
+	auto failures = 0;
+	for (uint32_t step = 0; step < WARM_UP_STEPS + STEADY_STEPS; step++)
+	{
+		for (auto i = 0; i < 30; i++)
+		{
+			auto kind = rng() % 10;
+			if (kind < 5)
+			{
+				auto side = rng() & 1 ? OrderSide::BID : OrderSide::ASK;
+				auto price = 100.0f + (static_cast<int>(rng() % 600) - 300) / 100.0f;
+				submitted.emplace_back(step, simulation.submit_limit_order(rng() % 5, stock_id, side, price, 1.0f + rng() % 25));
+			}
+			else if (kind < 9)
+			{
+				while (!submitted.empty() && submitted.front().first + 50 < step)
+				{
+					simulation.submit_cancel_order(0, stock_id, submitted.front().second);
+					submitted.pop_front();
+				}
+			}
+			else
+			{
+				simulation.submit_market_order(rng() % 5, stock_id, rng() & 1 ? OrderAction::BUY : OrderAction::SELL, 1.0f + rng() % 10);
+			}
+		}
+		simulation.do_simulation_step_flat();
+		auto allocations = simulation.get_last_step_allocation_count();
+		if (step >= WARM_UP_STEPS && allocations != 0)
+		{
+			std::printf("Tick size %g, step %u: %llu allocations\n", tick_size, step, static_cast<unsigned long long>(allocations));
+			failures++;
+		}
+	}
+	return failures;
+}
+
+int main()
+{
+	auto failures = run(0.0f) + run(0.01f);
+	std::printf("%s\n", failures == 0 ? "passed" : "failed");
+	return failures == 0 ? 0 : 1;
+}
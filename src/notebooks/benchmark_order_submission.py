@@ -0,0 +1,94 @@
+"""
+Order submission throughput of `GenericSimulation` against the number of submitting threads.
+
+Every thread submits a random mix of limit, market and cancel orders to random securities while a
+stepping thread runs `do_simulation_step` back to back. Submissions only lock the queue of their
+security, so more securities means less contention between the submitting threads.
+
+    python benchmark_order_submission.py [--orders 20000]
+"""
+import argparse
+import threading
+import time
+import numpy as np
+import python_modules.Server as Server
+
+SECURITY_COUNTS = [1, 8, 64]
+THREAD_COUNTS = [1, 2, 4, 8, 16]
+USER_COUNT = 16
+
+
+def make_simulation(security_count: int):
+    securities = {"CAD": Server.GenericSecurities.GenericCurrency("CAD")}
+    for i in range(security_count):
+        securities[f"STOCK{i:03}"] = Server.GenericSecurities.GenericStock(f"STOCK{i:03}", "CAD")
+    simulation = Server.GenericSimulation(securities, 1.0, 1_000_000)
+    for user in range(USER_COUNT):
+        simulation.add_user(f"user{user}")
+    stock_ids = [simulation.get_security_id(ticker) for ticker in securities if ticker != "CAD"]
+    return simulation, stock_ids
+
+
+def submit_orders(simulation, stock_ids, orders: int, seed: int, start: threading.Barrier):
+    rng = np.random.default_rng(seed)
+    # Draw everything up front, so the timed loop is mostly calls into the simulation
+    stocks = rng.choice(stock_ids, size=orders)
+    users = rng.integers(0, USER_COUNT, size=orders)
+    kinds = rng.random(size=orders)
+    sides = rng.random(size=orders) < 0.5
+    prices = np.round(100.0 + rng.normal(0.0, 2.0, size=orders), 2)
+    volumes = rng.integers(1, 25, size=orders).astype(float)
+    open_orders = []
+    start.wait()
+    for i in range(orders):
+        stock_id, user = int(stocks[i]), int(users[i])
+        if kinds[i] < 0.6 and prices[i] > 0:
+            side = Server.OrderSide.BID if sides[i] else Server.OrderSide.ASK
+            open_orders.append((stock_id, simulation.submit_limit_order(user, stock_id, side, prices[i], volumes[i])))
+        elif kinds[i] < 0.8 and open_orders:
+            stock_id, order_id = open_orders.pop()
+            simulation.submit_cancel_order(user, stock_id, order_id)
+        else:
+            action = Server.OrderAction.BUY if sides[i] else Server.OrderAction.SELL
+            simulation.submit_market_order(user, stock_id, action, volumes[i])
+
+
+def run(security_count: int, thread_count: int, orders_per_thread: int) -> float:
+    simulation, stock_ids = make_simulation(security_count)
+    start = threading.Barrier(thread_count + 1)
+    submitters = [threading.Thread(target=submit_orders, args=(simulation, stock_ids, orders_per_thread, seed, start))
+                  for seed in range(thread_count)]
+    for submitter in submitters:
+        submitter.start()
+
+    stop = threading.Event()
+
+    def step():
+        while not stop.is_set():
+            simulation.do_simulation_step()
+
+    stepper = threading.Thread(target=step)
+    stepper.start()
+    start.wait()
+    begin = time.perf_counter()
+    for submitter in submitters:
+        submitter.join()
+    elapsed = time.perf_counter() - begin
+    stop.set()
+    stepper.join()
+    return thread_count * orders_per_thread / elapsed
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--orders", type=int, default=20000, help="orders submitted per thread")
+    args = parser.parse_args()
+
+    print(f"{'securities':>10} " + " ".join(f"{f'{threads} threads':>12}" for threads in THREAD_COUNTS) + "   (thousand orders per second)")
+    for security_count in SECURITY_COUNTS:
+        rates = [run(security_count, threads, args.orders) for threads in THREAD_COUNTS]
+        print(f"{security_count:>10} " + " ".join(f"{rate / 1e3:12.1f}" for rate in rates))
+
+
+if __name__ == "__main__":
+    main()
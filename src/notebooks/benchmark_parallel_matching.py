@@ -0,0 +1,84 @@
+"""
+Step time of `GenericSimulation` against the number of securities and matching threads.
+
+Every security gets a seeded book, then each step queues the same random mix of limit, market
+and cancel orders per security. Only `do_simulation_step` is timed, queueing the orders is not.
+
+    python benchmark_parallel_matching.py [--steps 50] [--orders 500]
+"""
+import argparse
+import time
+import numpy as np
+import python_modules.Server as Server
+
+SECURITY_COUNTS = [1, 4, 16, 64]
+THREAD_COUNTS = [1, 2, 4, 8]
+USER_COUNT = 16
+
+
+def make_simulation(security_count: int, thread_count: int, steps: int, seed: int):
+    securities = {"CAD": Server.GenericSecurities.GenericCurrency("CAD")}
+    for i in range(security_count):
+        securities[f"STOCK{i:03}"] = Server.GenericSecurities.GenericStock(f"STOCK{i:03}", "CAD")
+    simulation = Server.GenericSimulation(securities, 1.0, steps + 1)
+    simulation.set_matching_threads(thread_count)
+    for user in range(USER_COUNT):
+        simulation.add_user(f"user{user}")
+
+    rng = np.random.default_rng(seed)
+    stock_ids = [simulation.get_security_id(ticker) for ticker in securities if ticker != "CAD"]
+    for stock_id in stock_ids:
+        sides = rng.integers(0, 2, size=2000, dtype=np.uint8)
+        offsets = rng.uniform(0.01, 5.0, size=2000)
+        prices = np.round(np.where(sides == 0, 100.0 - offsets, 100.0 + offsets), 2)
+        volumes = rng.integers(1, 25, size=2000).astype(np.float32)
+        simulation.bulk_insert_limit_orders(0, stock_id, sides, prices, volumes)
+    return simulation, stock_ids
+
+
+def queue_orders(simulation, stock_ids, orders_per_security: int, rng, open_orders):
+    for stock_id in stock_ids:
+        for _ in range(orders_per_security):
+            user = int(rng.integers(0, USER_COUNT))
+            kind = rng.random()
+            if kind < 0.6:
+                side = Server.OrderSide.BID if rng.random() < 0.5 else Server.OrderSide.ASK
+                price = round(100.0 + rng.normal(0.0, 2.0), 2)
+                if price > 0:
+                    open_orders[stock_id].append(simulation.submit_limit_order(user, stock_id, side, price, float(rng.integers(1, 25))))
+            elif kind < 0.8 and open_orders[stock_id]:
+                order_id = open_orders[stock_id].pop(int(rng.integers(0, len(open_orders[stock_id]))))
+                simulation.submit_cancel_order(user, stock_id, order_id)
+            else:
+                action = Server.OrderAction.BUY if rng.random() < 0.5 else Server.OrderAction.SELL
+                simulation.submit_market_order(user, stock_id, action, float(rng.integers(1, 40)))
+
+
+def run(security_count: int, thread_count: int, steps: int, orders_per_security: int) -> float:
+    simulation, stock_ids = make_simulation(security_count, thread_count, steps, seed=0)
+    rng = np.random.default_rng(1)
+    open_orders = {stock_id: [] for stock_id in stock_ids}
+    elapsed = 0.0
+    for _ in range(steps):
+        queue_orders(simulation, stock_ids, orders_per_security, rng, open_orders)
+        start = time.perf_counter()
+        simulation.do_simulation_step()
+        elapsed += time.perf_counter() - start
+    return elapsed / steps
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--steps", type=int, default=50)
+    parser.add_argument("--orders", type=int, default=500, help="orders queued per security and step")
+    args = parser.parse_args()
+
+    print(f"{'securities':>10} " + " ".join(f"{f'{threads} threads':>12}" for threads in THREAD_COUNTS) + "   (ms per step, speedup)")
+    for security_count in SECURITY_COUNTS:
+        timings = [run(security_count, threads, args.steps, args.orders) for threads in THREAD_COUNTS]
+        cells = [f"{timing * 1e3:7.2f} {timings[0] / timing:3.1f}x" for timing in timings]
+        print(f"{security_count:>10} " + " ".join(f"{cell:>12}" for cell in cells))
+
+
+if __name__ == "__main__":
+    main()